@@ -0,0 +1,757 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include <SoapySDR/Logger.hpp>
+#include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Time.hpp>
+#include <algorithm> //min, max, find
+#include <climits> //SHRT_MAX, LLONG_MIN
+#include <cmath>
+#include <cstring> //memcpy
+
+#define DEFAULT_CALIBRATE_SAMPLES 65536
+
+//values of a list, commas also separate markup args so spaces and semicolons work too
+static std::vector<std::string> splitList(const std::string &list)
+{
+    std::vector<std::string> values;
+    size_t pos = list.find_first_not_of(" ;,");
+    while (pos != std::string::npos)
+    {
+        size_t end = list.find_first_of(" ;,", pos);
+        if (end == std::string::npos) end = list.size();
+        values.push_back(list.substr(pos, end - pos));
+        pos = list.find_first_not_of(" ;,", end);
+    }
+    return values;
+}
+
+//serials of the array, a dongle can only be opened once
+static std::vector<std::string> splitSerials(const std::string &list)
+{
+    const auto serials = splitList(list);
+    for (size_t i = 0; i < serials.size(); i++)
+    {
+        if (std::find(serials.begin(), serials.begin() + i, serials[i]) != serials.begin() + i)
+        {
+            throw std::runtime_error("RTL-SDR array lists serial " + serials[i] + " more than once");
+        }
+    }
+    return serials;
+}
+
+bool isRTLSDRArray(const SoapySDR::Kwargs &args)
+{
+    return args.count("serial") != 0 and splitList(args.at("serial")).size() > 1;
+}
+
+/*!
+ * Several dongles opened as one device, each dongle is a channel.
+ * The streams are aligned by sample index: output sample n of channel c
+ * is sample n + delay[c] of that dongle. The delays are measured by
+ * cross-correlating the envelope of a burst that every dongle receives.
+ */
+class SoapyRTLSDRArray : public SoapySDR::Device
+{
+public:
+    SoapyRTLSDRArray(const SoapySDR::Kwargs &args):
+        _format(RTL_RX_FORMAT_FLOAT32),
+        _planar(false),
+        _elemSize(0),
+        _pos(LLONG_MIN),
+        _calibrate(0)
+    {
+        for (const auto &serial : splitSerials(args.at("serial")))
+        {
+            SoapySDR::Kwargs devArgs(args);
+            devArgs["serial"] = serial;
+            _devices.push_back(std::unique_ptr<SoapyRTLSDR>(new SoapyRTLSDR(devArgs)));
+        }
+        _delays.assign(_devices.size(), 0);
+        _quality.assign(_devices.size(), 0.0);
+    }
+
+    ~SoapyRTLSDRArray(void)
+    {
+        this->closeStream((SoapySDR::Stream *)this);
+    }
+
+    /*******************************************************************
+     * Identification API
+     ******************************************************************/
+
+    std::string getDriverKey(void) const
+    {
+        return "RTLSDR_ARRAY";
+    }
+
+    std::string getHardwareKey(void) const
+    {
+        return _devices.front()->getHardwareKey();
+    }
+
+    SoapySDR::Kwargs getHardwareInfo(void) const
+    {
+        SoapySDR::Kwargs args;
+        for (size_t i = 0; i < _devices.size(); i++)
+        {
+            for (const auto &pair : _devices[i]->getHardwareInfo())
+            {
+                args[pair.first + std::to_string(i)] = pair.second;
+            }
+        }
+        return args;
+    }
+
+    size_t getNumChannels(const int dir) const
+    {
+        return (dir == SOAPY_SDR_RX) ? _devices.size() : 0;
+    }
+
+    /*******************************************************************
+     * Stream API
+     ******************************************************************/
+
+    std::vector<std::string> getStreamFormats(const int direction, const size_t channel) const
+    {
+        std::vector<std::string> formats;
+        formats.push_back(SOAPY_SDR_CS8);
+        formats.push_back(SOAPY_SDR_CS16);
+        formats.push_back(SOAPY_SDR_CF32);
+        return formats;
+    }
+
+    std::string getNativeStreamFormat(const int direction, const size_t channel, double &fullScale) const
+    {
+        fullScale = 128;
+        return SOAPY_SDR_CS8;
+    }
+
+    SoapySDR::ArgInfoList getStreamArgsInfo(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->getStreamArgsInfo(direction, 0);
+    }
+
+    SoapySDR::Stream *setupStream(const int direction, const std::string &format, const std::vector<size_t> &channels =
+        std::vector<size_t>(), const SoapySDR::Kwargs &args = SoapySDR::Kwargs())
+    {
+        if (direction != SOAPY_SDR_RX) throw std::runtime_error("RTL-SDR is RX only, use SOAPY_SDR_RX");
+        if (not _channels.empty()) throw std::runtime_error("setupStream the RTL-SDR array supports one stream");
+
+        if (format == SOAPY_SDR_CF32) _format = RTL_RX_FORMAT_FLOAT32;
+        else if (format == SOAPY_SDR_CS16) _format = RTL_RX_FORMAT_INT16;
+        else if (format == SOAPY_SDR_CS8) _format = RTL_RX_FORMAT_INT8;
+        else throw std::runtime_error("setupStream invalid format '" + format + "' -- Only CS8, CS16 and CF32 are supported by the RTL-SDR array.");
+
+        //planar channel c writes I to buffs[2c] and Q to buffs[2c+1]
+        _planar = args.count("layout") != 0 and args.at("layout") == "planar";
+        _elemSize = SoapySDR::formatToSize(format) / (_planar ? 2 : 1);
+
+        //every dongle by default, the samples are read raw through the buffer api
+        std::vector<size_t> indexes(channels);
+        if (indexes.empty()) for (size_t i = 0; i < _devices.size(); i++) indexes.push_back(i);
+        for (const auto index : indexes)
+        {
+            if (index >= _devices.size()) throw std::runtime_error("setupStream invalid channel selection");
+            Channel ch = Channel();
+            ch.index = index;
+            ch.device = _devices[index].get();
+            ch.stream = ch.device->setupStream(SOAPY_SDR_RX, SOAPY_SDR_CS8, std::vector<size_t>(), args);
+            ch.head = 0;
+            ch.fill = 0;
+            ch.tick = -1;
+            _channels.push_back(ch);
+        }
+        return (SoapySDR::Stream *)this;
+    }
+
+    void closeStream(SoapySDR::Stream *stream)
+    {
+        for (auto &ch : _channels) ch.device->closeStream(ch.stream);
+        _channels.clear();
+    }
+
+    size_t getStreamMTU(SoapySDR::Stream *stream) const
+    {
+        return _channels.front().device->getStreamMTU(_channels.front().stream);
+    }
+
+    int activateStream(SoapySDR::Stream *stream, const int flags = 0, const long long timeNs = 0, const size_t numElems = 0)
+    {
+        if (flags != 0) return SOAPY_SDR_NOT_SUPPORTED;
+
+        //count every dongle from zero, the start skew between the usb
+        //transfers remains, so the delays must be measured after activation
+        for (auto &ch : _channels)
+        {
+            ch.device->setHardwareTime(0);
+            ch.head = 0;
+            ch.fill = 0;
+            ch.tick = -1;
+        }
+        for (auto &ch : _channels)
+        {
+            const int ret = ch.device->activateStream(ch.stream);
+            if (ret != 0) return ret;
+        }
+        _pos = LLONG_MIN;
+        return 0;
+    }
+
+    int deactivateStream(SoapySDR::Stream *stream, const int flags = 0, const long long timeNs = 0)
+    {
+        if (flags != 0) return SOAPY_SDR_NOT_SUPPORTED;
+        for (auto &ch : _channels) ch.device->deactivateStream(ch.stream);
+        return 0;
+    }
+
+    int readStream(SoapySDR::Stream *stream, void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs = 100000)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto &ch : _channels) ch.delay = _delays[ch.index];
+        }
+
+        int ret = this->align(timeoutUs);
+        if (ret < 0) return ret;
+
+        //every channel has samples from _pos on
+        size_t returnedElems = numElems;
+        for (const auto &ch : _channels) returnedElems = std::min(returnedElems, available(ch));
+
+        //the dongle converts with its own settings, so iq_swap, lo_offset
+        //and the calibration apply per channel
+        for (size_t c = 0; c < _channels.size(); c++)
+        {
+            const Channel &ch = _channels[c];
+            const size_t rails = _planar ? 2 : 1;
+            char *out[2] = {(char *)buffs[c * rails], _planar ? (char *)buffs[c * rails + 1] : nullptr};
+
+            //at most two contiguous runs, the ring wraps on a sample boundary
+            size_t done = 0;
+            while (done < returnedElems)
+            {
+                const size_t offset = (ch.head + done * BYTES_PER_SAMPLE) & (ch.raw.size() - 1);
+                const size_t n = std::min(returnedElems - done, (ch.raw.size() - offset) / BYTES_PER_SAMPLE);
+                void *segment[2] = {out[0] + done * _elemSize, _planar ? out[1] + done * _elemSize : nullptr};
+                ch.device->convertStream(ch.stream, _format, _planar, segment, (const signed char *)ch.raw.data() + offset, n, ch.tick + done);
+                done += n;
+            }
+        }
+        if (_calibrate != 0) this->capture(returnedElems);
+        for (auto &ch : _channels) consume(ch, returnedElems);
+
+        flags = SOAPY_SDR_HAS_TIME;
+        timeNs = SoapySDR::ticksToTimeNs(_pos, this->getSampleRate(SOAPY_SDR_RX, 0));
+        _pos += returnedElems;
+        return returnedElems;
+    }
+
+    /*******************************************************************
+     * Antenna API
+     ******************************************************************/
+
+    std::vector<std::string> listAntennas(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->listAntennas(direction, 0);
+    }
+
+    void setAntenna(const int direction, const size_t channel, const std::string &name)
+    {
+        _devices.at(channel)->setAntenna(direction, 0, name);
+    }
+
+    std::string getAntenna(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->getAntenna(direction, 0);
+    }
+
+    /*******************************************************************
+     * Frontend corrections API
+     ******************************************************************/
+
+    bool hasDCOffsetMode(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->hasDCOffsetMode(direction, 0);
+    }
+
+    bool hasFrequencyCorrection(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->hasFrequencyCorrection(direction, 0);
+    }
+
+    void setFrequencyCorrection(const int direction, const size_t channel, const double value)
+    {
+        _devices.at(channel)->setFrequencyCorrection(direction, 0, value);
+    }
+
+    double getFrequencyCorrection(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->getFrequencyCorrection(direction, 0);
+    }
+
+    /*******************************************************************
+     * Gain API
+     ******************************************************************/
+
+    std::vector<std::string> listGains(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->listGains(direction, 0);
+    }
+
+    bool hasGainMode(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->hasGainMode(direction, 0);
+    }
+
+    void setGainMode(const int direction, const size_t channel, const bool automatic)
+    {
+        _devices.at(channel)->setGainMode(direction, 0, automatic);
+    }
+
+    bool getGainMode(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->getGainMode(direction, 0);
+    }
+
+    void setGain(const int direction, const size_t channel, const double value)
+    {
+        _devices.at(channel)->setGain(direction, 0, value);
+    }
+
+    void setGain(const int direction, const size_t channel, const std::string &name, const double value)
+    {
+        _devices.at(channel)->setGain(direction, 0, name, value);
+    }
+
+    double getGain(const int direction, const size_t channel) const
+    {
+        //the dongle only overrides the named gain, use the overall one of the base
+        return static_cast<const SoapySDR::Device &>(*_devices.at(channel)).getGain(direction, 0);
+    }
+
+    double getGain(const int direction, const size_t channel, const std::string &name) const
+    {
+        return _devices.at(channel)->getGain(direction, 0, name);
+    }
+
+    SoapySDR::Range getGainRange(const int direction, const size_t channel) const
+    {
+        return static_cast<const SoapySDR::Device &>(*_devices.at(channel)).getGainRange(direction, 0);
+    }
+
+    SoapySDR::Range getGainRange(const int direction, const size_t channel, const std::string &name) const
+    {
+        return _devices.at(channel)->getGainRange(direction, 0, name);
+    }
+
+    /*******************************************************************
+     * Frequency API
+     ******************************************************************/
+
+    void setFrequency(const int direction, const size_t channel, const std::string &name, const double frequency,
+        const SoapySDR::Kwargs &args = SoapySDR::Kwargs())
+    {
+        _devices.at(channel)->setFrequency(direction, 0, name, frequency, args);
+    }
+
+    double getFrequency(const int direction, const size_t channel, const std::string &name) const
+    {
+        return _devices.at(channel)->getFrequency(direction, 0, name);
+    }
+
+    std::vector<std::string> listFrequencies(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->listFrequencies(direction, 0);
+    }
+
+    SoapySDR::RangeList getFrequencyRange(const int direction, const size_t channel, const std::string &name) const
+    {
+        return _devices.at(channel)->getFrequencyRange(direction, 0, name);
+    }
+
+    /*******************************************************************
+     * Sample Rate API
+     ******************************************************************/
+
+    //the channels are aligned by sample index, so every dongle runs the same rate
+    void setSampleRate(const int direction, const size_t channel, const double rate)
+    {
+        for (auto &device : _devices) device->setSampleRate(direction, 0, rate);
+    }
+
+    double getSampleRate(const int direction, const size_t channel) const
+    {
+        return _devices.front()->getSampleRate(direction, 0);
+    }
+
+    std::vector<double> listSampleRates(const int direction, const size_t channel) const
+    {
+        return _devices.front()->listSampleRates(direction, 0);
+    }
+
+    SoapySDR::RangeList getSampleRateRange(const int direction, const size_t channel) const
+    {
+        return _devices.front()->getSampleRateRange(direction, 0);
+    }
+
+    void setBandwidth(const int direction, const size_t channel, const double bw)
+    {
+        _devices.at(channel)->setBandwidth(direction, 0, bw);
+    }
+
+    double getBandwidth(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->getBandwidth(direction, 0);
+    }
+
+    std::vector<double> listBandwidths(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->listBandwidths(direction, 0);
+    }
+
+    /*******************************************************************
+     * Settings API
+     ******************************************************************/
+
+    SoapySDR::ArgInfoList getSettingInfo(void) const
+    {
+        SoapySDR::ArgInfoList setArgs;
+
+        SoapySDR::ArgInfo delaysArg;
+        delaysArg.key = "delays";
+        delaysArg.value = "";
+        delaysArg.name = "Channel delays";
+        delaysArg.description = "Samples each dongle is behind the others, one value per channel separated by spaces or semicolons";
+        delaysArg.type = SoapySDR::ArgInfo::STRING;
+        setArgs.push_back(delaysArg);
+
+        SoapySDR::ArgInfo calibrateArg;
+        calibrateArg.key = "calibrate";
+        calibrateArg.value = std::to_string(DEFAULT_CALIBRATE_SAMPLES);
+        calibrateArg.name = "Calibrate delays";
+        calibrateArg.description = "Capture this many samples from the stream and measure the delays on a reference burst, read back the peak to rms ratio per channel";
+        calibrateArg.units = "samples";
+        calibrateArg.type = SoapySDR::ArgInfo::INT;
+        setArgs.push_back(calibrateArg);
+
+        //the dongle settings apply to every channel
+        for (const auto &arg : _devices.front()->getSettingInfo()) setArgs.push_back(arg);
+        return setArgs;
+    }
+
+    SoapySDR::ArgInfoList getSettingInfo(const int direction, const size_t channel) const
+    {
+        return _devices.at(channel)->getSettingInfo();
+    }
+
+    void writeSetting(const std::string &key, const std::string &value)
+    {
+        if (key == "delays")
+        {
+            const auto values = splitList(value);
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (size_t i = 0; i < values.size() and i < _delays.size(); i++)
+            {
+                try
+                {
+                    _delays[i] = std::stoll(values[i]);
+                }
+                catch (const std::invalid_argument &) {
+                    SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR array invalid delay '%s'", values[i].c_str());
+                }
+            }
+        }
+        else if (key == "calibrate")
+        {
+            size_t samples = DEFAULT_CALIBRATE_SAMPLES;
+            try
+            {
+                if (not value.empty()) samples = std::stoul(value);
+            }
+            catch (const std::invalid_argument &) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR array invalid calibration length '%s'", value.c_str());
+            }
+            SoapySDR_logf(SOAPY_SDR_INFO, "RTL-SDR array calibrating delays over the next %zu samples", samples);
+            _calibrate = samples;
+        }
+        else for (auto &device : _devices) device->writeSetting(key, value);
+    }
+
+    void writeSetting(const int direction, const size_t channel, const std::string &key, const std::string &value)
+    {
+        _devices.at(channel)->writeSetting(key, value);
+    }
+
+    std::string readSetting(const std::string &key) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (key == "delays") return join(_delays);
+        if (key == "calibrate") return (_calibrate != 0) ? "" : join(_quality);
+        return _devices.front()->readSetting(key);
+    }
+
+    std::string readSetting(const int direction, const size_t channel, const std::string &key) const
+    {
+        return _devices.at(channel)->readSetting(key);
+    }
+
+private:
+    struct Channel
+    {
+        size_t index;
+        SoapyRTLSDR *device;
+        SoapySDR::Stream *stream;
+        std::vector<unsigned char> raw; //ring of raw samples, a power of two bytes
+        size_t head; //offset of the oldest byte
+        size_t fill; //bytes in the ring
+        long long tick; //tick of the sample at head
+        long long delay;
+        std::vector<float> envelope; //calibration capture
+    };
+
+    static size_t available(const Channel &ch)
+    {
+        return ch.fill / BYTES_PER_SAMPLE;
+    }
+
+    static void consume(Channel &ch, const size_t numElems)
+    {
+        if (numElems == 0) return;
+        ch.head = (ch.head + numElems * BYTES_PER_SAMPLE) & (ch.raw.size() - 1);
+        ch.fill -= numElems * BYTES_PER_SAMPLE;
+        ch.tick += numElems;
+    }
+
+    //raw byte i after the head
+    static unsigned char at(const Channel &ch, const size_t i)
+    {
+        return ch.raw[(ch.head + i) & (ch.raw.size() - 1)];
+    }
+
+    template <typename T>
+    static std::string join(const std::vector<T> &values)
+    {
+        std::string out;
+        for (const auto &value : values)
+        {
+            if (not out.empty()) out += ";";
+            out += std::to_string(value);
+        }
+        return out;
+    }
+
+    //append the next buffer of a dongle, a gap in its ticks restarts the queue
+    int fetch(Channel &ch, const long timeoutUs)
+    {
+        size_t handle;
+        const void *buff = nullptr;
+        int flags = 0;
+        long long timeNs = 0;
+        const int ret = ch.device->acquireReadBuffer(ch.stream, handle, &buff, flags, timeNs, timeoutUs);
+        if (ret < 0) return ret;
+
+        const long long tick = ((SoapyRTLSDRStream *)ch.stream)->bufTicks;
+        if (ch.tick + (long long)available(ch) != tick)
+        {
+            ch.head = 0;
+            ch.fill = 0;
+            ch.tick = tick;
+        }
+
+        //grow only while a channel waits for the others, the queued bytes move once
+        const size_t bytes = ret * BYTES_PER_SAMPLE;
+        if (ch.fill + bytes > ch.raw.size())
+        {
+            size_t size = std::max<size_t>(ch.raw.size(), BYTES_PER_SAMPLE);
+            while (size < ch.fill + bytes) size *= 2;
+            std::vector<unsigned char> raw(size);
+            for (size_t i = 0; i < ch.fill; i++) raw[i] = at(ch, i);
+            ch.raw.swap(raw);
+            ch.head = 0;
+        }
+
+        //one copy into the ring, split where it wraps
+        const unsigned char *in = (const unsigned char *)buff;
+        const size_t tail = (ch.head + ch.fill) & (ch.raw.size() - 1);
+        const size_t first = std::min(bytes, ch.raw.size() - tail);
+        std::memcpy(ch.raw.data() + tail, in, first);
+        std::memcpy(ch.raw.data(), in + first, bytes - first);
+        ch.fill += bytes;
+        ch.device->releaseReadBuffer(ch.stream, handle);
+        return ret;
+    }
+
+    //drop samples until every channel starts at _pos + delay,
+    //a channel that is missing data moves every channel forward
+    int align(const long timeoutUs)
+    {
+        while (true)
+        {
+            long long target = _pos;
+            for (auto &ch : _channels)
+            {
+                while (available(ch) == 0)
+                {
+                    const int ret = this->fetch(ch, timeoutUs);
+                    if (ret < 0) return ret;
+                }
+                target = std::max(target, ch.tick - ch.delay);
+            }
+
+            bool aligned = true;
+            for (auto &ch : _channels)
+            {
+                const long long drop = target + ch.delay - ch.tick;
+                if (drop > 0) consume(ch, std::min<size_t>(drop, available(ch)));
+                //a channel dropped down to nothing fetches again
+                if (ch.tick != target + ch.delay or available(ch) == 0) aligned = false;
+            }
+            _pos = target;
+            if (aligned) return 0;
+        }
+    }
+
+    void capture(const size_t numElems)
+    {
+        const SoapyRTLSDRTables &tables = SoapyRTLSDRTables::get();
+        for (auto &ch : _channels)
+        {
+            for (size_t i = 0; i < numElems and ch.envelope.size() < _calibrate; i++)
+            {
+                ch.envelope.push_back(std::hypot(tables.f32[at(ch, i * 2)], tables.f32[at(ch, i * 2 + 1)]));
+            }
+        }
+        if (_channels.front().envelope.size() < _calibrate) return;
+
+        this->calibrate();
+        for (auto &ch : _channels) ch.envelope.clear();
+        _calibrate = 0;
+    }
+
+    //the envelope ignores the unknown phase of every tuner, the lag of the
+    //cross-correlation peak against the first channel is added to its delay
+    void calibrate(void)
+    {
+        const size_t length = _channels.front().envelope.size();
+        size_t size = 1;
+        while (size < 2 * length) size *= 2;
+        SoapyRTLSDRFFT fft(size);
+
+        auto spectrum = [&](const std::vector<float> &envelope)
+        {
+            double mean = 0.0;
+            for (const auto v : envelope) mean += v;
+            mean /= envelope.size();
+            std::vector<std::complex<float>> out(size, std::complex<float>(0.0f, 0.0f));
+            for (size_t i = 0; i < envelope.size(); i++) out[i] = float(envelope[i] - mean);
+            fft.transform(out.data(), false);
+            return out;
+        };
+
+        const auto ref = spectrum(_channels.front().envelope);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quality[_channels.front().index] = 0.0;
+        for (size_t c = 1; c < _channels.size(); c++)
+        {
+            auto corr = spectrum(_channels[c].envelope);
+            for (size_t k = 0; k < size; k++) corr[k] *= std::conj(ref[k]);
+            fft.transform(corr.data(), true);
+
+            size_t peak = 0;
+            double power = 0.0;
+            for (size_t k = 0; k < size; k++)
+            {
+                power += corr[k].real() * corr[k].real();
+                if (corr[k].real() > corr[peak].real()) peak = k;
+            }
+            const long long lag = (peak < size / 2) ? (long long)peak : (long long)peak - (long long)size;
+            const double quality = corr[peak].real() / std::sqrt(power / size + 1e-30);
+
+            _delays[_channels[c].index] += lag;
+            _quality[_channels[c].index] = quality;
+            SoapySDR_logf(SOAPY_SDR_INFO, "RTL-SDR array channel %zu lag %lld samples (peak/rms %.1f), delay %lld",
+                _channels[c].index, lag, quality, _delays[_channels[c].index]);
+        }
+    }
+
+    std::vector<std::unique_ptr<SoapyRTLSDR>> _devices;
+    std::vector<Channel> _channels; //of the stream
+    rtlsdrRXFormat _format;
+    bool _planar;
+    size_t _elemSize; //bytes of one output sample in each buffer
+    long long _pos; //aligned sample index of the next output
+
+    //the delays are shared with the settings, the capture belongs to the reader
+    mutable std::mutex _mutex;
+    std::vector<long long> _delays;
+    std::vector<double> _quality;
+    std::atomic<size_t> _calibrate;
+};
+
+std::vector<SoapySDR::Kwargs> findRTLSDRArray(const SoapySDR::Kwargs &args)
+{
+    std::vector<SoapySDR::Kwargs> results;
+    std::vector<std::string> serials;
+    try
+    {
+        serials = splitSerials(args.at("serial"));
+    }
+    catch (const std::exception &ex)
+    {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "%s", ex.what());
+        return results;
+    }
+
+    //every dongle must be present, the array is one result
+    char manufact[256], product[256], serial[256];
+    size_t found = 0;
+    for (const auto &wanted : serials)
+    {
+        for (int i = 0; i < int(rtlsdr_get_device_count()); i++)
+        {
+            if (rtlsdr_get_device_usb_strings(i, manufact, product, serial) != 0) continue;
+            if (wanted != serial) continue;
+            found++;
+            break;
+        }
+    }
+    if (found != serials.size())
+    {
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR array found %zu of %zu dongles", found, serials.size());
+        return results;
+    }
+
+    SoapySDR::Kwargs devInfo;
+    devInfo["label"] = "RTL-SDR array :: " + args.at("serial");
+    devInfo["serial"] = args.at("serial");
+    results.push_back(devInfo);
+    return results;
+}
+
+SoapySDR::Device *makeRTLSDRArray(const SoapySDR::Kwargs &args)
+{
+    return new SoapyRTLSDRArray(args);
+}
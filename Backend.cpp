@@ -0,0 +1,177 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+
+SoapyRTLSDRBackend::~SoapyRTLSDRBackend(void)
+{
+    return;
+}
+
+/*******************************************************************
+ * librtlsdr backend
+ ******************************************************************/
+
+SoapyRTLSDRUsbBackend::SoapyRTLSDRUsbBackend(const int deviceId):
+    _dev(nullptr),
+    _cancel(false)
+{
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR opening device %d", deviceId);
+    if (rtlsdr_open(&_dev, deviceId) != 0) {
+        throw std::runtime_error("Unable to open RTL-SDR device");
+    }
+}
+
+SoapyRTLSDRUsbBackend::~SoapyRTLSDRUsbBackend(void)
+{
+    rtlsdr_close(_dev);
+}
+
+rtlsdr_dev_t *SoapyRTLSDRUsbBackend::device(void) const
+{
+    return _dev;
+}
+
+rtlsdr_tuner SoapyRTLSDRUsbBackend::tunerType(void) const
+{
+    return rtlsdr_get_tuner_type(_dev);
+}
+
+std::vector<int> SoapyRTLSDRUsbBackend::tunerGains(void) const
+{
+    std::vector<int> gains;
+    const int num_gains = rtlsdr_get_tuner_gains(_dev, nullptr);
+    if (num_gains <= 0) return gains;
+    gains.resize(num_gains);
+    rtlsdr_get_tuner_gains(_dev, gains.data());
+    return gains;
+}
+
+int SoapyRTLSDRUsbBackend::setFrequency(const uint32_t frequency)
+{
+    return rtlsdr_set_center_freq(_dev, frequency);
+}
+
+uint32_t SoapyRTLSDRUsbBackend::getFrequency(void) const
+{
+    return rtlsdr_get_center_freq(_dev);
+}
+
+int SoapyRTLSDRUsbBackend::setFrequencyCorrection(const int ppm)
+{
+    return rtlsdr_set_freq_correction(_dev, ppm);
+}
+
+int SoapyRTLSDRUsbBackend::getFrequencyCorrection(void) const
+{
+    return rtlsdr_get_freq_correction(_dev);
+}
+
+int SoapyRTLSDRUsbBackend::setSampleRate(const uint32_t rate)
+{
+    return rtlsdr_set_sample_rate(_dev, rate);
+}
+
+uint32_t SoapyRTLSDRUsbBackend::getSampleRate(void) const
+{
+    return rtlsdr_get_sample_rate(_dev);
+}
+
+int SoapyRTLSDRUsbBackend::setBandwidth(const uint32_t bandwidth)
+{
+    return rtlsdr_set_tuner_bandwidth(_dev, bandwidth);
+}
+
+int SoapyRTLSDRUsbBackend::setGainMode(const bool manual)
+{
+    return rtlsdr_set_tuner_gain_mode(_dev, manual ? 1 : 0);
+}
+
+int SoapyRTLSDRUsbBackend::setGain(const int gain)
+{
+    return rtlsdr_set_tuner_gain(_dev, gain);
+}
+
+int SoapyRTLSDRUsbBackend::setIFGain(const int stage, const int gain)
+{
+    return rtlsdr_set_tuner_if_gain(_dev, stage, gain);
+}
+
+int SoapyRTLSDRUsbBackend::setDirectSampling(const int mode)
+{
+    return rtlsdr_set_direct_sampling(_dev, mode);
+}
+
+int SoapyRTLSDRUsbBackend::setOffsetTuning(const bool enable)
+{
+    return rtlsdr_set_offset_tuning(_dev, enable ? 1 : 0);
+}
+
+int SoapyRTLSDRUsbBackend::setAGCMode(const bool enable)
+{
+    return rtlsdr_set_agc_mode(_dev, enable ? 1 : 0);
+}
+
+int SoapyRTLSDRUsbBackend::setTestMode(const bool enable)
+{
+    return rtlsdr_set_testmode(_dev, enable ? 1 : 0);
+}
+
+int SoapyRTLSDRUsbBackend::setBiasTee(const bool enable)
+{
+#if HAS_RTLSDR_SET_BIAS_TEE
+    return rtlsdr_set_bias_tee(_dev, enable ? 1 : 0);
+#else
+    return -1;
+#endif
+}
+
+int SoapyRTLSDRUsbBackend::setDithering(const bool enable)
+{
+#if HAS_RTLSDR_SET_DITHERING
+    return rtlsdr_set_dithering(_dev, enable ? 1 : 0);
+#else
+    return -1;
+#endif
+}
+
+long SoapyRTLSDRUsbBackend::read(unsigned char *buf, const size_t len)
+{
+    if (_cancel) return 0;
+    int n_read = 0;
+    if (rtlsdr_read_sync(_dev, buf, int(len), &n_read) < 0) return -1;
+    return long(n_read);
+}
+
+void SoapyRTLSDRUsbBackend::cancel(void)
+{
+    _cancel = true;
+    rtlsdr_cancel_async(_dev);
+}
+
+void SoapyRTLSDRUsbBackend::reset(void)
+{
+    _cancel = false;
+    rtlsdr_reset_buffer(_dev);
+}
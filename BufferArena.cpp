@@ -0,0 +1,151 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include <cstring>
+#include <cerrno>
+#include <map>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static size_t alignUp(const size_t size, const size_t alignment)
+{
+    return ((size + alignment - 1) / alignment) * alignment;
+}
+
+SoapyRTLSDRArena::SoapyRTLSDRArena(const size_t size, const bool hugepages, const bool lock):
+    _mem(nullptr),
+    _size(0),
+    _mapped(false),
+    _locked(false)
+{
+#ifdef _WIN32
+    _size = alignUp(size, ARENA_ALIGNMENT);
+    _mem = (signed char *)_aligned_malloc(_size, ARENA_ALIGNMENT);
+    if (_mem == nullptr) throw std::runtime_error("SoapyRTLSDRArena allocation failed");
+    if (hugepages or lock) SoapySDR_log(SOAPY_SDR_WARNING, "RTL-SDR arena hugepages and mlock not supported on this platform");
+#else
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    void *mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (hugepages)
+    {
+        _size = alignUp(size, HUGEPAGE_SIZE);
+        mem = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem == MAP_FAILED) SoapySDR_logf(SOAPY_SDR_WARNING,
+            "RTL-SDR arena hugepage allocation of %zu bytes failed: %s", _size, std::strerror(errno));
+    }
+#else
+    if (hugepages) SoapySDR_log(SOAPY_SDR_WARNING, "RTL-SDR arena hugepages not supported on this platform");
+#endif
+
+    //fall back to regular pages, transparent hugepages may still apply
+    if (mem == MAP_FAILED)
+    {
+        _size = alignUp(size, pageSize);
+        mem = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) throw std::runtime_error("SoapyRTLSDRArena mmap failed: " + std::string(std::strerror(errno)));
+#ifdef MADV_HUGEPAGE
+        if (hugepages) madvise(mem, _size, MADV_HUGEPAGE);
+#endif
+    }
+    _mem = (signed char *)mem;
+    _mapped = true;
+
+    if (lock)
+    {
+        _locked = (mlock(_mem, _size) == 0);
+        if (not _locked) SoapySDR_logf(SOAPY_SDR_WARNING,
+            "RTL-SDR arena mlock of %zu bytes failed: %s", _size, std::strerror(errno));
+    }
+#endif
+
+    //touch every page now so the stream does not take page faults
+    std::memset(_mem, 0, _size);
+}
+
+SoapyRTLSDRArena::~SoapyRTLSDRArena(void)
+{
+#ifdef _WIN32
+    _aligned_free(_mem);
+#else
+    if (_locked) munlock(_mem, _size);
+    if (_mapped) munmap(_mem, _size);
+#endif
+}
+
+signed char *SoapyRTLSDRArena::allocate(const size_t size)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const size_t length = alignUp(size, ARENA_ALIGNMENT);
+
+    //first fit between the regions in use
+    size_t offset = 0;
+    for (const auto &region : _regions)
+    {
+        if (region.first - offset >= length) break;
+        offset = region.first + region.second;
+    }
+    if (offset + length > _size) return nullptr;
+
+    _regions[offset] = length;
+    return _mem + offset;
+}
+
+void SoapyRTLSDRArena::release(signed char *ptr)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _regions.erase(size_t(ptr - _mem));
+}
+
+size_t SoapyRTLSDRArena::size(void) const
+{
+    return _size;
+}
+
+std::shared_ptr<SoapyRTLSDRArena> SoapyRTLSDRArena::shared(
+    const std::string &name, const size_t size, const bool hugepages, const bool lock)
+{
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> guard(mutex);
+
+    //the arena lives as long as a stream is using it
+    static std::map<std::string, std::weak_ptr<SoapyRTLSDRArena>> arenas;
+    auto arena = arenas[name].lock();
+    if (not arena)
+    {
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR creating shared arena '%s' of %zu bytes", name.c_str(), size);
+        arena.reset(new SoapyRTLSDRArena(size, hugepages, lock));
+        arenas[name] = arena;
+    }
+    return arena;
+}
@@ -0,0 +1,208 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "SoapyRTLSDR.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <algorithm> //min, max
+#include <fstream>
+#include <cstdio> //rename, snprintf
+#include <cmath>
+
+SoapyRTLSDRCalibration::SoapyRTLSDRCalibration(const double biasI, const double biasQ, const double gain, const double skew):
+    biasI(biasI),
+    biasQ(biasQ),
+    gain(gain),
+    skew(skew)
+{
+    //Q is scaled to the power of I, then the part correlated with I is removed
+    const double phi = skew * M_PI / 180;
+    const double qScale = gain / std::cos(phi), qiScale = -std::tan(phi);
+    for (unsigned int x = 0; x < 256; x++)
+    {
+        i[x] = float((x - biasI) / 128);
+        q[x] = float(qScale * (x - biasQ) / 128);
+        qi[x] = float(qiScale * (x - biasI) / 128);
+    }
+}
+
+SoapyRTLSDRCalibration SoapyRTLSDRCalibration::estimate(const unsigned char *raw, const size_t numElems)
+{
+    //first and second moments of the raw rails, exact in integers
+    unsigned long long sumI = 0, sumQ = 0, sumII = 0, sumQQ = 0, sumIQ = 0;
+    for (size_t n = 0; n < numElems; n++)
+    {
+        const unsigned long long x = raw[n * 2], y = raw[n * 2 + 1];
+        sumI += x;
+        sumQ += y;
+        sumII += x * x;
+        sumQQ += y * y;
+        sumIQ += x * y;
+    }
+    if (numElems == 0) throw std::runtime_error("no samples to calibrate");
+
+    const double count = double(numElems);
+    const double biasI = sumI / count, biasQ = sumQ / count;
+    const double varI = sumII / count - biasI * biasI, varQ = sumQQ / count - biasQ * biasQ;
+    const double cov = sumIQ / count - biasI * biasQ;
+    if (varI < 1.0 or varQ < 1.0) throw std::runtime_error("not enough signal to calibrate");
+
+    //noise has the same power on both rails and no correlation between
+    //them, what remains is the amplitude imbalance and the phase skew
+    const double gain = std::sqrt(varI / varQ);
+    const double skew = std::asin(std::max(-1.0, std::min(1.0, cov / std::sqrt(varI * varQ)))) * 180 / M_PI;
+    return SoapyRTLSDRCalibration(biasI, biasQ, gain, skew);
+}
+
+SoapyRTLSDRCalibration SoapyRTLSDRCalibration::parse(const std::string &value)
+{
+    double fields[4];
+    size_t pos = 0;
+    for (size_t n = 0; n < 4; n++)
+    {
+        const size_t end = value.find(':', pos);
+        if ((n == 3) != (end == std::string::npos)) throw std::runtime_error("expected biasI:biasQ:gain:skew");
+        try
+        {
+            fields[n] = std::stod(value.substr(pos, end - pos));
+        }
+        catch (const std::logic_error &)
+        {
+            throw std::runtime_error("expected biasI:biasQ:gain:skew");
+        }
+        pos = end + 1;
+    }
+
+    //anything further off is a broken dongle or a bad capture
+    if (fields[0] < 0 or fields[0] > 255 or fields[1] < 0 or fields[1] > 255 or
+        fields[2] < 0.5 or fields[2] > 2.0 or std::abs(fields[3]) > 30.0)
+    {
+        throw std::runtime_error("calibration out of range");
+    }
+    return SoapyRTLSDRCalibration(fields[0], fields[1], fields[2], fields[3]);
+}
+
+std::string SoapyRTLSDRCalibration::toString(void) const
+{
+    char buff[128];
+    std::snprintf(buff, sizeof(buff), "%.3f:%.3f:%.5f:%.4f", biasI, biasQ, gain, skew);
+    return buff;
+}
+
+static std::mutex calibrationMutex;
+static std::map<std::string, std::string> calibrations;
+
+//the calibration file is one line per dongle: serial, tab, calibration
+static std::map<std::string, std::string> readCalibrationFile(const std::string &path)
+{
+    std::map<std::string, std::string> saved;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        const size_t pos = line.rfind('\t');
+        if (pos == std::string::npos) continue;
+        saved[line.substr(0, pos)] = line.substr(pos + 1);
+    }
+    return saved;
+}
+
+std::string SoapyRTLSDRCalibration::load(const std::string &file, const std::string &serial)
+{
+    //the process copy is the newest, a cleared calibration is kept as empty
+    std::lock_guard<std::mutex> lock(calibrationMutex);
+    const auto it = calibrations.find(serial);
+    if (it != calibrations.end()) return it->second;
+    if (file.empty()) return "";
+
+    const auto saved = readCalibrationFile(file);
+    const auto entry = saved.find(serial);
+    return (entry == saved.end()) ? "" : entry->second;
+}
+
+void SoapyRTLSDRCalibration::store(const std::string &file, const std::string &serial, const std::string &value)
+{
+    std::lock_guard<std::mutex> lock(calibrationMutex);
+    calibrations[serial] = value;
+    if (file.empty()) return;
+
+    auto saved = readCalibrationFile(file);
+    if (value.empty()) saved.erase(serial);
+    else saved[serial] = value;
+
+    //write a temporary file and rename so readers never see half a file
+    const std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp);
+        for (const auto &entry : saved) out << entry.first << "\t" << entry.second << "\n";
+        if (not out) return;
+    }
+    if (std::rename(tmp.c_str(), file.c_str()) != 0)
+    {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR cannot write calibration file %s", file.c_str());
+    }
+}
+
+void SoapyRTLSDR::setCalibration(const std::string &value)
+{
+    //an empty value goes back to the shared tables
+    std::shared_ptr<const SoapyRTLSDRCalibration> calibration;
+    if (not value.empty()) calibration = std::make_shared<const SoapyRTLSDRCalibration>(SoapyRTLSDRCalibration::parse(value));
+    std::atomic_store(&_calibration, calibration);
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR iq calibration: %s", calibration ? calibration->toString().c_str() : "none");
+}
+
+void SoapyRTLSDR::calibrateIQ(const size_t numElems)
+{
+    //a private stream on the ring, running alongside any other streams;
+    //the raw buffers are used so iq_swap and the current calibration do not apply
+    SoapySDR::Stream *stream = this->setupStream(SOAPY_SDR_RX, SOAPY_SDR_CU8);
+    this->activateStream(stream);
+    std::vector<unsigned char> raw;
+    raw.reserve(numElems * BYTES_PER_SAMPLE);
+    size_t timeouts = 0;
+    while (raw.size() < numElems * BYTES_PER_SAMPLE and timeouts < 10)
+    {
+        size_t handle = 0;
+        const void *buffs[1];
+        int flags = 0;
+        long long timeNs = 0;
+        const int ret = this->acquireReadBuffer(stream, handle, buffs, flags, timeNs);
+        if (ret == SOAPY_SDR_TIMEOUT) timeouts++;
+        if (ret <= 0) continue;
+
+        //overflows leave gaps, which do not matter to the moments
+        const unsigned char *buff = (const unsigned char *)buffs[0];
+        raw.insert(raw.end(), buff, buff + std::min(size_t(ret) * BYTES_PER_SAMPLE, numElems * BYTES_PER_SAMPLE - raw.size()));
+        this->releaseReadBuffer(stream, handle);
+    }
+    this->deactivateStream(stream);
+    this->closeStream(stream);
+    if (raw.size() < numElems * BYTES_PER_SAMPLE) throw std::runtime_error("timeout capturing samples to calibrate");
+
+    const auto calibration = std::make_shared<const SoapyRTLSDRCalibration>(SoapyRTLSDRCalibration::estimate(raw.data(), numElems));
+    std::atomic_store(&_calibration, calibration);
+    SoapyRTLSDRCalibration::store(calibrationFile, calibrationKey, calibration->toString());
+    SoapySDR_logf(SOAPY_SDR_INFO, "RTL-SDR iq calibration %s: %s", calibrationKey.c_str(), calibration->toString().c_str());
+}
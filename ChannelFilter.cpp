@@ -0,0 +1,283 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include <algorithm> //copy, fill
+#include <cmath>
+
+#define FILTER_MIN_FFT_SIZE 64
+
+//plain complex multiply, std::complex operator* handles inf/nan the slow way
+static inline std::complex<float> cmul(const std::complex<float> &a, const std::complex<float> &b)
+{
+    return std::complex<float>(
+        a.real() * b.real() - a.imag() * b.imag(),
+        a.real() * b.imag() + a.imag() * b.real());
+}
+
+SoapyRTLSDRFFT::SoapyRTLSDRFFT(const size_t size):
+    _size(size)
+{
+    //twiddles and the bit reversed order for the in-place transform
+    _twiddles.resize(_size / 2);
+    for (size_t k = 0; k < _twiddles.size(); k++)
+    {
+        _twiddles[k] = std::polar(1.0f, float(-2 * M_PI * k / _size));
+    }
+    _bitrev.resize(_size);
+    size_t bits = 0;
+    while ((size_t(1) << bits) < _size) bits++;
+    for (size_t i = 0; i < _size; i++)
+    {
+        size_t r = 0;
+        for (size_t b = 0; b < bits; b++) if (i & (size_t(1) << b)) r |= size_t(1) << (bits - 1 - b);
+        _bitrev[i] = r;
+    }
+}
+
+size_t SoapyRTLSDRFFT::size(void) const
+{
+    return _size;
+}
+
+void SoapyRTLSDRFFT::transform(std::complex<float> *data, const bool inverse) const
+{
+    for (size_t i = 0; i < _size; i++)
+    {
+        if (i < _bitrev[i]) std::swap(data[i], data[_bitrev[i]]);
+    }
+
+    for (size_t len = 2; len <= _size; len *= 2)
+    {
+        const size_t half = len / 2, stride = _size / len;
+        for (size_t i = 0; i < _size; i += len)
+        {
+            for (size_t k = 0; k < half; k++)
+            {
+                const std::complex<float> &t = _twiddles[k * stride];
+                const std::complex<float> v = cmul(data[i + k + half], inverse ? std::conj(t) : t);
+                const std::complex<float> u = data[i + k];
+                data[i + k] = u + v;
+                data[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+//about four times the taps keeps most of each transform as new output
+static size_t filterSize(const size_t numTaps)
+{
+    size_t size = FILTER_MIN_FFT_SIZE;
+    while (size < 4 * numTaps) size *= 2;
+    return size;
+}
+
+SoapyRTLSDRChannelFilter::SoapyRTLSDRChannelFilter(const std::vector<float> &taps, const double shift, const size_t decim):
+    _numTaps(std::max<size_t>(taps.size(), 1)),
+    _fft(filterSize(_numTaps)),
+    _fftSize(_fft.size()),
+    _blockSize(_fftSize - _numTaps + 1),
+    _fill(0),
+    _shift(shift),
+    _phase(0.0),
+    _decim(std::max<size_t>(decim, 1)),
+    _decimPhase(0)
+{
+    //frequency response with the inverse transform scaling folded in
+    _response.assign(_fftSize, std::complex<float>(0.0f, 0.0f));
+    for (size_t i = 0; i < taps.size(); i++) _response[i] = taps[i] / float(_fftSize);
+    if (taps.empty()) _response[0] = 1.0f / _fftSize;
+    _fft.transform(_response.data(), false);
+
+    _block.resize(_fftSize);
+    _work.resize(_fftSize);
+    this->reset();
+}
+
+std::vector<float> SoapyRTLSDRChannelFilter::lowpass(const size_t numTaps, const double cutoff)
+{
+    //blackman windowed sinc with unity gain at DC
+    std::vector<float> taps(numTaps);
+    const double center = (numTaps - 1) / 2.0;
+    double sum = 0.0;
+    for (size_t n = 0; n < numTaps; n++)
+    {
+        const double x = n - center;
+        const double sinc = (x == 0.0) ? 2 * cutoff : std::sin(2 * M_PI * cutoff * x) / (M_PI * x);
+        const double window = (numTaps == 1) ? 1.0 : 0.42 - 0.5 * std::cos(2 * M_PI * n / (numTaps - 1)) + 0.08 * std::cos(4 * M_PI * n / (numTaps - 1));
+        taps[n] = float(sinc * window);
+        sum += taps[n];
+    }
+    for (auto &tap : taps) tap = float(tap / sum);
+    return taps;
+}
+
+void SoapyRTLSDRChannelFilter::reset(void)
+{
+    std::fill(_block.begin(), _block.end(), std::complex<float>(0.0f, 0.0f));
+    _fill = 0;
+    _phase = 0.0;
+    _decimPhase = 0;
+}
+
+size_t SoapyRTLSDRChannelFilter::decimation(void) const
+{
+    return _decim;
+}
+
+size_t SoapyRTLSDRChannelFilter::delay(void) const
+{
+    return (_numTaps - 1) / 2;
+}
+
+void SoapyRTLSDRChannelFilter::process(const std::complex<float> *in, const size_t numElems, std::vector<std::complex<float>> &out)
+{
+    //the oscillator restarts from the exact phase on every call to bound the drift
+    std::complex<float> rotation = std::polar(1.0f, float(-2 * M_PI * _phase));
+    const std::complex<float> step = std::polar(1.0f, float(-2 * M_PI * _shift));
+    _phase = std::fmod(_phase + _shift * numElems, 1.0);
+
+    for (size_t i = 0; i < numElems; i++)
+    {
+        _block[_numTaps - 1 + _fill++] = (_shift == 0.0) ? in[i] : cmul(in[i], rotation);
+        rotation = cmul(rotation, step);
+        if (_fill == _blockSize) this->runBlock(out);
+    }
+}
+
+void SoapyRTLSDRChannelFilter::runBlock(std::vector<std::complex<float>> &out)
+{
+    //circular convolution of the window, the first taps-1 outputs wrap around
+    std::copy(_block.begin(), _block.end(), _work.begin());
+    _fft.transform(_work.data(), false);
+    for (size_t i = 0; i < _fftSize; i++) _work[i] = cmul(_work[i], _response[i]);
+    _fft.transform(_work.data(), true);
+
+    for (size_t n = _numTaps - 1; n < _fftSize; n++)
+    {
+        if (_decimPhase == 0) out.push_back(_work[n]);
+        if (++_decimPhase == _decim) _decimPhase = 0;
+    }
+
+    //the last taps-1 inputs are the history for the next block
+    std::copy(_block.end() - (_numTaps - 1), _block.end(), _block.begin());
+    _fill = 0;
+}
+
+static unsigned long long gcd(unsigned long long a, unsigned long long b)
+{
+    while (b != 0)
+    {
+        const unsigned long long r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+SoapyRTLSDRResampler::SoapyRTLSDRResampler(const unsigned long long inputRate, const unsigned long long outputRate, const size_t tapsPerPhase)
+{
+    const unsigned long long g = gcd(inputRate, outputRate);
+    _up = outputRate / g;
+    _down = inputRate / g;
+    _numPhases = size_t(std::min<unsigned long long>(_up, RESAMPLER_MAX_PHASES));
+
+    //longer phases when decimating keep the transition band relative to the output rate
+    _numTaps = std::max<size_t>(tapsPerPhase, 1) * size_t((_down + _up - 1) / _up);
+    const double cutoff = RESAMPLER_BANDWIDTH / 2 * std::min(1.0, double(_up) / _down) / _numPhases;
+    const std::vector<float> prototype = SoapyRTLSDRChannelFilter::lowpass(_numTaps * _numPhases + 1, cutoff);
+
+    //phase p is every P-th tap from p with unity gain, the extra phase P
+    //is phase 0 one input later for interpolating past the last phase
+    _bank.resize((_numPhases + 1) * _numTaps);
+    for (size_t p = 0; p <= _numPhases; p++)
+    {
+        for (size_t k = 0; k < _numTaps; k++)
+        {
+            _bank[p * _numTaps + (_numTaps - 1 - k)] = prototype[k * _numPhases + p] * _numPhases;
+        }
+    }
+    this->reset();
+}
+
+void SoapyRTLSDRResampler::reset(void)
+{
+    _history.assign(_numTaps - 1, std::complex<float>(0.0f, 0.0f));
+    _position = (_numTaps - 1) * _up;
+}
+
+double SoapyRTLSDRResampler::delay(void) const
+{
+    return _numTaps / 2.0;
+}
+
+//real taps over interleaved complex samples, the two pairs of
+//partial sums map onto the lanes of the vector unit
+static inline std::complex<float> dotTaps(const float *taps, const std::complex<float> *x, const size_t n)
+{
+    const float *v = (const float *)x;
+    float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    size_t k = 0;
+    for (; k + 2 <= n; k += 2)
+    {
+        acc[0] += taps[k] * v[2 * k];
+        acc[1] += taps[k] * v[2 * k + 1];
+        acc[2] += taps[k + 1] * v[2 * k + 2];
+        acc[3] += taps[k + 1] * v[2 * k + 3];
+    }
+    for (; k < n; k++)
+    {
+        acc[0] += taps[k] * v[2 * k];
+        acc[1] += taps[k] * v[2 * k + 1];
+    }
+    return std::complex<float>(acc[0] + acc[2], acc[1] + acc[3]);
+}
+
+void SoapyRTLSDRResampler::process(const std::complex<float> *in, const size_t numElems, std::vector<std::complex<float>> &out)
+{
+    _history.insert(_history.end(), in, in + numElems);
+    while (_position / _up < _history.size())
+    {
+        //the newest input of the output and the offset past it in 1/up samples
+        const size_t index = size_t(_position / _up);
+        const unsigned long long rest = _position % _up;
+        const std::complex<float> *x = _history.data() + index + 1 - _numTaps;
+        if (_numPhases == _up) out.push_back(dotTaps(_bank.data() + rest * _numTaps, x, _numTaps));
+        else
+        {
+            const double where = double(rest) * _numPhases / _up;
+            const size_t phase = size_t(where);
+            const float frac = float(where - phase);
+            const std::complex<float> a = dotTaps(_bank.data() + phase * _numTaps, x, _numTaps);
+            const std::complex<float> b = dotTaps(_bank.data() + (phase + 1) * _numTaps, x, _numTaps);
+            out.push_back(a + (b - a) * frac);
+        }
+        _position += _down;
+    }
+
+    //keep the inputs the next output still needs
+    const size_t drop = size_t(std::min<unsigned long long>(_position / _up - (_numTaps - 1), _history.size()));
+    _history.erase(_history.begin(), _history.begin() + drop);
+    _position -= drop * _up;
+}
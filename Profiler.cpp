@@ -0,0 +1,142 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "SoapyRTLSDR.hpp"
+#include <algorithm> //sort, min, max
+#include <cstdio> //snprintf
+#include <cmath>
+
+#define PROFILE_BLOCK_SAMPLES 1024
+#define PROFILE_WINDOW_MS 250
+#define PROFILE_MIN_BLOCKS 8
+#define PROFILE_SETTLE_DB 1.0
+#define PROFILE_MAX_RECORDS 1024
+
+static void record(std::vector<double> &values, const double value)
+{
+    values.push_back(value);
+    if (values.size() > PROFILE_MAX_RECORDS) values.erase(values.begin());
+}
+
+void SoapyRTLSDRProfiler::call(const std::string &op, const double durationUs, const unsigned long long tick, const size_t window)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    record(_calls[op], durationUs);
+
+    //samples after this call belong to it, cut the earlier windows short
+    for (const auto &pending : _pending)
+    {
+        if (pending.power.size() >= PROFILE_MIN_BLOCKS) this->finish(pending);
+    }
+    _pending.clear();
+
+    Pending pending;
+    pending.op = op;
+    pending.tick = tick;
+    pending.window = std::max<size_t>(window / PROFILE_BLOCK_SAMPLES, PROFILE_MIN_BLOCKS);
+    pending.sum = 0;
+    pending.fill = 0;
+    _pending.push_back(pending);
+}
+
+void SoapyRTLSDRProfiler::samples(const unsigned char *buf, const size_t len, const unsigned long long tick)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_pending.empty()) return;
+
+    const size_t numElems = len / BYTES_PER_SAMPLE;
+    for (auto it = _pending.begin(); it != _pending.end();)
+    {
+        //blocks start at the tick of the call
+        Pending &pending = *it;
+        for (size_t i = (pending.tick > tick) ? size_t(std::min<unsigned long long>(pending.tick - tick, numElems)) : 0; i < numElems; i++)
+        {
+            const int x = 2 * int(buf[i * 2]) - 255, y = 2 * int(buf[i * 2 + 1]) - 255;
+            pending.sum += (unsigned long long)(x * x + y * y);
+            if (++pending.fill < PROFILE_BLOCK_SAMPLES) continue;
+            pending.power.push_back(double(pending.sum) / pending.fill);
+            pending.sum = 0;
+            pending.fill = 0;
+            if (pending.power.size() == pending.window) break;
+        }
+        if (pending.power.size() < pending.window) ++it;
+        else
+        {
+            this->finish(pending);
+            it = _pending.erase(it);
+        }
+    }
+}
+
+void SoapyRTLSDRProfiler::finish(const Pending &pending)
+{
+    //the reference is the mean power over the last eighth of the window,
+    //the signal settled after the last block that strays from it
+    const size_t tail = std::max<size_t>(pending.power.size() / 8, 1);
+    double reference = 0.0;
+    for (size_t b = pending.power.size() - tail; b < pending.power.size(); b++) reference += pending.power[b];
+    const double referenceDb = 10 * std::log10(reference / tail + 1.0);
+
+    size_t settled = 0;
+    for (size_t b = 0; b < pending.power.size(); b++)
+    {
+        if (std::abs(10 * std::log10(pending.power[b] + 1.0) - referenceDb) > PROFILE_SETTLE_DB) settled = b + 1;
+    }
+    record(_settles[pending.op], double(settled * PROFILE_BLOCK_SAMPLES));
+}
+
+static std::string distribution(std::vector<double> values)
+{
+    if (values.empty()) return "";
+    std::sort(values.begin(), values.end());
+    const double p50 = values[(values.size() - 1) / 2], p90 = values[(values.size() - 1) * 9 / 10];
+    char buff[128];
+    std::snprintf(buff, sizeof(buff), "%.0f/%.0f/%.0f/%.0f", values.front(), p50, p90, values.back());
+    return buff;
+}
+
+std::string SoapyRTLSDRProfiler::report(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::string out;
+    for (const auto &entry : _calls)
+    {
+        if (not out.empty()) out += ",";
+        const auto settles = _settles.find(entry.first);
+        out += entry.first + ":" + std::to_string(entry.second.size()) + ":" + distribution(entry.second) + ":" +
+            ((settles == _settles.end()) ? "" : distribution(settles->second));
+    }
+    return out;
+}
+
+void SoapyRTLSDR::profileSetting(const std::string &op, const std::chrono::steady_clock::time_point &start)
+{
+    const auto profiler = std::atomic_load(&_profiler);
+    if (not profiler) return;
+
+    //the next raw sample is the first one that can show the change
+    const double durationUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    profiler->call(op, durationUs, ticks, size_t(sampleRate) * PROFILE_WINDOW_MS / 1000);
+}
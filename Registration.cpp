@@ -26,36 +26,130 @@
 #include <SoapySDR/Registry.hpp>
 #include <mutex>
 #include <map>
+#include <thread>
+#include <fstream>
+#include <cstdio> //rename
+#include <cstdlib> //getenv
+
+#ifdef __linux__
+#include <dirent.h>
+#endif
 
 //lookup the tuner by opening the device, it's used in the discovery arguments
 //the tuner is cached because the device cannot be opened twice in the same process,
 //and we require that findRTLSDR() yield the same results for SoapySDR device cache.
 //if another process attempts to find an open rtlsdr, it will be marked unavailable
-static std::string get_tuner(const std::string &serial, const size_t deviceIndex)
+static std::mutex tunerMutex;
+static std::map<std::string, std::string> tunerCache;
+
+static bool cached_tuner(const std::string &serial, std::string &tuner)
 {
-    static std::mutex mutex;
-    std::lock_guard<std::mutex> lock(mutex);
+    std::lock_guard<std::mutex> lock(tunerMutex);
+    auto it = tunerCache.find(serial);
+    if (it == tunerCache.end()) return false;
+    tuner = it->second;
+    return true;
+}
 
-    static std::map<std::string, std::string> cache;
-    auto it = cache.find(serial);
-    if (it != cache.end()) return it->second;
+static std::string get_tuner(const std::string &serial, const size_t deviceIndex)
+{
+    std::string tuner;
+    if (cached_tuner(serial, tuner)) return tuner;
 
+    //the open is not locked so that dongles can be probed in parallel
     rtlsdr_dev_t *devTest;
     if (rtlsdr_open(&devTest, deviceIndex) != 0) return "unavailable";
-    const auto tuner = SoapyRTLSDR::rtlTunerToString(rtlsdr_get_tuner_type(devTest));
+    tuner = SoapyRTLSDR::rtlTunerToString(rtlsdr_get_tuner_type(devTest));
     rtlsdr_close(devTest);
-    cache[serial] = tuner;
-    return tuner;
+
+    std::lock_guard<std::mutex> lock(tunerMutex);
+    return tunerCache.emplace(serial, tuner).first->second;
+}
+
+//usb port path of each dongle by its strings, empty when unknown
+static std::multimap<std::string, std::string> usb_paths(void)
+{
+    std::multimap<std::string, std::string> paths;
+#ifdef __linux__
+    DIR *dir = opendir("/sys/bus/usb/devices");
+    if (dir == nullptr) return paths;
+    while (struct dirent *entry = readdir(dir))
+    {
+        //interfaces like 1-1.2:1.0 have no strings of their own
+        const std::string name(entry->d_name);
+        if (name.empty() or name[0] == '.' or name.find(':') != std::string::npos) continue;
+        std::string strings;
+        for (const char *file : {"manufacturer", "product", "serial"})
+        {
+            std::ifstream in("/sys/bus/usb/devices/" + name + "/" + file);
+            std::string line;
+            std::getline(in, line);
+            strings += line + "\t";
+        }
+        paths.emplace(strings, name);
+    }
+    closedir(dir);
+#endif
+    return paths;
+}
+
+//the on-disk cache is one line per dongle: serial, usb path, manufacturer, product, tuner.
+//an entry is only used while all of the strings and the usb path still match,
+//so a moved or replaced dongle is probed again
+static std::map<std::string, std::string> load_tuner_cache(const std::string &path)
+{
+    std::map<std::string, std::string> cache;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        const size_t pos = line.rfind('\t');
+        if (pos == std::string::npos) continue;
+        cache[line.substr(0, pos)] = line.substr(pos + 1);
+    }
+    return cache;
+}
+
+static void save_tuner_cache(const std::string &path, const std::map<std::string, std::string> &cache)
+{
+    //write a temporary file and rename so readers never see half a cache
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp);
+        for (const auto &entry : cache) out << entry.first << "\t" << entry.second << "\n";
+        if (not out) return;
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR cannot write tuner cache %s", path.c_str());
+    }
 }
 
 static std::vector<SoapySDR::Kwargs> findRTLSDR(const SoapySDR::Kwargs &args)
 {
+    //a ring exported by another process, the dongle itself is not touched
+    if (args.count("rtlsdr_shm") != 0) return findRTLSDRShm(args);
+
+    //serial=A;B;C opens the dongles as channels of one device
+    if (isRTLSDRArray(args)) return findRTLSDRArray(args);
+
     std::vector<SoapySDR::Kwargs> results;
 
+    //a remote rtl_tcp server, connecting here would take its only client slot
+    if (args.count("rtltcp") != 0)
+    {
+        SoapySDR::Kwargs devInfo;
+        devInfo["label"] = "rtl_tcp :: " + args.at("rtltcp");
+        devInfo["rtltcp"] = args.at("rtltcp");
+        results.push_back(devInfo);
+        return results;
+    }
+
     char manufact[256], product[256], serial[256];
 
     const size_t this_count = rtlsdr_get_device_count();
 
+    std::vector<std::string> cacheKeys;
     for (size_t i = 0; i < this_count; i++)
     {
         if (rtlsdr_get_device_usb_strings(i, manufact, product, serial) != 0)
@@ -65,24 +159,68 @@ static std::vector<SoapySDR::Kwargs> findRTLSDR(const SoapySDR::Kwargs &args)
         }
         SoapySDR_logf(SOAPY_SDR_DEBUG, "\tManufacturer: %s, Product Name: %s, Serial: %s", manufact, product, serial);
 
+        //filtering by serial
+        if (args.count("serial") != 0 and args.at("serial") != serial) continue;
+
         SoapySDR::Kwargs devInfo;
         devInfo["label"] = std::string(rtlsdr_get_device_name(i)) + " :: " + serial;
         devInfo["product"] = product;
         devInfo["serial"] = serial;
         devInfo["manufacturer"] = manufact;
-        devInfo["tuner"] = get_tuner(serial, i);
+        devInfo["index"] = std::to_string(i);
+        results.push_back(devInfo);
+        cacheKeys.push_back(std::string(manufact) + "\t" + product + "\t" + serial + "\t");
+    }
 
-        //filtering by serial
-        if (args.count("serial") != 0 and args.at("serial") != serial) continue;
+    //optional on-disk tuner cache shared between processes
+    std::string cachePath;
+    if (args.count("tuner_cache") != 0) cachePath = args.at("tuner_cache");
+    else if (const char *env = std::getenv("SOAPY_RTLSDR_TUNER_CACHE")) cachePath = env;
+    std::map<std::string, std::string> diskCache;
+    if (not cachePath.empty())
+    {
+        diskCache = load_tuner_cache(cachePath);
+        const auto paths = usb_paths();
+        for (size_t k = 0; k < results.size(); k++)
+        {
+            //the port path only tells dongles with the same strings apart when it is unique
+            const std::string path = (paths.count(cacheKeys[k]) == 1) ? paths.find(cacheKeys[k])->second : "";
+            cacheKeys[k] = results[k].at("serial") + "\t" + path + "\t" + results[k].at("manufacturer") + "\t" + results[k].at("product");
+            auto it = diskCache.find(cacheKeys[k]);
+            if (it != diskCache.end()) results[k]["tuner"] = it->second;
+        }
+    }
 
-        results.push_back(devInfo);
+    //probe the rest in parallel, every open initializes the tuner over usb
+    std::vector<std::thread> probes;
+    for (auto &devInfo : results)
+    {
+        if (devInfo.count("tuner") != 0) continue;
+        probes.push_back(std::thread([&devInfo](void){
+            devInfo["tuner"] = get_tuner(devInfo.at("serial"), std::stoul(devInfo.at("index")));
+        }));
+    }
+    for (auto &probe : probes) probe.join();
+
+    //dongles open in another process are not cached as unavailable
+    bool changed = false;
+    for (size_t k = 0; k < results.size() and not cachePath.empty(); k++)
+    {
+        const auto &tuner = results[k].at("tuner");
+        auto it = diskCache.find(cacheKeys[k]);
+        if (tuner == "unavailable" or (it != diskCache.end() and it->second == tuner)) continue;
+        diskCache[cacheKeys[k]] = tuner;
+        changed = true;
     }
+    if (changed) save_tuner_cache(cachePath, diskCache);
 
     return results;
 }
 
 static SoapySDR::Device *makeRTLSDR(const SoapySDR::Kwargs &args)
 {
+    if (args.count("rtlsdr_shm") != 0) return makeRTLSDRShm(args);
+    if (isRTLSDRArray(args)) return makeRTLSDRArray(args);
     return new SoapyRTLSDR(args);
 }
 
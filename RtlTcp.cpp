@@ -0,0 +1,1000 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include <cstring>
+#include <cerrno>
+#include <iterator> //begin, end
+#include <algorithm> //min, find_if
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define RTLTCP_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define RTLTCP_SEND_FLAGS 0
+#endif
+
+#define RTLTCP_DEFAULT_PORT "1234"
+#define RTLTCP_RECV_TIMEOUT_US 100000
+#define RTLTCP_RECV_BUFFER (4 * 1024 * 1024)
+#define RTLTCP_HEADER_TRIES 20 //receive timeouts to wait for the header
+#define RTLTCP_MAX_EVENTS 16
+#define RTLTCP_DRAIN_LIMIT (4 * RTLTCP_RECV_BUFFER) //bytes reset() discards at most
+
+//host:port or [ipv6]:port, host and port are left alone when missing
+static void splitAddress(const std::string &address, std::string &host, std::string &port)
+{
+    const size_t bracket = address.find(']');
+    const size_t colon = address.find(':', (bracket == std::string::npos) ? 0 : bracket);
+    if (colon != std::string::npos and address.find(':', colon + 1) == std::string::npos)
+    {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    if (bracket != std::string::npos and host.size() > 1 and host[0] == '[') host = host.substr(1, host.find(']') - 1);
+}
+
+/*******************************************************************
+ * rtl_tcp client
+ ******************************************************************/
+
+SoapyRTLSDRTcpClient::SoapyRTLSDRTcpClient(const std::string &address):
+    _address(address),
+    _sock(-1),
+    _tunerType(RTLSDR_TUNER_UNKNOWN),
+    _gainCount(0),
+    _cancel(false),
+    _received(0),
+    _frequency(0),
+    _sampleRate(0),
+    _ppm(0)
+{
+#ifdef _WIN32
+    throw std::runtime_error("RTL-SDR rtl_tcp client is not supported on this platform");
+#else
+    std::string host = address, port = RTLTCP_DEFAULT_PORT;
+    splitAddress(address, host, port);
+
+    struct addrinfo hints, *res = nullptr;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    const int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (ret != 0) throw std::runtime_error("rtltcp=" + address + ": " + gai_strerror(ret));
+
+    //close and freeaddrinfo may change errno, keep the one of the failed call
+    int error = 0;
+    for (auto ai = res; ai != nullptr and _sock < 0; ai = ai->ai_next)
+    {
+        _sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (_sock < 0)
+        {
+            error = errno;
+            continue;
+        }
+        if (connect(_sock, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        error = errno;
+        close(_sock);
+        _sock = -1;
+    }
+    freeaddrinfo(res);
+    if (_sock < 0) throw std::runtime_error("rtltcp=" + address + ": connect failed: " + std::strerror(error));
+
+    //commands are tiny and should not wait on nagle,
+    //a large receive buffer absorbs scheduling jitter of the rx thread
+    int one = 1, rcvbuf = RTLTCP_RECV_BUFFER;
+    setsockopt(_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef SO_NOSIGPIPE
+    setsockopt(_sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    //the receive timeout lets cancel() interrupt a blocking receive
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = RTLTCP_RECV_TIMEOUT_US;
+    setsockopt(_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    //dongle info header: "RTL0", tuner type and gain count in network order
+    unsigned char header[12];
+    size_t got = 0;
+    for (int i = 0; i < RTLTCP_HEADER_TRIES and got < sizeof(header); i++)
+    {
+        const ssize_t ret = recv(_sock, header + got, sizeof(header) - got, 0);
+        if (ret > 0) got += ret;
+        else if (ret == 0) break;
+    }
+    if (got != sizeof(header) or std::memcmp(header, "RTL0", 4) != 0)
+    {
+        close(_sock);
+        throw std::runtime_error("rtltcp=" + address + ": no rtl_tcp dongle info header");
+    }
+    _tunerType = rtlsdr_tuner((header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7]);
+    _gainCount = (header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11];
+    SoapySDR_logf(SOAPY_SDR_INFO, "Connected to rtl_tcp %s, tuner %s with %zu gains",
+        address.c_str(), SoapyRTLSDR::rtlTunerToString(_tunerType).c_str(), _gainCount);
+#endif
+}
+
+SoapyRTLSDRTcpClient::~SoapyRTLSDRTcpClient(void)
+{
+#ifndef _WIN32
+    close(_sock);
+#endif
+}
+
+const std::string &SoapyRTLSDRTcpClient::address(void) const
+{
+    return _address;
+}
+
+int SoapyRTLSDRTcpClient::fd(void) const
+{
+    return _sock;
+}
+
+rtlsdr_tuner SoapyRTLSDRTcpClient::tunerType(void) const
+{
+    return _tunerType;
+}
+
+std::vector<int> SoapyRTLSDRTcpClient::tunerGains(void) const
+{
+    //rtl_tcp only reports the count, the steps are the librtlsdr tables in tenths of a dB
+    static const int e4k[] = {-10, 15, 40, 65, 90, 115, 140, 165, 190, 215, 240, 290, 340, 420};
+    static const int fc12[] = {-99, -40, 71, 179, 192};
+    static const int fc13[] = {-99, -73, -65, -63, -60, -58, -54, 58, 61, 63, 65, 67,
+        68, 70, 71, 179, 181, 182, 184, 186, 188, 191, 197};
+    static const int fc2580[] = {0};
+    static const int r82xx[] = {0, 9, 14, 27, 37, 77, 87, 125, 144, 157, 166, 197, 207, 229, 254,
+        280, 297, 328, 338, 364, 372, 386, 402, 421, 434, 439, 445, 480, 496};
+
+    std::vector<int> gains;
+    switch (_tunerType)
+    {
+    case RTLSDR_TUNER_E4000: gains.assign(std::begin(e4k), std::end(e4k)); break;
+    case RTLSDR_TUNER_FC0012: gains.assign(std::begin(fc12), std::end(fc12)); break;
+    case RTLSDR_TUNER_FC0013: gains.assign(std::begin(fc13), std::end(fc13)); break;
+    case RTLSDR_TUNER_FC2580: gains.assign(std::begin(fc2580), std::end(fc2580)); break;
+    case RTLSDR_TUNER_R820T:
+    case RTLSDR_TUNER_R828D: gains.assign(std::begin(r82xx), std::end(r82xx)); break;
+    default: break;
+    }
+    if (gains.size() != _gainCount) SoapySDR_logf(SOAPY_SDR_WARNING,
+        "rtl_tcp reports %zu gains, the %s table has %zu", _gainCount, SoapyRTLSDR::rtlTunerToString(_tunerType).c_str(), gains.size());
+    return gains;
+}
+
+int SoapyRTLSDRTcpClient::command(const uint8_t cmd, const uint32_t param)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    const unsigned char msg[5] = {cmd,
+        (unsigned char)(param >> 24), (unsigned char)(param >> 16),
+        (unsigned char)(param >> 8), (unsigned char)(param)};
+
+    //settings and the software agc may send at the same time
+    std::lock_guard<std::mutex> lock(_mutex);
+    const ssize_t ret = send(_sock, msg, sizeof(msg), RTLTCP_SEND_FLAGS);
+    if (ret == sizeof(msg)) return 0;
+    SoapySDR_logf(SOAPY_SDR_ERROR, "rtl_tcp command 0x%02x failed: %s", cmd, std::strerror(errno));
+    return -1;
+#endif
+}
+
+int SoapyRTLSDRTcpClient::setFrequency(const uint32_t frequency)
+{
+    const int r = command(RTLTCP_SET_FREQ, frequency);
+    if (r == 0) _frequency = frequency;
+    return r;
+}
+
+uint32_t SoapyRTLSDRTcpClient::getFrequency(void) const
+{
+    return _frequency;
+}
+
+int SoapyRTLSDRTcpClient::setFrequencyCorrection(const int ppm)
+{
+    const int r = command(RTLTCP_SET_FREQ_CORRECTION, uint32_t(ppm));
+    if (r == 0) _ppm = ppm;
+    return r;
+}
+
+int SoapyRTLSDRTcpClient::getFrequencyCorrection(void) const
+{
+    return _ppm;
+}
+
+int SoapyRTLSDRTcpClient::setSampleRate(const uint32_t rate)
+{
+    const int r = command(RTLTCP_SET_SAMPLE_RATE, rate);
+    if (r == 0) _sampleRate = rate;
+    return r;
+}
+
+uint32_t SoapyRTLSDRTcpClient::getSampleRate(void) const
+{
+    return _sampleRate;
+}
+
+int SoapyRTLSDRTcpClient::setBandwidth(const uint32_t bandwidth)
+{
+    //rtl_tcp has no bandwidth command, the server follows the sample rate
+    return (bandwidth == 0) ? 0 : -1;
+}
+
+int SoapyRTLSDRTcpClient::setGainMode(const bool manual)
+{
+    return command(RTLTCP_SET_GAIN_MODE, manual ? 1 : 0);
+}
+
+int SoapyRTLSDRTcpClient::setGain(const int gain)
+{
+    return command(RTLTCP_SET_GAIN, uint32_t(gain));
+}
+
+int SoapyRTLSDRTcpClient::setIFGain(const int stage, const int gain)
+{
+    return command(RTLTCP_SET_IF_GAIN, (uint32_t(stage) << 16) | (uint32_t(gain) & 0xffff));
+}
+
+int SoapyRTLSDRTcpClient::setDirectSampling(const int mode)
+{
+    return command(RTLTCP_SET_DIRECT_SAMPLING, uint32_t(mode));
+}
+
+int SoapyRTLSDRTcpClient::setOffsetTuning(const bool enable)
+{
+    return command(RTLTCP_SET_OFFSET_TUNING, enable ? 1 : 0);
+}
+
+int SoapyRTLSDRTcpClient::setAGCMode(const bool enable)
+{
+    return command(RTLTCP_SET_AGC_MODE, enable ? 1 : 0);
+}
+
+int SoapyRTLSDRTcpClient::setTestMode(const bool enable)
+{
+    return command(RTLTCP_SET_TEST_MODE, enable ? 1 : 0);
+}
+
+int SoapyRTLSDRTcpClient::setBiasTee(const bool enable)
+{
+    return command(RTLTCP_SET_BIAS_TEE, enable ? 1 : 0);
+}
+
+int SoapyRTLSDRTcpClient::setDithering(const bool enable)
+{
+    //not part of the rtl_tcp protocol
+    return -1;
+}
+
+long SoapyRTLSDRTcpClient::read(unsigned char *buf, const size_t len)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    if (_cancel) return 0;
+
+    size_t got = 0;
+    while (got < len)
+    {
+        //one call fills the whole buffer unless the timeout expires
+        const ssize_t ret = recv(_sock, buf + got, len - got, MSG_WAITALL);
+        if (ret > 0) got += ret;
+        else if (ret == 0) return -1;
+        else if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR) return -1;
+
+        //only stop on a whole sample so the stream stays aligned
+        if (_cancel and got % BYTES_PER_SAMPLE == 0) break;
+    }
+    _received += got;
+    return long(got);
+#endif
+}
+
+long SoapyRTLSDRTcpClient::receiveSome(unsigned char *buf, const size_t len)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    const ssize_t ret = recv(_sock, buf, len, MSG_DONTWAIT);
+    if (ret > 0)
+    {
+        _received += ret;
+        return long(ret);
+    }
+    if (ret == 0) return -1;
+    return (errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR) ? 0 : -1;
+#endif
+}
+
+void SoapyRTLSDRTcpClient::cancel(void)
+{
+    _cancel = true;
+}
+
+void SoapyRTLSDRTcpClient::reset(void)
+{
+    _cancel = false;
+#ifndef _WIN32
+    //the server kept streaming into the socket while nobody was reading
+    unsigned char scratch[16384];
+    size_t drained = 0;
+    while (drained < RTLTCP_DRAIN_LIMIT)
+    {
+        const ssize_t ret = recv(_sock, scratch, sizeof(scratch), MSG_DONTWAIT);
+        if (ret <= 0) break;
+        _received += ret;
+        drained += ret;
+    }
+
+    //realign on a whole sample, the next byte is on its way
+    while (_received % BYTES_PER_SAMPLE != 0)
+    {
+        const ssize_t ret = recv(_sock, scratch, 1, 0);
+        if (ret > 0) _received += ret;
+        else if (ret == 0 or (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR)) break;
+    }
+    if (drained != 0) SoapySDR_logf(SOAPY_SDR_DEBUG, "rtl_tcp %s dropped %zu stale bytes", _address.c_str(), drained);
+#endif
+}
+
+/*******************************************************************
+ * rtl_tcp stream
+ ******************************************************************/
+
+void SoapyRTLSDR::rx_tcp_operation(void)
+{
+    std::vector<unsigned char> scratch(bufferLength);
+    while (true)
+    {
+        //receive straight into the next ring slot,
+        //the squelch gate and a full ring go through the callback path
+        size_t index = 0;
+        const bool direct = not squelchEnabled and reserveBuffer(index);
+        unsigned char *buf = direct ? (unsigned char *)_buffs[index].data : scratch.data();
+
+        const long len = _tcp->read(buf, bufferLength);
+        if (len < 0)
+        {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "rtl_tcp %s disconnected", _tcp->address().c_str());
+            return;
+        }
+        if (len == 0) return; //cancelled
+
+        if (not direct) rx_callback(buf, len);
+        else dispatchBuffer(buf, len, index);
+    }
+}
+
+bool SoapyRTLSDR::rx_tcp_ready(void)
+{
+    //at most one buffer per wakeup so every device on the engine gets a turn,
+    //the socket stays readable for the rest
+    while (true)
+    {
+        const long len = _tcp->receiveSome(_tcpScratch.data() + _tcpFill, bufferLength - _tcpFill);
+        if (len < 0)
+        {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "rtl_tcp %s disconnected", _tcp->address().c_str());
+            return false;
+        }
+        if (len == 0) return true;
+
+        _tcpFill += len;
+        if (_tcpFill < bufferLength) continue;
+        rx_callback(_tcpScratch.data(), bufferLength);
+        _tcpFill = 0;
+        return true;
+    }
+}
+
+/*******************************************************************
+ * shared rtl_tcp receive engine
+ ******************************************************************/
+
+SoapyRTLSDRTcpEngine::SoapyRTLSDRTcpEngine(void):
+    _poll(-1),
+    _done(false),
+    _busy(nullptr)
+{
+    _wake[0] = _wake[1] = -1;
+}
+
+SoapyRTLSDRTcpEngine::~SoapyRTLSDRTcpEngine(void)
+{
+#ifndef _WIN32
+    if (_wake[0] >= 0) close(_wake[0]);
+    if (_wake[1] >= 0 and _wake[1] != _wake[0]) close(_wake[1]);
+    if (_poll >= 0) close(_poll);
+#endif
+}
+
+SoapyRTLSDRTcpEngine &SoapyRTLSDRTcpEngine::instance(void)
+{
+    static SoapyRTLSDRTcpEngine engine;
+    return engine;
+}
+
+void SoapyRTLSDRTcpEngine::attach(SoapyRTLSDR *device, const int fd)
+{
+#ifdef _WIN32
+    throw std::runtime_error("RTL-SDR rtltcp_engine=shared is not supported on this platform");
+#else
+    auto &engine = instance();
+    std::lock_guard<std::mutex> lifecycle(engine._lifecycle);
+
+    //the wakeup and the poll set outlive the thread
+    if (engine._wake[0] < 0)
+    {
+#ifdef __linux__
+        engine._wake[0] = engine._wake[1] = eventfd(0, EFD_NONBLOCK);
+        engine._poll = epoll_create1(0);
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = engine._wake[0];
+        epoll_ctl(engine._poll, EPOLL_CTL_ADD, engine._wake[0], &ev);
+#else
+        if (pipe(engine._wake) != 0) throw std::runtime_error("rtltcp_engine pipe failed: " + std::string(std::strerror(errno)));
+        fcntl(engine._wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(engine._wake[1], F_SETFL, O_NONBLOCK);
+#endif
+    }
+
+    {
+    std::lock_guard<std::mutex> lock(engine._mutex);
+    engine._devices.push_back(std::make_pair(fd, device));
+#ifdef __linux__
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(engine._poll, EPOLL_CTL_ADD, fd, &ev);
+#endif
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR shared rtl_tcp engine serving %zu devices", engine._devices.size());
+    }
+    engine.wake();
+
+    if (not engine._thread.joinable())
+    {
+        engine._done = false;
+        engine._thread = std::thread(&SoapyRTLSDRTcpEngine::serve, &engine);
+    }
+#endif
+}
+
+void SoapyRTLSDRTcpEngine::detach(SoapyRTLSDR *device)
+{
+#ifndef _WIN32
+    auto &engine = instance();
+    std::lock_guard<std::mutex> lifecycle(engine._lifecycle);
+
+    bool stop = false;
+    {
+    std::unique_lock<std::mutex> lock(engine._mutex);
+    for (auto it = engine._devices.begin(); it != engine._devices.end();)
+    {
+        if (it->second != device) ++it;
+        else
+        {
+#ifdef __linux__
+            epoll_ctl(engine._poll, EPOLL_CTL_DEL, it->first, nullptr);
+#endif
+            it = engine._devices.erase(it);
+        }
+    }
+    engine._cond.wait(lock, [&engine, device](void){return engine._busy != device;});
+    stop = engine._devices.empty();
+    if (stop) engine._done = true;
+    }
+
+    //the last device out stops the thread
+    if (stop and engine._thread.joinable())
+    {
+        engine.wake();
+        engine._thread.join();
+    }
+#endif
+}
+
+void SoapyRTLSDRTcpEngine::wake(void)
+{
+#ifndef _WIN32
+    //a full counter or pipe already means a pending wakeup
+    const uint64_t one = 1;
+    if (write(_wake[1], &one, sizeof(one)) < 0) return;
+#endif
+}
+
+void SoapyRTLSDRTcpEngine::serve(void)
+{
+#ifndef _WIN32
+    std::vector<int> ready;
+    while (true)
+    {
+        ready.clear();
+#ifdef __linux__
+        struct epoll_event events[RTLTCP_MAX_EVENTS];
+        const int n = epoll_wait(_poll, events, RTLTCP_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) ready.push_back(events[i].data.fd);
+#else
+        std::vector<struct pollfd> fds(1);
+        fds[0].fd = _wake[0];
+        fds[0].events = POLLIN;
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (const auto &entry : _devices)
+        {
+            struct pollfd pfd;
+            pfd.fd = entry.first;
+            pfd.events = POLLIN;
+            fds.push_back(pfd);
+        }
+        }
+        if (poll(fds.data(), fds.size(), -1) > 0) for (const auto &pfd : fds)
+        {
+            if (pfd.revents != 0) ready.push_back(pfd.fd);
+        }
+#endif
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_done) return;
+        for (const int fd : ready)
+        {
+            if (fd == _wake[0])
+            {
+                uint64_t count;
+                while (read(_wake[0], &count, sizeof(count)) > 0){}
+                continue;
+            }
+
+            //a device detached since the wait is not in the list anymore
+            auto it = std::find_if(_devices.begin(), _devices.end(), [fd](const std::pair<int, SoapyRTLSDR *> &e){return e.first == fd;});
+            if (it == _devices.end()) continue;
+            SoapyRTLSDR *device = it->second;
+
+            //receive without the lock, detach waits for the device to be released
+            _busy = device;
+            lock.unlock();
+            const bool connected = device->rx_tcp_ready();
+            lock.lock();
+            _busy = nullptr;
+            _cond.notify_all();
+
+            if (connected) continue;
+            it = std::find_if(_devices.begin(), _devices.end(), [fd](const std::pair<int, SoapyRTLSDR *> &e){return e.first == fd;});
+            if (it == _devices.end()) continue;
+#ifdef __linux__
+            epoll_ctl(_poll, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+            _devices.erase(it);
+        }
+    }
+#endif
+}
+
+/*******************************************************************
+ * rtl_tcp server
+ ******************************************************************/
+
+SoapyRTLSDRTcpServer::SoapyRTLSDRTcpServer(const std::string &address, const size_t queueBytes,
+    const rtlsdr_tuner tunerType, const size_t gainCount):
+    _address(address),
+    _listen(-1),
+    _poll(-1),
+    _ring(queueBytes),
+    _written(0),
+    _done(false)
+{
+#ifdef _WIN32
+    throw std::runtime_error("RTL-SDR rtl_tcp server is not supported on this platform");
+#else
+    _wake[0] = _wake[1] = -1;
+
+    //a bare port listens on every interface
+    std::string host, port = address;
+    if (address.find(':') != std::string::npos) splitAddress(address, host, port);
+
+    struct addrinfo hints, *res = nullptr;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    const int ret = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+    if (ret != 0) throw std::runtime_error("rtltcp_server=" + address + ": " + gai_strerror(ret));
+
+    //close and freeaddrinfo may change errno, keep the one of the failed call
+    int error = 0;
+    for (auto ai = res; ai != nullptr and _listen < 0; ai = ai->ai_next)
+    {
+        _listen = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (_listen < 0)
+        {
+            error = errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(_listen, ai->ai_addr, ai->ai_addrlen) == 0 and listen(_listen, SOMAXCONN) == 0) break;
+        error = errno;
+        close(_listen);
+        _listen = -1;
+    }
+    freeaddrinfo(res);
+    if (_listen < 0) throw std::runtime_error("rtltcp_server=" + address + ": listen failed: " + std::strerror(error));
+    fcntl(_listen, F_SETFL, O_NONBLOCK);
+
+    //the rx thread wakes the server through a non-blocking counter or pipe
+#ifdef __linux__
+    _wake[0] = _wake[1] = eventfd(0, EFD_NONBLOCK);
+    _poll = epoll_create1(0);
+    this->watch(_listen, false, true);
+    this->watch(_wake[0], false, true);
+#else
+    if (pipe(_wake) != 0) throw std::runtime_error("rtltcp_server pipe failed: " + std::string(std::strerror(errno)));
+    fcntl(_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    //dongle info header sent to every client
+    std::memcpy(_header, "RTL0", 4);
+    const uint32_t info[2] = {uint32_t(tunerType), uint32_t(gainCount)};
+    for (size_t i = 0; i < 8; i++) _header[4 + i] = (unsigned char)(info[i / 4] >> (24 - 8 * (i % 4)));
+
+    _thread = std::thread(&SoapyRTLSDRTcpServer::serve, this);
+    SoapySDR_logf(SOAPY_SDR_INFO, "RTL-SDR serving rtl_tcp on %s with a %zu byte queue", address.c_str(), queueBytes);
+#endif
+}
+
+SoapyRTLSDRTcpServer::~SoapyRTLSDRTcpServer(void)
+{
+#ifndef _WIN32
+    _done = true;
+    this->wake();
+    _thread.join();
+    for (const auto &client : _clients) close(client.fd);
+    close(_listen);
+    close(_wake[0]);
+    if (_wake[1] != _wake[0]) close(_wake[1]);
+    if (_poll >= 0) close(_poll);
+#endif
+}
+
+//push writes the ring without the ring mutex that serve sends under:
+//trim keeps every client within half the queue, so a buffer of at most
+//half the queue never overwrites bytes a send is reading. tcpQueueSizing
+//makes the queue at least two buffers, a larger buffer takes the lock.
+//resize only runs while the rx side is stopped.
+void SoapyRTLSDRTcpServer::push(const unsigned char *buf, const size_t len)
+{
+    std::unique_lock<std::mutex> lock(_ringMutex, std::defer_lock);
+    if (len > _ring.size() / 2) lock.lock();
+
+    //keep the newest bytes when a buffer is larger than the whole queue
+    const size_t capacity = _ring.size();
+    const size_t skip = (len > capacity) ? len - capacity : 0;
+    unsigned long long written = _written.load(std::memory_order_relaxed) + skip;
+
+    const size_t pos = written % capacity;
+    const size_t first = std::min(len - skip, capacity - pos);
+    std::memcpy(_ring.data() + pos, buf + skip, first);
+    std::memcpy(_ring.data(), buf + skip + first, len - skip - first);
+
+    _written.store(written + len - skip, std::memory_order_release);
+    this->wake();
+}
+
+void SoapyRTLSDRTcpServer::resize(const size_t queueBytes)
+{
+    std::lock_guard<std::mutex> lock(_ringMutex);
+    if (queueBytes == _ring.size()) return;
+
+    //the newest bytes keep their stream positions so the client cursors stay valid
+    std::vector<unsigned char> ring(queueBytes);
+    const unsigned long long written = _written.load(std::memory_order_acquire);
+    const size_t keep = size_t(std::min<unsigned long long>(written, std::min(_ring.size(), queueBytes)));
+    for (unsigned long long n = written - keep; n < written; n++) ring[n % queueBytes] = _ring[n % _ring.size()];
+    _ring.swap(ring);
+
+    //a client behind the kept bytes skips to the newest data like in trim()
+    std::lock_guard<std::mutex> clientsLock(_mutex);
+    for (auto &client : _clients)
+    {
+        if (written - client.cursor <= keep) continue;
+        const unsigned long long cursor = written - (written - client.cursor) % BYTES_PER_SAMPLE;
+        client.dropped += cursor - client.cursor;
+        client.cursor = cursor;
+    }
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR rtl_tcp %s queue resized to %zu bytes", _address.c_str(), queueBytes);
+}
+
+size_t SoapyRTLSDRTcpServer::queueBytes(void) const
+{
+    return _ring.size();
+}
+
+std::string SoapyRTLSDRTcpServer::clients(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::string result;
+    for (const auto &client : _clients)
+    {
+        if (not result.empty()) result += ",";
+        result += client.peer + ":" + std::to_string(client.sent) + ":" + std::to_string(client.dropped);
+    }
+    return result;
+}
+
+void SoapyRTLSDRTcpServer::wake(void)
+{
+#ifndef _WIN32
+    //a full counter or pipe already means a pending wakeup
+    const uint64_t one = 1;
+    if (write(_wake[1], &one, sizeof(one)) < 0) return;
+#endif
+}
+
+void SoapyRTLSDRTcpServer::watch(const int fd, const bool writable, const bool add)
+{
+#ifdef __linux__
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = writable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(_poll, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#endif
+}
+
+void SoapyRTLSDRTcpServer::serve(void)
+{
+#ifndef _WIN32
+    std::vector<std::pair<int, int>> ready; //fd, 1 readable | 2 writable
+    while (not _done)
+    {
+        ready.clear();
+#ifdef __linux__
+        struct epoll_event events[RTLTCP_MAX_EVENTS];
+        const int n = epoll_wait(_poll, events, RTLTCP_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++)
+        {
+            const int fd = events[i].data.fd;
+            ready.push_back(std::make_pair(fd,
+                ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? 1 : 0) | ((events[i].events & EPOLLOUT) ? 2 : 0)));
+        }
+#else
+        std::vector<struct pollfd> fds(2);
+        fds[0].fd = _listen;
+        fds[0].events = POLLIN;
+        fds[1].fd = _wake[0];
+        fds[1].events = POLLIN;
+        for (const auto &client : _clients)
+        {
+            struct pollfd pfd;
+            pfd.fd = client.fd;
+            pfd.events = POLLIN | (client.blocked ? POLLOUT : 0);
+            fds.push_back(pfd);
+        }
+        if (poll(fds.data(), fds.size(), -1) > 0) for (const auto &pfd : fds)
+        {
+            if (pfd.revents != 0) ready.push_back(std::make_pair(pfd.fd,
+                ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0) | ((pfd.revents & POLLOUT) ? 2 : 0)));
+        }
+#endif
+
+        std::lock_guard<std::mutex> ringLock(_ringMutex);
+        for (const auto &event : ready)
+        {
+            if (event.first == _listen) this->accept();
+            else if (event.first == _wake[0])
+            {
+                uint64_t count;
+                while (read(_wake[0], &count, sizeof(count)) > 0){}
+            }
+            else
+            {
+                auto it = std::find_if(_clients.begin(), _clients.end(), [&event](const Client &c){return c.fd == event.first;});
+                if (it == _clients.end()) continue;
+                if ((event.second & 2) != 0 and it->blocked)
+                {
+                    it->blocked = false;
+                    this->watch(it->fd, false, false);
+                }
+                if ((event.second & 1) != 0 and not this->receive(*it)) this->disconnect(it);
+            }
+        }
+
+        //send to every client that is not waiting on a full socket
+        for (auto it = _clients.begin(); it != _clients.end();)
+        {
+            this->trim(*it);
+            if (it->blocked) ++it;
+            else if (this->send(*it)) ++it;
+            else it = this->disconnect(it);
+        }
+    }
+#endif
+}
+
+void SoapyRTLSDRTcpServer::accept(void)
+{
+#ifndef _WIN32
+    while (true)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof(addr);
+        const int fd = ::accept(_listen, (struct sockaddr *)&addr, &addrLen);
+        if (fd < 0) return;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+        char host[NI_MAXHOST], serv[NI_MAXSERV];
+        Client client;
+        client.fd = fd;
+        if (getnameinfo((struct sockaddr *)&addr, addrLen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        {
+            client.peer = std::string(host) + ":" + serv;
+        }
+        client.header = sizeof(_header);
+        client.cursor = _written.load(std::memory_order_acquire);
+        client.sent = 0;
+        client.dropped = 0;
+        client.blocked = false;
+        client.commands = 0;
+        this->watch(fd, false, true);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _clients.push_back(client);
+        SoapySDR_logf(SOAPY_SDR_INFO, "rtl_tcp client %s connected", client.peer.c_str());
+    }
+#endif
+}
+
+bool SoapyRTLSDRTcpServer::receive(Client &client)
+{
+#ifdef _WIN32
+    return false;
+#else
+    //clients are read-only, commands are drained and ignored
+    unsigned char buf[256];
+    while (true)
+    {
+        const ssize_t ret = recv(client.fd, buf, sizeof(buf), 0);
+        if (ret == 0) return false;
+        if (ret < 0) return errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR;
+        if (client.commands == 0) SoapySDR_logf(SOAPY_SDR_DEBUG, "rtl_tcp client %s is read-only, ignoring commands", client.peer.c_str());
+        client.commands += ret;
+    }
+#endif
+}
+
+void SoapyRTLSDRTcpServer::trim(Client &client)
+{
+    //a client more than half the queue behind skips to the newest data,
+    //the other half is margin for the rx thread while a send is in progress
+    const unsigned long long written = _written.load(std::memory_order_acquire);
+    if (written - client.cursor <= _ring.size() / 2) return;
+    //a partial send may have left half a sample, keep the client aligned
+    const unsigned long long cursor = written - (written - client.cursor) % BYTES_PER_SAMPLE;
+    std::lock_guard<std::mutex> lock(_mutex);
+    client.dropped += cursor - client.cursor;
+    client.cursor = cursor;
+}
+
+bool SoapyRTLSDRTcpServer::send(Client &client)
+{
+#ifdef _WIN32
+    return false;
+#else
+    this->trim(client);
+    const size_t capacity = _ring.size();
+    const unsigned long long written = _written.load(std::memory_order_acquire);
+    const size_t backlog = written - client.cursor;
+    if (backlog == 0 and client.header == 0) return true;
+
+    //header, then the queued bytes in up to two pieces around the wrap
+    struct iovec iov[3];
+    int iovcnt = 0;
+    if (client.header != 0)
+    {
+        iov[iovcnt].iov_base = _header + sizeof(_header) - client.header;
+        iov[iovcnt++].iov_len = client.header;
+    }
+    const size_t pos = client.cursor % capacity;
+    const size_t first = std::min(backlog, capacity - pos);
+    if (first != 0)
+    {
+        iov[iovcnt].iov_base = _ring.data() + pos;
+        iov[iovcnt++].iov_len = first;
+    }
+    if (backlog > first)
+    {
+        iov[iovcnt].iov_base = _ring.data();
+        iov[iovcnt++].iov_len = backlog - first;
+    }
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t ret = sendmsg(client.fd, &msg, RTLTCP_SEND_FLAGS);
+    if (ret < 0)
+    {
+        if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR) return false;
+        ret = 0;
+    }
+
+    size_t sent = ret;
+    const size_t header = std::min(sent, client.header);
+    client.header -= header;
+    sent -= header;
+    {
+    std::lock_guard<std::mutex> lock(_mutex);
+    client.cursor += sent;
+    client.sent += sent;
+    }
+
+    //wait for the socket to drain before sending more
+    if (sent < backlog or client.header != 0)
+    {
+        client.blocked = true;
+        this->watch(client.fd, true, false);
+    }
+    return true;
+#endif
+}
+
+std::vector<SoapyRTLSDRTcpServer::Client>::iterator SoapyRTLSDRTcpServer::disconnect(std::vector<Client>::iterator it)
+{
+#ifndef _WIN32
+    SoapySDR_logf(SOAPY_SDR_INFO, "rtl_tcp client %s disconnected, sent %llu bytes, dropped %llu bytes",
+        it->peer.c_str(), it->sent, it->dropped);
+    close(it->fd);
+#endif
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _clients.erase(it);
+}
@@ -27,19 +27,26 @@
 #include <SoapySDR/Time.hpp>
 #include <algorithm>
 #include <cstring>
+#include <cmath>
 
 SoapyRTLSDR::SoapyRTLSDR(const SoapySDR::Kwargs &args):
     deviceId(-1),
     dev(nullptr),
-    rxFormat(RTL_RX_FORMAT_FLOAT32),
+    _tcp(nullptr),
     tunerType(RTLSDR_TUNER_R820T),
     sampleRate(2048000),
     centerFrequency(100000000),
     bandwidth(0),
+    loOffset(0.0),
+    tunedFrequency(100000000),
+    _ncoFrequency(0),
     ppm(0),
     directSamplingMode(0),
     numBuffers(DEFAULT_NUM_BUFFERS),
     bufferLength(DEFAULT_BUFFER_LENGTH),
+    asyncBuffs(0),
+    latencyMs(0.0),
+    headroomMs(DEFAULT_HEADROOM_MS),
     iqSwap(false),
     gainMode(false),
     offsetMode(false),
@@ -51,45 +58,120 @@ SoapyRTLSDR::SoapyRTLSDR(const SoapySDR::Kwargs &args):
 #if HAS_RTLSDR_SET_DITHERING
     dithering(true),
 #endif
-    tunerGain(0.0),
     ticks(false),
-    bufferedElems(0),
-    resetBuffer(false),
+    tunerGain(0.0),
+    softAGC(false),
+    agcSetPoint(-20.0),
+    agcHysteresis(3.0),
+    _agcSettleTick(0),
+    _agcStep(-1),
+    _agcStepTick(0),
+    _agcExit(false),
+    threadPriority(0),
+    _history(nullptr),
+    _historySize(0),
+    historyMs(0.0),
+    _historyWritten(0),
+    _historyBaseTick(0),
+    _historyEpoch(0),
+    squelchEnabled(false),
+    _squelchOpen(false),
+    squelchLevel(0.0),
+    squelchHangMs(DEFAULT_SQUELCH_HANG_MS),
+    squelchPrerollMs(DEFAULT_SQUELCH_PREROLL_MS),
+    _squelchHangBuffers(1),
+    _squelchHang(0),
+    _prerollHead(0),
+    _prerollCount(0),
+    _resizeBuffers(false),
+    _arenaBuffs(nullptr),
+    arenaSize(0),
+    arenaHugepages(false),
+    arenaLock(false),
+    _buf_tail(0),
+    _applying(false),
+    tcpQueueMs(DEFAULT_RTLTCP_QUEUE_MS),
+    tcpShared(false),
+    _tcpAttached(false),
+    _tcpFill(0),
+    usbReader(false),
+    _usbReading(false),
     gainMin(0.0),
     gainMax(0.0)
 {
     if (args.count("label") != 0) SoapySDR_logf(SOAPY_SDR_INFO, "Opening %s...", args.at("label").c_str());
 
+    //saved iq calibration of this dongle, rtl_tcp dongles are keyed by the server address
+    if (args.count("rtltcp") != 0) calibrationKey = "rtltcp=" + args.at("rtltcp");
+    else if (args.count("serial") != 0) calibrationKey = args.at("serial");
+    if (args.count("calibration_file") != 0) calibrationFile = args.at("calibration_file");
+    try
+    {
+        this->setCalibration(SoapyRTLSDRCalibration::load(calibrationFile, calibrationKey));
+    }
+    catch (const std::exception &ex)
+    {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR ignoring saved iq calibration - %s", ex.what());
+    }
+
+    //a remote dongle behind rtl_tcp, the server owns the usb device
+    if (args.count("rtltcp") != 0)
+    {
+        _tcp = new SoapyRTLSDRTcpClient(args.at("rtltcp"));
+        _backend.reset(_tcp);
+        tunerType = _tcp->tunerType();
+    }
+    else this->openUsb(args);
+
+    //extract min/max overall gain range
+    tunerGains = _backend->tunerGains();
+    std::sort(tunerGains.begin(), tunerGains.end());
+    if (not tunerGains.empty())
+    {
+        gainMin = tunerGains.front() / 10.0;
+        gainMax = tunerGains.back() / 10.0;
+    }
+}
+
+void SoapyRTLSDR::openUsb(const SoapySDR::Kwargs &args)
+{
     //if a serial is not present, then findRTLSDR had zero devices enumerated
     if (args.count("serial") == 0) throw std::runtime_error("No RTL-SDR devices found!");
 
+    //reuse the index from findRTLSDR while it still points at the serial,
+    //rtlsdr_get_index_by_serial reads the strings of every dongle on the bus
     const auto serial = args.at("serial");
-    deviceId = rtlsdr_get_index_by_serial(serial.c_str());
+    deviceId = -1;
+    if (args.count("index") != 0)
+    {
+        try
+        {
+            const int index = std::stoi(args.at("index"));
+            char manufact[256], product[256], indexSerial[256];
+            if (rtlsdr_get_device_usb_strings(index, manufact, product, indexSerial) == 0 and serial == indexSerial) deviceId = index;
+        }
+        catch (const std::invalid_argument &){}
+    }
+    if (deviceId < 0) deviceId = rtlsdr_get_index_by_serial(serial.c_str());
     if (deviceId < 0) throw std::runtime_error("rtlsdr_get_index_by_serial("+serial+") - " + std::to_string(deviceId));
 
     if (args.count("tuner") != 0) tunerType = rtlStringToTuner(args.at("tuner"));
     SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR Tuner type: %s", rtlTunerToString(tunerType).c_str());
 
-    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR opening device %d", deviceId);
-    if (rtlsdr_open(&dev, deviceId) != 0) {
-        throw std::runtime_error("Unable to open RTL-SDR device");
-    }
-
-    //extract min/max overall gain range
-    int num_gains = rtlsdr_get_tuner_gains(dev, nullptr);
-    if (num_gains > 0)
-    {
-        std::vector<int> gains(num_gains);
-        rtlsdr_get_tuner_gains(dev, gains.data());
-        gainMin = *std::min_element(gains.begin(), gains.end()) / 10.0;
-        gainMax = *std::max_element(gains.begin(), gains.end()) / 10.0;
-    }
+    auto usb = new SoapyRTLSDRUsbBackend(deviceId);
+    _backend.reset(usb);
+    dev = usb->device();
 }
 
 SoapyRTLSDR::~SoapyRTLSDR(void)
 {
-    //cleanup device handles
-    rtlsdr_close(dev);
+    //cleanup streams the caller did not close
+    stopAsync();
+    stopAGC();
+    for (auto stream : _streams) delete stream;
+
+    //the backend closes the device handle
+    releaseBuffers();
 }
 
 /*******************************************************************
@@ -103,7 +185,7 @@ std::string SoapyRTLSDR::getDriverKey(void) const
 
 std::string SoapyRTLSDR::getHardwareKey(void) const
 {
-    switch (rtlsdr_get_tuner_type(dev))
+    switch (_backend->tunerType())
     {
     case RTLSDR_TUNER_UNKNOWN:
         return "UNKNOWN";
@@ -131,7 +213,8 @@ SoapySDR::Kwargs SoapyRTLSDR::getHardwareInfo(void) const
     SoapySDR::Kwargs args;
 
     args["origin"] = "https://github.com/pothosware/SoapyRTLSDR";
-    args["index"] = std::to_string(deviceId);
+    if (_tcp) args["rtltcp"] = _tcp->address();
+    else args["index"] = std::to_string(deviceId);
 
     return args;
 }
@@ -190,7 +273,7 @@ bool SoapyRTLSDR::hasFrequencyCorrection(const int direction, const size_t chann
 
 void SoapyRTLSDR::setFrequencyCorrection(const int direction, const size_t channel, const double value)
 {
-    int r = rtlsdr_set_freq_correction(dev, int(value));
+    int r = _backend->setFrequencyCorrection(int(value));
     if (r == -2)
     {
         return; // CORR didn't actually change, we are done
@@ -199,7 +282,7 @@ void SoapyRTLSDR::setFrequencyCorrection(const int direction, const size_t chann
     {
         throw std::runtime_error("setFrequencyCorrection failed");
     }
-    ppm = rtlsdr_get_freq_correction(dev);
+    ppm = _backend->getFrequencyCorrection();
 }
 
 double SoapyRTLSDR::getFrequencyCorrection(const int direction, const size_t channel) const
@@ -239,8 +322,9 @@ bool SoapyRTLSDR::hasGainMode(const int direction, const size_t channel) const
 void SoapyRTLSDR::setGainMode(const int direction, const size_t channel, const bool automatic)
 {
     gainMode = automatic;
+    if (gainMode) softAGC = false;
     SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting RTL-SDR gain mode: %s", automatic ? "Automatic" : "Manual");
-    rtlsdr_set_tuner_gain_mode(dev, gainMode ? 0 : 1);
+    _backend->setGainMode(not gainMode);
 }
 
 bool SoapyRTLSDR::getGainMode(const int direction, const size_t channel) const
@@ -257,6 +341,7 @@ void SoapyRTLSDR::setGain(const int direction, const size_t channel, const doubl
 
 void SoapyRTLSDR::setGain(const int direction, const size_t channel, const std::string &name, const double value)
 {
+    const auto start = std::chrono::steady_clock::now();
     if ((name.length() >= 2) && (name.substr(0, 2) == "IF"))
     {
         int stage = 1;
@@ -274,14 +359,20 @@ void SoapyRTLSDR::setGain(const int direction, const size_t channel, const std::
             IFGain[stage - 1] = value;
         }
         SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting RTL-SDR IF Gain for stage %d: %f", stage, IFGain[stage - 1]);
-        rtlsdr_set_tuner_if_gain(dev, stage, (int) IFGain[stage - 1] * 10.0);
+        const int ifGain = (int) IFGain[stage - 1] * 10.0;
+        _backend->setIFGain(stage, ifGain);
+        this->profileSetting("if_gain", start);
     }
 
     if (name == "TUNER")
     {
+        std::lock_guard<std::mutex> lock(_gainMutex);
         tunerGain = value;
-        SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting RTL-SDR Tuner Gain: %f", tunerGain);
-        rtlsdr_set_tuner_gain(dev, (int) tunerGain * 10.0);
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting RTL-SDR Tuner Gain: %f", value);
+        _backend->setGain((int) value * 10.0);
+        //the software agc restarts its measurement at the new gain
+        _agcSettleTick = ticks.load();
+        this->profileSetting("gain", start);
     }
 }
 
@@ -348,20 +439,30 @@ void SoapyRTLSDR::setFrequency(
         const double frequency,
         const SoapySDR::Kwargs &args)
 {
+    const auto start = std::chrono::steady_clock::now();
     if (name == "RF")
     {
-        SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting center freq: %d", (uint32_t)frequency);
-        int r = rtlsdr_set_center_freq(dev, (uint32_t)frequency);
+        //the tuner is bypassed in direct sampling, so there is no lo to move
+        const double offset = (directSamplingMode == 0) ? loOffset : 0.0;
+        const uint32_t loFrequency = (uint32_t)(frequency + offset);
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting center freq: %d", loFrequency);
+        int r = _backend->setFrequency(loFrequency);
         if (r != 0)
         {
             throw std::runtime_error("setFrequency failed");
         }
-        centerFrequency = rtlsdr_get_center_freq(dev);
+        tunedFrequency = _backend->getFrequency();
+
+        //report the requested frequency when the conversion re-centers on it
+        if (offset == 0.0) centerFrequency = tunedFrequency;
+        else centerFrequency = (uint32_t)frequency;
+        _ncoFrequency = (long long)tunedFrequency - (long long)centerFrequency;
+        this->profileSetting("frequency", start);
     }
 
     if (name == "CORR")
     {
-        int r = rtlsdr_set_freq_correction(dev, (int)frequency);
+        int r = _backend->setFrequencyCorrection((int)frequency);
         if (r == -2)
         {
             return; // CORR didn't actually change, we are done
@@ -370,7 +471,7 @@ void SoapyRTLSDR::setFrequency(
         {
             throw std::runtime_error("setFrequencyCorrection failed");
         }
-        ppm = rtlsdr_get_freq_correction(dev);
+        ppm = _backend->getFrequencyCorrection();
     }
 }
 
@@ -407,7 +508,7 @@ SoapySDR::RangeList SoapyRTLSDR::getFrequencyRange(
     char product[256] = {0};
 
     // Get manufact and product USB strings to detect RTL-SDR Blog V4 model
-    rtlsdr_get_usb_strings(dev, manufact, product, NULL);
+    if (dev != nullptr) rtlsdr_get_usb_strings(dev, manufact, product, NULL);
 
     if (name == "RF")
     {
@@ -446,11 +547,12 @@ SoapySDR::ArgInfoList SoapyRTLSDR::getFrequencyArgsInfo(const int direction, con
 
 void SoapyRTLSDR::setSampleRate(const int direction, const size_t channel, const double rate)
 {
+    const auto start = std::chrono::steady_clock::now();
     long long ns = SoapySDR::ticksToTimeNs(ticks, sampleRate);
     sampleRate = rate;
-    resetBuffer = true;
+    resetStreams();
     SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting sample rate: %d", sampleRate);
-    int r = rtlsdr_set_sample_rate(dev, sampleRate);
+    int r = _backend->setSampleRate(sampleRate);
     if (r == -EINVAL)
     {
         throw std::runtime_error("setSampleRate failed: RTL-SDR does not support this sample rate");
@@ -459,8 +561,13 @@ void SoapyRTLSDR::setSampleRate(const int direction, const size_t channel, const
     {
         throw std::runtime_error("setSampleRate failed");
     }
-    sampleRate = rtlsdr_get_sample_rate(dev);
+    sampleRate = _backend->getSampleRate();
     ticks = SoapySDR::timeNsToTicks(ns, sampleRate);
+    _agcSettleTick = 0;
+    this->profileSetting("sample_rate", start);
+
+    //the ring, the history and the server queue are resized by the stream once it is safe to do so
+    if ((latencyMs > 0.0 or historyMs > 0.0 or _tcpServer) and not _buffs.empty()) _resizeBuffers = true;
 }
 
 double SoapyRTLSDR::getSampleRate(const int direction, const size_t channel) const
@@ -498,12 +605,14 @@ SoapySDR::RangeList SoapyRTLSDR::getSampleRateRange(const int direction, const s
 
 void SoapyRTLSDR::setBandwidth(const int direction, const size_t channel, const double bw)
 {
-    int r = rtlsdr_set_tuner_bandwidth(dev, bw);
+    const auto start = std::chrono::steady_clock::now();
+    int r = _backend->setBandwidth(bw);
     if (r != 0)
     {
         throw std::runtime_error("setBandwidth failed");
     }
     bandwidth = bw;
+    this->profileSetting("bandwidth", start);
 }
 
 double SoapyRTLSDR::getBandwidth(const int direction, const size_t channel) const
@@ -561,6 +670,7 @@ long long SoapyRTLSDR::getHardwareTime(const std::string &what) const
 void SoapyRTLSDR::setHardwareTime(const long long timeNs, const std::string &what)
 {
     ticks = SoapySDR::timeNsToTicks(timeNs, sampleRate);
+    _agcSettleTick = 0;
 }
 
 /*******************************************************************
@@ -596,6 +706,17 @@ SoapySDR::ArgInfoList SoapyRTLSDR::getSettingInfo(void) const
     offsetTuneArg.type = SoapySDR::ArgInfo::BOOL;
     setArgs.push_back(offsetTuneArg);
 
+    SoapySDR::ArgInfo loOffsetArg;
+
+    loOffsetArg.key = "lo_offset";
+    loOffsetArg.value = "0";
+    loOffsetArg.name = "LO Offset";
+    loOffsetArg.description = "Tune the hardware LO this far from the requested frequency and shift the samples back, moves the DC spike out of the channel (0 to disable)";
+    loOffsetArg.units = "Hz";
+    loOffsetArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    setArgs.push_back(loOffsetArg);
+
     SoapySDR::ArgInfo iqSwapArg;
 
     iqSwapArg.key = "iq_swap";
@@ -626,6 +747,93 @@ SoapySDR::ArgInfoList SoapyRTLSDR::getSettingInfo(void) const
 
     setArgs.push_back(testModeArg);
 
+    SoapySDR::ArgInfo historyDumpArg;
+
+    historyDumpArg.key = "history_dump";
+    historyDumpArg.value = "";
+    historyDumpArg.name = "History Dump";
+    historyDumpArg.description = "Write a window of the history_ms stream history as raw CU8: startNs:stopNs:path, see history_range";
+    historyDumpArg.type = SoapySDR::ArgInfo::STRING;
+
+    setArgs.push_back(historyDumpArg);
+
+    SoapySDR::ArgInfo iqCalibrateArg;
+
+    iqCalibrateArg.key = "iq_calibrate";
+    iqCalibrateArg.value = std::to_string(DEFAULT_IQ_CALIBRATION_SAMPLES);
+    iqCalibrateArg.name = "IQ Calibrate";
+    iqCalibrateArg.description = "Capture this many samples of broadband noise or a busy band and estimate the rail bias, I/Q gain and phase skew, see iq_calibration";
+    iqCalibrateArg.units = "samples";
+    iqCalibrateArg.type = SoapySDR::ArgInfo::INT;
+
+    setArgs.push_back(iqCalibrateArg);
+
+    SoapySDR::ArgInfo iqCalibrationArg;
+
+    iqCalibrationArg.key = "iq_calibration";
+    iqCalibrationArg.value = "";
+    iqCalibrationArg.name = "IQ Calibration";
+    iqCalibrationArg.description = "Correction applied to the complex formats as biasI:biasQ:gain:skew, saved per serial and in the calibration_file device arg, empty to clear";
+    iqCalibrationArg.type = SoapySDR::ArgInfo::STRING;
+
+    setArgs.push_back(iqCalibrationArg);
+
+    SoapySDR::ArgInfo applyArg;
+
+    applyArg.key = "apply";
+    applyArg.value = "";
+    applyArg.name = "Apply Configuration";
+    applyArg.description = "Apply a whole configuration as markup, sample_rate, bandwidth, ppm, direct_samp, gain_mode, gain, lo_offset and frequency plus any other setting; "
+        "every value is checked first, unchanged fields are skipped, the frequency is tuned last and streams see a single gap. "
+        "A hardware failure midway restores the named fields where it can, other settings keep what was written. Read back the current configuration";
+    applyArg.type = SoapySDR::ArgInfo::STRING;
+
+    setArgs.push_back(applyArg);
+
+    SoapySDR::ArgInfo latencyProfileArg;
+
+    latencyProfileArg.key = "latency_profile";
+    latencyProfileArg.value = "false";
+    latencyProfileArg.name = "Latency Profile";
+    latencyProfileArg.description = "Time the frequency, gain, sample rate and bandwidth calls and the samples until the signal settles after them, read back in latency_stats";
+    latencyProfileArg.type = SoapySDR::ArgInfo::BOOL;
+
+    setArgs.push_back(latencyProfileArg);
+
+    SoapySDR::ArgInfo softAGCArg;
+
+    softAGCArg.key = "sw_agc";
+    softAGCArg.value = "false";
+    softAGCArg.name = "Software AGC";
+    softAGCArg.description = "Drive the tuner gain table from power and clipping measured during conversion";
+    softAGCArg.type = SoapySDR::ArgInfo::BOOL;
+
+    setArgs.push_back(softAGCArg);
+
+    SoapySDR::ArgInfo agcSetPointArg;
+
+    agcSetPointArg.key = "agc_setpoint";
+    agcSetPointArg.value = "-20";
+    agcSetPointArg.name = "AGC Set Point";
+    agcSetPointArg.description = "Software AGC target power";
+    agcSetPointArg.units = "dBFS";
+    agcSetPointArg.type = SoapySDR::ArgInfo::FLOAT;
+    agcSetPointArg.range = SoapySDR::Range(-60, 0);
+
+    setArgs.push_back(agcSetPointArg);
+
+    SoapySDR::ArgInfo agcHysteresisArg;
+
+    agcHysteresisArg.key = "agc_hysteresis";
+    agcHysteresisArg.value = "3";
+    agcHysteresisArg.name = "AGC Hysteresis";
+    agcHysteresisArg.description = "Software AGC dead band around the set point";
+    agcHysteresisArg.units = "dB";
+    agcHysteresisArg.type = SoapySDR::ArgInfo::FLOAT;
+    agcHysteresisArg.range = SoapySDR::Range(0, 20);
+
+    setArgs.push_back(agcHysteresisArg);
+
 #if HAS_RTLSDR_SET_BIAS_TEE
     SoapySDR::ArgInfo biasTeeArg;
 
@@ -668,7 +876,23 @@ void SoapyRTLSDR::writeSetting(const std::string &key, const std::string &value)
             directSamplingMode = 0;
         }
         SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR direct sampling mode: %d", directSamplingMode);
-        rtlsdr_set_direct_sampling(dev, directSamplingMode);
+        _backend->setDirectSampling(directSamplingMode);
+
+        //the lo offset only applies with the tuner in use
+        if (loOffset != 0.0) setFrequency(SOAPY_SDR_RX, 0, "RF", centerFrequency);
+    }
+    else if (key == "lo_offset")
+    {
+        try
+        {
+            loOffset = std::stod(value);
+        }
+        catch (const std::invalid_argument &) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR invalid lo offset '%s'", value.c_str());
+            loOffset = 0.0;
+        }
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR lo offset: %g Hz", loOffset);
+        setFrequency(SOAPY_SDR_RX, 0, "RF", centerFrequency);
     }
     else if (key == "iq_swap")
     {
@@ -679,26 +903,104 @@ void SoapyRTLSDR::writeSetting(const std::string &key, const std::string &value)
     {
         offsetMode = (value == "true") ? true : false;
         SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR offset_tune mode: %s", offsetMode ? "true" : "false");
-        rtlsdr_set_offset_tuning(dev, offsetMode ? 1 : 0);
+        _backend->setOffsetTuning(offsetMode);
     }
     else if (key == "digital_agc")
     {
         digitalAGC = (value == "true") ? true : false;
         SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR digital agc mode: %s", digitalAGC ? "true" : "false");
-        rtlsdr_set_agc_mode(dev, digitalAGC ? 1 : 0);
+        _backend->setAGCMode(digitalAGC);
     }
     else if (key == "testmode")
     {
         testMode = (value == "true") ? true : false;
         SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR test mode: %s", testMode ? "true" : "false");
-        rtlsdr_set_testmode(dev, testMode ? 1 : 0);
+        _backend->setTestMode(testMode);
+    }
+    else if (key == "sw_agc")
+    {
+        softAGC = (value == "true") ? true : false;
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR software agc mode: %s", softAGC ? "true" : "false");
+        if (softAGC)
+        {
+            //the software loop owns the tuner gain
+            std::lock_guard<std::mutex> lock(_gainMutex);
+            gainMode = false;
+            _backend->setGainMode(true);
+            _backend->setGain(int(tunerGain * 10));
+        }
+        if (softAGC) startAGC();
+        else stopAGC();
+    }
+    else if (key == "agc_setpoint")
+    {
+        try
+        {
+            agcSetPoint = std::stod(value);
+        }
+        catch (const std::invalid_argument &) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR invalid agc set point '%s'", value.c_str());
+        }
+    }
+    else if (key == "agc_hysteresis")
+    {
+        try
+        {
+            agcHysteresis = std::stod(value);
+        }
+        catch (const std::invalid_argument &) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR invalid agc hysteresis '%s'", value.c_str());
+        }
+    }
+    else if (key == "history_dump")
+    {
+        dumpHistory(value);
+    }
+    else if (key == "apply")
+    {
+        try
+        {
+            this->applyConfiguration(SoapySDR::KwargsFromString(value));
+        }
+        catch (const std::exception &ex) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR apply '%s' failed - %s", value.c_str(), ex.what());
+        }
+    }
+    else if (key == "latency_profile")
+    {
+        //enabling starts a new profile
+        std::shared_ptr<SoapyRTLSDRProfiler> profiler;
+        if (value == "true") profiler = std::make_shared<SoapyRTLSDRProfiler>();
+        std::atomic_store(&_profiler, profiler);
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR latency profile: %s", profiler ? "true" : "false");
+    }
+    else if (key == "iq_calibrate")
+    {
+        try
+        {
+            this->calibrateIQ(value.empty() ? DEFAULT_IQ_CALIBRATION_SAMPLES : std::stoul(value));
+        }
+        catch (const std::exception &ex) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR iq calibration failed - %s", ex.what());
+        }
+    }
+    else if (key == "iq_calibration")
+    {
+        try
+        {
+            this->setCalibration(value);
+            SoapyRTLSDRCalibration::store(calibrationFile, calibrationKey, value);
+        }
+        catch (const std::exception &ex) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR invalid iq calibration '%s' - %s", value.c_str(), ex.what());
+        }
     }
 #if HAS_RTLSDR_SET_BIAS_TEE
     else if (key == "biastee")
     {
         biasTee = (value == "true") ? true: false;
         SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR bias tee mode: %s", biasTee ? "true" : "false");
-        rtlsdr_set_bias_tee(dev, biasTee ? 1 : 0);
+        _backend->setBiasTee(biasTee);
     }
 #endif
 #if HAS_RTLSDR_SET_DITHERING
@@ -706,7 +1008,7 @@ void SoapyRTLSDR::writeSetting(const std::string &key, const std::string &value)
     {
         dithering = (value == "true") ? true : false;
         SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR dithering mode: %s", dithering ? "true" : "false");
-        rtlsdr_set_dithering(dev, dithering ? 1 : 0);
+        if (_backend->setDithering(dithering) != 0) SoapySDR_log(SOAPY_SDR_WARNING, "RTL-SDR dithering cannot be set on this device");
     }
 #endif
 }
@@ -715,6 +1017,8 @@ std::string SoapyRTLSDR::readSetting(const std::string &key) const
 {
     if (key == "direct_samp") {
         return std::to_string(directSamplingMode);
+    } else if (key == "lo_offset") {
+        return std::to_string(loOffset);
     } else if (key == "iq_swap") {
         return iqSwap?"true":"false";
     } else if (key == "offset_tune") {
@@ -723,6 +1027,45 @@ std::string SoapyRTLSDR::readSetting(const std::string &key) const
         return digitalAGC?"true":"false";
     } else if (key == "testmode") {
         return testMode?"true":"false";
+    } else if (key == "sw_agc") {
+        return softAGC?"true":"false";
+    } else if (key == "agc_setpoint") {
+        return std::to_string(agcSetPoint);
+    } else if (key == "agc_hysteresis") {
+        return std::to_string(agcHysteresis);
+    } else if (key == "history_range") {
+        //the window of time currently available to history_dump as startNs:stopNs
+        std::lock_guard<std::mutex> lock(_historyMutex);
+        if (_history == nullptr) return "";
+        const unsigned long long written = _historyWritten;
+        const long long stop = _historyBaseTick + written / BYTES_PER_SAMPLE;
+        const long long start = stop - std::min<unsigned long long>(written, _historySize - bufferLength) / BYTES_PER_SAMPLE;
+        return std::to_string(SoapySDR::ticksToTimeNs(start, sampleRate)) + ":" +
+            std::to_string(SoapySDR::ticksToTimeNs(stop, sampleRate));
+    } else if (key == "agc_events") {
+        //recent gain changes as tick:gain, the tick is the first sample at the new gain
+        std::lock_guard<std::mutex> lock(_agcMutex);
+        std::string events;
+        for (const auto &event : _agcEvents)
+        {
+            if (not events.empty()) events += ",";
+            events += std::to_string(event.first) + ":" + std::to_string(event.second);
+        }
+        return events;
+    } else if (key == "apply") {
+        return SoapySDR::KwargsToString(currentConfiguration());
+    } else if (key == "latency_profile") {
+        return std::atomic_load(&_profiler) ? "true" : "false";
+    } else if (key == "latency_stats") {
+        //per operation op:calls:callUs:settleSamples, distributions as min/p50/p90/max
+        const auto profiler = std::atomic_load(&_profiler);
+        return profiler ? profiler->report() : "";
+    } else if (key == "iq_calibration") {
+        const auto calibration = std::atomic_load(&_calibration);
+        return calibration ? calibration->toString() : "";
+    } else if (key == "rtltcp_clients") {
+        //clients of the rtltcp_server stream arg as peer:sentBytes:droppedBytes
+        return _tcpServer ? _tcpServer->clients() : "";
 #if HAS_RTLSDR_SET_BIAS_TEE
     } else if (key == "biastee") {
         return biasTee?"true":"false";
@@ -737,6 +1080,149 @@ std::string SoapyRTLSDR::readSetting(const std::string &key) const
     return "";
 }
 
+/*******************************************************************
+ * Bulk configuration
+ ******************************************************************/
+
+SoapySDR::Kwargs SoapyRTLSDR::currentConfiguration(void) const
+{
+    SoapySDR::Kwargs config;
+    config["sample_rate"] = std::to_string(sampleRate);
+    config["bandwidth"] = std::to_string(bandwidth);
+    config["ppm"] = std::to_string(ppm);
+    config["direct_samp"] = std::to_string(directSamplingMode);
+    config["gain_mode"] = gainMode ? "true" : "false";
+    config["gain"] = std::to_string(tunerGain.load());
+    config["lo_offset"] = std::to_string(loOffset);
+    config["frequency"] = std::to_string(centerFrequency);
+    return config;
+}
+
+//the value of a generic setting must fit its arg info, as writeSetting would only log it
+static void checkSetting(const SoapySDR::ArgInfo &info, const std::string &value)
+{
+    if (not info.options.empty() and std::find(info.options.begin(), info.options.end(), value) == info.options.end())
+    {
+        throw std::runtime_error(info.key + " '" + value + "' is not one of its options");
+    }
+    if (info.type == SoapySDR::ArgInfo::BOOL and value != "true" and value != "false")
+    {
+        throw std::runtime_error(info.key + " '" + value + "' is not true or false");
+    }
+    if (info.type == SoapySDR::ArgInfo::FLOAT) std::stod(value);
+    if (info.type == SoapySDR::ArgInfo::INT and not value.empty()) std::stol(value);
+}
+
+void SoapyRTLSDR::applyConfiguration(const SoapySDR::Kwargs &target)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    //parse and check everything first so a bad value or key writes nothing
+    double rate = sampleRate, bw = bandwidth, frequency = centerFrequency, gain = tunerGain, offset = loOffset;
+    int correction = ppm, direct = directSamplingMode;
+    bool automatic = gainMode;
+    SoapySDR::Kwargs settings;
+    const auto infos = getSettingInfo();
+    try
+    {
+        for (const auto &entry : target)
+        {
+            if (entry.first == "sample_rate") rate = std::stod(entry.second);
+            else if (entry.first == "bandwidth") bw = std::stod(entry.second);
+            else if (entry.first == "ppm") correction = std::stoi(entry.second);
+            else if (entry.first == "gain_mode") automatic = (entry.second == "true");
+            else if (entry.first == "gain") gain = std::stod(entry.second);
+            else if (entry.first == "lo_offset") offset = std::stod(entry.second);
+            else if (entry.first == "frequency") frequency = std::stod(entry.second);
+            else if (entry.first == "direct_samp")
+            {
+                direct = std::stoi(entry.second);
+                if (direct < 0 or direct > 2) throw std::runtime_error("direct_samp must be 0, 1 or 2");
+            }
+            else if (entry.first == "apply" or entry.first == "iq_calibrate")
+            {
+                throw std::runtime_error(entry.first + " cannot be applied");
+            }
+            else
+            {
+                auto it = std::find_if(infos.begin(), infos.end(), [&entry](const SoapySDR::ArgInfo &info){return info.key == entry.first;});
+                if (it == infos.end()) throw std::runtime_error("unknown setting " + entry.first);
+                checkSetting(*it, entry.second);
+                if (readSetting(entry.first) != entry.second) settings[entry.first] = entry.second;
+            }
+        }
+    }
+    catch (const std::logic_error &)
+    {
+        throw std::runtime_error("invalid value");
+    }
+
+    //unchanged fields cost no control transfers, the rate reads back truncated to whole Hz
+    const bool rateChanged = std::abs(rate - sampleRate) >= 1.0;
+    const bool bwChanged = uint32_t(bw) != bandwidth;
+    const bool correctionChanged = correction != ppm;
+    const bool directChanged = direct != directSamplingMode;
+    const bool modeChanged = automatic != gainMode;
+    const bool gainChanged = not automatic and (modeChanged or gain != tunerGain);
+    const bool offsetChanged = offset != loOffset;
+    const bool frequencyChanged = uint32_t(frequency) != centerFrequency or offsetChanged or (directChanged and offset != 0.0);
+    if (not (rateChanged or bwChanged or correctionChanged or directChanged or modeChanged or gainChanged or frequencyChanged or not settings.empty())) return;
+
+    //what the named fields go back to when the hardware fails midway
+    const double previousRate = sampleRate, previousFrequency = centerFrequency, previousGain = tunerGain, previousOffset = loOffset;
+    const uint32_t previousBw = bandwidth;
+    const int previousCorrection = ppm, previousDirect = directSamplingMode;
+    const bool previousAutomatic = gainMode;
+
+    //the rate first since it resets the ring, the tuner pll last so it settles once,
+    //direct sampling only switches the input here and leaves the tune to the end
+    _applying = true;
+    try
+    {
+        if (rateChanged) setSampleRate(SOAPY_SDR_RX, 0, rate);
+        for (const auto &entry : settings) writeSetting(entry.first, entry.second);
+        if (directChanged)
+        {
+            directSamplingMode = direct;
+            _backend->setDirectSampling(directSamplingMode);
+        }
+        if (bwChanged) setBandwidth(SOAPY_SDR_RX, 0, bw);
+        if (correctionChanged) setFrequency(SOAPY_SDR_RX, 0, "CORR", correction);
+        if (modeChanged) setGainMode(SOAPY_SDR_RX, 0, automatic);
+        if (gainChanged) setGain(SOAPY_SDR_RX, 0, "TUNER", gain);
+        loOffset = offset;
+        if (frequencyChanged) setFrequency(SOAPY_SDR_RX, 0, "RF", frequency);
+    }
+    catch (...)
+    {
+        //best effort, the generic settings written so far are kept
+        //and a failing dongle may well refuse the old values too
+        try
+        {
+            if (std::abs(previousRate - sampleRate) >= 1.0) setSampleRate(SOAPY_SDR_RX, 0, previousRate);
+            if (previousDirect != directSamplingMode)
+            {
+                directSamplingMode = previousDirect;
+                _backend->setDirectSampling(directSamplingMode);
+            }
+            if (previousBw != bandwidth) setBandwidth(SOAPY_SDR_RX, 0, previousBw);
+            if (previousCorrection != ppm) setFrequency(SOAPY_SDR_RX, 0, "CORR", previousCorrection);
+            if (previousAutomatic != gainMode) setGainMode(SOAPY_SDR_RX, 0, previousAutomatic);
+            if (not previousAutomatic and previousGain != tunerGain) setGain(SOAPY_SDR_RX, 0, "TUNER", previousGain);
+            loOffset = previousOffset;
+            setFrequency(SOAPY_SDR_RX, 0, "RF", previousFrequency);
+        }
+        catch (const std::exception &ex)
+        {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR restoring the configuration failed - %s", ex.what());
+        }
+        _applying = false;
+        throw;
+    }
+    _applying = false;
+    this->profileSetting("apply", start);
+}
+
 std::string SoapyRTLSDR::rtlTunerToString(rtlsdr_tuner tunerType)
 {
     std::string deviceTuner;
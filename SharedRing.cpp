@@ -0,0 +1,529 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include <SoapySDR/Logger.hpp>
+#include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Time.hpp>
+#include <algorithm> //min
+#include <chrono>
+#include <climits>
+#include <complex>
+#include <cstring>
+#include <cerrno>
+#include <new>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#define SHM_RING_MAGIC 0x534c5452 //"RTLS"
+#define SHM_RING_VERSION 2
+#define SHM_WRITING (~0ull)
+
+//posix names start with a single slash
+static std::string shmPath(const std::string &name)
+{
+    return (not name.empty() and name[0] == '/') ? name : "/" + name;
+}
+
+#ifndef _WIN32
+//an existing ring may only be replaced once its producer is gone,
+//anything that cannot be identified as such is left alone
+static bool staleRing(const std::string &path)
+{
+    const int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0) return errno == ENOENT;
+    struct stat st;
+    const bool sized = fstat(fd, &st) == 0 and size_t(st.st_size) >= sizeof(SoapyRTLSDRShmHeader);
+    void *mem = sized ? mmap(nullptr, sizeof(SoapyRTLSDRShmHeader), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mem == MAP_FAILED) return false;
+
+    const SoapyRTLSDRShmHeader *header = (const SoapyRTLSDRShmHeader *)mem;
+    bool stale = header->magic == SHM_RING_MAGIC and header->version == SHM_RING_VERSION;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (stale and header->closed.load(std::memory_order_acquire) == 0)
+    {
+        //a crashed producer never set closed, check that its process is gone
+        stale = header->producer > 0 and kill(pid_t(header->producer), 0) != 0 and errno == ESRCH;
+    }
+    munmap(mem, sizeof(SoapyRTLSDRShmHeader));
+    return stale;
+}
+#endif
+
+/*******************************************************************
+ * Shared ring
+ ******************************************************************/
+
+SoapyRTLSDRSharedRing::SoapyRTLSDRSharedRing(const std::string &name, const size_t numSlots, const size_t slotSize,
+    const std::string &serial, const std::string &tuner):
+    _name(shmPath(name)),
+    _owner(true),
+    _mem(nullptr),
+    _size(0),
+    _header(nullptr),
+    _slots(nullptr)
+{
+#ifdef _WIN32
+    throw std::runtime_error("RTL-SDR shared memory export is not supported on this platform");
+#else
+    const size_t tableSize = sizeof(SoapyRTLSDRShmHeader) + numSlots * sizeof(SoapyRTLSDRShmSlot);
+    const size_t dataOffset = ((tableSize + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT) * ARENA_ALIGNMENT;
+    _size = dataOffset + numSlots * slotSize;
+
+    //a segment left behind by a crashed producer is replaced,
+    //readers still attached to it keep their old mapping
+    int fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 and errno == EEXIST)
+    {
+        if (not staleRing(_name))
+        {
+            throw std::runtime_error("rtlsdr_shm " + _name + " is in use by another producer, "
+                "choose another name or remove /dev/shm" + _name + " if it is left over");
+        }
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR replacing the stale shared memory %s", _name.c_str());
+        shm_unlink(_name.c_str());
+        fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0) throw std::runtime_error("shm_open(" + _name + ") failed: " + std::string(std::strerror(errno)));
+    if (ftruncate(fd, _size) != 0)
+    {
+        const int err = errno;
+        close(fd);
+        shm_unlink(_name.c_str());
+        throw std::runtime_error("ftruncate(" + _name + ") failed: " + std::string(std::strerror(err)));
+    }
+    _mem = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (_mem == MAP_FAILED)
+    {
+        shm_unlink(_name.c_str());
+        throw std::runtime_error("mmap(" + _name + ") failed: " + std::string(std::strerror(errno)));
+    }
+
+    //the new segment is zero filled, construct the header and slot table in place
+    _header = new (_mem) SoapyRTLSDRShmHeader();
+    _slots = (SoapyRTLSDRShmSlot *)((char *)_mem + sizeof(SoapyRTLSDRShmHeader));
+    for (size_t i = 0; i < numSlots; i++)
+    {
+        new (_slots + i) SoapyRTLSDRShmSlot();
+        _slots[i].index.store(SHM_WRITING, std::memory_order_relaxed);
+    }
+    _header->version = SHM_RING_VERSION;
+    _header->numSlots = numSlots;
+    _header->slotSize = slotSize;
+    _header->dataOffset = dataOffset;
+    std::strncpy(_header->serial, serial.c_str(), sizeof(_header->serial) - 1);
+    std::strncpy(_header->tuner, tuner.c_str(), sizeof(_header->tuner) - 1);
+    _header->writeIndex.store(0, std::memory_order_relaxed);
+    _header->closed.store(0, std::memory_order_relaxed);
+    _header->producer = getpid();
+
+    //readers only accept the segment once the magic is in place
+    std::atomic_thread_fence(std::memory_order_release);
+    _header->magic = SHM_RING_MAGIC;
+
+    SoapySDR_logf(SOAPY_SDR_INFO, "RTL-SDR exporting %zu slots of %zu bytes in shared memory %s", numSlots, slotSize, _name.c_str());
+#endif
+}
+
+SoapyRTLSDRSharedRing::SoapyRTLSDRSharedRing(const std::string &name):
+    _name(shmPath(name)),
+    _owner(false),
+    _mem(nullptr),
+    _size(0),
+    _header(nullptr),
+    _slots(nullptr)
+{
+#ifdef _WIN32
+    throw std::runtime_error("RTL-SDR shared memory export is not supported on this platform");
+#else
+    const int fd = shm_open(_name.c_str(), O_RDONLY, 0);
+    if (fd < 0) throw std::runtime_error("shm_open(" + _name + ") failed: " + std::string(std::strerror(errno)));
+    struct stat st;
+    if (fstat(fd, &st) != 0 or size_t(st.st_size) < sizeof(SoapyRTLSDRShmHeader))
+    {
+        close(fd);
+        throw std::runtime_error("rtlsdr_shm " + _name + " is not an exported RTL-SDR ring");
+    }
+    _size = st.st_size;
+    _mem = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (_mem == MAP_FAILED) throw std::runtime_error("mmap(" + _name + ") failed: " + std::string(std::strerror(errno)));
+
+    _header = (SoapyRTLSDRShmHeader *)_mem;
+    _slots = (SoapyRTLSDRShmSlot *)((char *)_mem + sizeof(SoapyRTLSDRShmHeader));
+    const bool valid = _header->magic == SHM_RING_MAGIC and _header->version == SHM_RING_VERSION and
+        _header->dataOffset + size_t(_header->numSlots) * _header->slotSize <= _size;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (not valid)
+    {
+        munmap(_mem, _size);
+        throw std::runtime_error("rtlsdr_shm " + _name + " is not an exported RTL-SDR ring");
+    }
+#endif
+}
+
+SoapyRTLSDRSharedRing::~SoapyRTLSDRSharedRing(void)
+{
+#ifndef _WIN32
+    if (_owner)
+    {
+        _header->closed.store(1, std::memory_order_release);
+        shm_unlink(_name.c_str());
+    }
+    munmap(_mem, _size);
+#endif
+}
+
+void SoapyRTLSDRSharedRing::write(const unsigned char *buf, const size_t len, const unsigned long long tick, const int flags,
+    const uint32_t sampleRate, const uint32_t frequency)
+{
+    this->setTuning(sampleRate, frequency);
+
+    unsigned long long index = _header->writeIndex.load(std::memory_order_relaxed);
+    for (size_t offset = 0; offset < len; offset += _header->slotSize)
+    {
+        const size_t size = std::min<size_t>(len - offset, _header->slotSize);
+        auto &slot = _slots[index % _header->numSlots];
+
+        //invalidate the slot so that readers of the previous lap notice the overwrite
+        slot.index.store(SHM_WRITING, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        std::memcpy((char *)_mem + _header->dataOffset + size_t(index % _header->numSlots) * _header->slotSize, buf + offset, size);
+        slot.tick.store(tick + offset / BYTES_PER_SAMPLE, std::memory_order_relaxed);
+        slot.size.store(size, std::memory_order_relaxed);
+        slot.flags.store((offset + size == len) ? flags : 0, std::memory_order_relaxed);
+        slot.index.store(index, std::memory_order_release);
+
+        _header->writeIndex.store(++index, std::memory_order_release);
+    }
+}
+
+void SoapyRTLSDRSharedRing::setTuning(const uint32_t sampleRate, const uint32_t frequency)
+{
+    _header->sampleRate.store(sampleRate, std::memory_order_relaxed);
+    _header->frequency.store(frequency, std::memory_order_relaxed);
+}
+
+const SoapyRTLSDRShmHeader &SoapyRTLSDRSharedRing::header(void) const
+{
+    return *_header;
+}
+
+const SoapyRTLSDRShmSlot &SoapyRTLSDRSharedRing::slot(const size_t index) const
+{
+    return _slots[index % _header->numSlots];
+}
+
+const signed char *SoapyRTLSDRSharedRing::data(const size_t index) const
+{
+    return (const signed char *)_mem + _header->dataOffset + (index % _header->numSlots) * _header->slotSize;
+}
+
+/*******************************************************************
+ * Read-only device
+ ******************************************************************/
+
+/*!
+ * A device that reads the ring exported by another process.
+ * Only streaming is supported, the tuner belongs to the producer,
+ * so frequency and rate are reported from the ring header.
+ */
+class SoapyRTLSDRShm : public SoapySDR::Device
+{
+public:
+    SoapyRTLSDRShm(const SoapySDR::Kwargs &args):
+        _ring(args.at("rtlsdr_shm")),
+        _format(RTL_RX_FORMAT_FLOAT32),
+        _planar(false),
+        _iqSwap(false),
+        _cursor(0),
+        _offset(0)
+    {
+    }
+
+    std::string getDriverKey(void) const
+    {
+        return "RTLSDR_SHM";
+    }
+
+    std::string getHardwareKey(void) const
+    {
+        return _ring.header().tuner;
+    }
+
+    SoapySDR::Kwargs getHardwareInfo(void) const
+    {
+        SoapySDR::Kwargs args;
+        args["serial"] = _ring.header().serial;
+        args["slots"] = std::to_string(_ring.header().numSlots);
+        args["slot_size"] = std::to_string(_ring.header().slotSize);
+        return args;
+    }
+
+    size_t getNumChannels(const int dir) const
+    {
+        return (dir == SOAPY_SDR_RX) ? 1 : 0;
+    }
+
+    std::vector<std::string> getStreamFormats(const int direction, const size_t channel) const
+    {
+        std::vector<std::string> formats;
+        formats.push_back(SOAPY_SDR_CS8);
+        formats.push_back(SOAPY_SDR_CS16);
+        formats.push_back(SOAPY_SDR_CF32);
+        return formats;
+    }
+
+    std::string getNativeStreamFormat(const int direction, const size_t channel, double &fullScale) const
+    {
+        fullScale = 128;
+        return SOAPY_SDR_CS8;
+    }
+
+    SoapySDR::ArgInfoList getStreamArgsInfo(const int direction, const size_t channel) const
+    {
+        SoapySDR::ArgInfoList streamArgs;
+
+        SoapySDR::ArgInfo layoutArg;
+        layoutArg.key = "layout";
+        layoutArg.value = "interleaved";
+        layoutArg.name = "Sample layout";
+        layoutArg.description = "Write interleaved I/Q to buffs[0], or I to buffs[0] and Q to buffs[1] when planar.";
+        layoutArg.type = SoapySDR::ArgInfo::STRING;
+        layoutArg.options.push_back("interleaved");
+        layoutArg.optionNames.push_back("Interleaved");
+        layoutArg.options.push_back("planar");
+        layoutArg.optionNames.push_back("Planar");
+        streamArgs.push_back(layoutArg);
+
+        return streamArgs;
+    }
+
+    SoapySDR::Stream *setupStream(const int direction, const std::string &format, const std::vector<size_t> &channels =
+        std::vector<size_t>(), const SoapySDR::Kwargs &args = SoapySDR::Kwargs())
+    {
+        if (direction != SOAPY_SDR_RX) throw std::runtime_error("RTL-SDR is RX only, use SOAPY_SDR_RX");
+        if (channels.size() > 1 or (channels.size() > 0 and channels.at(0) != 0)) throw std::runtime_error("setupStream invalid channel selection");
+
+        if (format == SOAPY_SDR_CF32) _format = RTL_RX_FORMAT_FLOAT32;
+        else if (format == SOAPY_SDR_CS16) _format = RTL_RX_FORMAT_INT16;
+        else if (format == SOAPY_SDR_CS8) _format = RTL_RX_FORMAT_INT8;
+        else throw std::runtime_error("setupStream invalid format '" + format + "' -- Only CS8, CS16 and CF32 are supported by rtlsdr_shm.");
+
+        _planar = args.count("layout") != 0 and args.at("layout") == "planar";
+        if (args.count("layout") != 0 and not _planar and args.at("layout") != "interleaved")
+        {
+            throw std::runtime_error("setupStream invalid layout '" + args.at("layout") + "'");
+        }
+        return (SoapySDR::Stream *)this;
+    }
+
+    void closeStream(SoapySDR::Stream *stream)
+    {
+        return;
+    }
+
+    size_t getStreamMTU(SoapySDR::Stream *stream) const
+    {
+        return _ring.header().slotSize / BYTES_PER_SAMPLE;
+    }
+
+    int activateStream(SoapySDR::Stream *stream, const int flags = 0, const long long timeNs = 0, const size_t numElems = 0)
+    {
+        if (flags != 0) return SOAPY_SDR_NOT_SUPPORTED;
+
+        //start at the newest data like the local streams do
+        _cursor = _ring.header().writeIndex.load(std::memory_order_acquire);
+        _offset = 0;
+        return 0;
+    }
+
+    int readStream(SoapySDR::Stream *stream, void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs = 100000)
+    {
+        const auto &header = _ring.header();
+        const auto exit = std::chrono::high_resolution_clock::now() + std::chrono::microseconds(timeoutUs);
+
+        //poll for the next slot, the producer never signals readers
+        while (header.writeIndex.load(std::memory_order_acquire) <= _cursor)
+        {
+            if (header.closed.load(std::memory_order_relaxed) != 0)
+            {
+                SoapySDR_log(SOAPY_SDR_ERROR, "rtlsdr_shm producer closed the ring");
+                return SOAPY_SDR_STREAM_ERROR;
+            }
+            if (std::chrono::high_resolution_clock::now() > exit) return SOAPY_SDR_TIMEOUT;
+            std::this_thread::sleep_for(std::chrono::microseconds(pollPeriodUs()));
+        }
+
+        //the writer lapped this reader, skip to the newest data
+        const unsigned long long written = header.writeIndex.load(std::memory_order_acquire);
+        if (written - _cursor >= header.numSlots) return this->overflow(written);
+
+        const auto &slot = _ring.slot(_cursor);
+        if (slot.index.load(std::memory_order_acquire) != _cursor) return this->overflow(written);
+        const size_t size = slot.size.load(std::memory_order_relaxed);
+        const unsigned long long tick = slot.tick.load(std::memory_order_relaxed);
+        const int slotFlags = slot.flags.load(std::memory_order_relaxed);
+
+        const size_t returnedElems = std::min(size / BYTES_PER_SAMPLE - _offset, numElems);
+        const signed char *in = (const signed char *)_ring.data(_cursor) + _offset * BYTES_PER_SAMPLE;
+
+        //the tuner belongs to the producer, so no lo_offset, calibration or agc here
+        SoapyRTLSDRConversion conversion;
+        conversion.format = _format;
+        conversion.planar = _planar;
+        conversion.swap = _iqSwap;
+        conversion.tick = tick + _offset;
+        conversion.convert(buffs, in, returnedElems);
+
+        //the data is only good if the slot was not rewritten while converting
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.index.load(std::memory_order_relaxed) != _cursor) return this->overflow(written);
+
+        flags = SOAPY_SDR_HAS_TIME;
+        timeNs = SoapySDR::ticksToTimeNs(tick + _offset, header.sampleRate.load(std::memory_order_relaxed));
+        _offset += returnedElems;
+        if (_offset * BYTES_PER_SAMPLE < size) flags |= SOAPY_SDR_MORE_FRAGMENTS;
+        else
+        {
+            flags |= slotFlags;
+            _cursor++;
+            _offset = 0;
+        }
+        return returnedElems;
+    }
+
+    double getFrequency(const int direction, const size_t channel, const std::string &name) const
+    {
+        return double(_ring.header().frequency.load(std::memory_order_relaxed));
+    }
+
+    std::vector<std::string> listFrequencies(const int direction, const size_t channel) const
+    {
+        std::vector<std::string> names;
+        names.push_back("RF");
+        return names;
+    }
+
+    double getSampleRate(const int direction, const size_t channel) const
+    {
+        return double(_ring.header().sampleRate.load(std::memory_order_relaxed));
+    }
+
+    std::vector<double> listSampleRates(const int direction, const size_t channel) const
+    {
+        std::vector<double> rates;
+        rates.push_back(this->getSampleRate(direction, channel));
+        return rates;
+    }
+
+    SoapySDR::ArgInfoList getSettingInfo(void) const
+    {
+        SoapySDR::ArgInfoList setArgs;
+
+        SoapySDR::ArgInfo iqSwapArg;
+        iqSwapArg.key = "iq_swap";
+        iqSwapArg.value = "false";
+        iqSwapArg.name = "I/Q Swap";
+        iqSwapArg.description = "Swap I and Q of the shared samples";
+        iqSwapArg.type = SoapySDR::ArgInfo::BOOL;
+        setArgs.push_back(iqSwapArg);
+
+        return setArgs;
+    }
+
+    void writeSetting(const std::string &key, const std::string &value)
+    {
+        if (key == "iq_swap")
+        {
+            _iqSwap = (value == "true");
+            SoapySDR_logf(SOAPY_SDR_DEBUG, "rtlsdr_shm I/Q swap: %s", _iqSwap ? "true" : "false");
+        }
+    }
+
+    std::string readSetting(const std::string &key) const
+    {
+        if (key == "iq_swap") return _iqSwap ? "true" : "false";
+        SoapySDR_logf(SOAPY_SDR_WARNING, "Unknown setting '%s'", key.c_str());
+        return "";
+    }
+
+private:
+    int overflow(const unsigned long long written)
+    {
+        _cursor = written;
+        _offset = 0;
+        SoapySDR::log(SOAPY_SDR_SSI, "O");
+        return SOAPY_SDR_OVERFLOW;
+    }
+
+    //a quarter of a slot, so a reader that keeps up wakes a few times per slot
+    long pollPeriodUs(void) const
+    {
+        const double rate = double(_ring.header().sampleRate.load(std::memory_order_relaxed));
+        if (rate <= 0.0) return 1000;
+        return std::max(100l, long(_ring.header().slotSize / BYTES_PER_SAMPLE * 1e6 / rate / 4));
+    }
+
+    SoapyRTLSDRSharedRing _ring;
+    rtlsdrRXFormat _format;
+    bool _planar;
+    std::atomic<bool> _iqSwap;
+    unsigned long long _cursor;
+    size_t _offset;
+};
+
+std::vector<SoapySDR::Kwargs> findRTLSDRShm(const SoapySDR::Kwargs &args)
+{
+    std::vector<SoapySDR::Kwargs> results;
+    try
+    {
+        SoapyRTLSDRSharedRing ring(args.at("rtlsdr_shm"));
+        SoapySDR::Kwargs devInfo;
+        devInfo["label"] = std::string("RTL-SDR shared memory :: ") + ring.header().serial;
+        devInfo["rtlsdr_shm"] = args.at("rtlsdr_shm");
+        devInfo["serial"] = ring.header().serial;
+        devInfo["tuner"] = ring.header().tuner;
+        results.push_back(devInfo);
+    }
+    catch (const std::exception &ex)
+    {
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "%s", ex.what());
+    }
+    return results;
+}
+
+SoapySDR::Device *makeRTLSDRShm(const SoapySDR::Kwargs &args)
+{
+    return new SoapyRTLSDRShm(args);
+}
@@ -33,15 +33,671 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <memory>
+#include <map>
+#include <complex>
+#include <chrono>
 
 typedef enum rtlsdrRXFormat
 {
-    RTL_RX_FORMAT_FLOAT32, RTL_RX_FORMAT_INT16, RTL_RX_FORMAT_INT8
+    RTL_RX_FORMAT_FLOAT32, RTL_RX_FORMAT_INT16, RTL_RX_FORMAT_INT8,
+    RTL_RX_FORMAT_MAG16, RTL_RX_FORMAT_MAGSQ16,
+    RTL_RX_FORMAT_REAL_FLOAT32, RTL_RX_FORMAT_REAL_INT16, RTL_RX_FORMAT_REAL_INT8,
+    RTL_RX_FORMAT_FM_FLOAT32, RTL_RX_FORMAT_FM_INT16,
+    RTL_RX_FORMAT_UINT8, RTL_RX_FORMAT_FLOAT16
 } rtlsdrRXFormat;
 
 #define DEFAULT_BUFFER_LENGTH (16 * 32 * 512)
 #define DEFAULT_NUM_BUFFERS 15
+#define SPARE_NUM_BUFFERS 4
 #define BYTES_PER_SAMPLE 2
+#define DEFAULT_HEADROOM_MS 500
+#define ASYNC_INFLIGHT_MS 50
+#define DEFAULT_SQUELCH_HANG_MS 200
+#define DEFAULT_SQUELCH_PREROLL_MS 50
+#define ARENA_ALIGNMENT 64
+#define AGC_UPDATE_RATE 50
+#define AGC_CLIP_RATIO 0.001
+#define AGC_OVERLOAD_STEP_DB 10.0
+#define AGC_MAX_EVENTS 64
+#define DEFAULT_RTLTCP_QUEUE_MS 500
+#define DEFAULT_FILTER_TAPS 127
+#define NCO_RESYNC_SAMPLES 1024
+#define DEFAULT_IQ_CALIBRATION_SAMPLES (1 << 18)
+#define DEFAULT_RESAMPLE_TAPS 16
+#define RESAMPLER_MAX_PHASES 256
+#define RESAMPLER_BANDWIDTH 0.9
+#define RX_COPY_BUFFER (~size_t(0)) //dispatchBuffer copies into a new ring slot
+#define RAW_BIAS 127.4f //mean of a raw 8-bit rail, the zero of every converted format
+
+//! Raw signal statistics gathered while converting samples
+struct rtlsdrSignalStats
+{
+    rtlsdrSignalStats(void): power(0), clipped(0), count(0){}
+    unsigned long long power; //sum of squares, full scale is 1 << 16
+    size_t clipped; //samples with a rail at 0 or 255
+    size_t count;
+};
+
+/*!
+ * Conversion tables shared by every device in the process. The tables
+ * have one entry per raw 8-bit value of a rail, so both rails and the
+ * I/Q swap index the same table. Built on first use, read-only after.
+ */
+struct SoapyRTLSDRTables
+{
+    SoapyRTLSDRTables(void);
+    static const SoapyRTLSDRTables &get(void);
+
+    float f32[256]; //(x - RAW_BIAS) / 128
+    int16_t s16[256]; //f32 at SHRT_MAX full scale
+    uint16_t f16[256]; //f32 as IEEE half
+
+    //magnitude and magnitude squared of f32, indexed by the raw pair (i << 8) | q
+    uint16_t mag16[256 * 256];
+    uint16_t magsq16[256 * 256];
+};
+
+/*!
+ * IQ calibration of one dongle: the DC bias of each rail in raw units,
+ * the I/Q amplitude ratio and the phase skew of Q in degrees.
+ * The correction is folded into per-rail tables, I = i[rawI] and
+ * Q = q[rawQ] + qi[rawI], which convert at the cost of the shared tables.
+ */
+struct SoapyRTLSDRCalibration
+{
+    SoapyRTLSDRCalibration(const double biasI, const double biasQ, const double gain, const double skew);
+
+    //! Estimate from raw CU8 samples of broadband noise or a busy band
+    static SoapyRTLSDRCalibration estimate(const unsigned char *raw, const size_t numElems);
+
+    //! Parse biasI:biasQ:gain:skew, throws on a malformed or implausible value
+    static SoapyRTLSDRCalibration parse(const std::string &value);
+
+    std::string toString(void) const;
+
+    //! Saved calibrations by serial, kept for the process and optionally in a file
+    static std::string load(const std::string &file, const std::string &serial);
+    static void store(const std::string &file, const std::string &serial, const std::string &value);
+
+    double biasI, biasQ, gain, skew;
+    float i[256], q[256], qi[256];
+};
+
+/*!
+ * The stream settings a conversion of raw samples depends on.
+ * One pass over the raw samples into buffs, shared by the device
+ * streams, the array and the shared memory reader.
+ */
+struct SoapyRTLSDRConversion
+{
+    SoapyRTLSDRConversion(void);
+
+    //! Convert numElems raw samples
+    void convert(void * const *buffs, const signed char *in, const size_t numElems) const;
+
+    rtlsdrRXFormat format;
+    bool planar; //I and Q in separate buffers
+    bool swap;
+    size_t rail; //input rail of the real formats
+    long long nco; //lo_offset re-centering, already mirrored by the swap
+    long long tick;
+    uint32_t rate;
+    const SoapyRTLSDRCalibration *calibration;
+    std::vector<std::complex<float>> *scratch; //corrected CF16 and FM
+    std::complex<float> *fmLast;
+};
+
+/*!
+ * Contiguous memory for the sample ring buffers.
+ * The memory is page aligned, optionally hugepage backed and locked,
+ * and regions are handed out aligned to ARENA_ALIGNMENT bytes.
+ */
+class SoapyRTLSDRArena
+{
+public:
+    SoapyRTLSDRArena(const size_t size, const bool hugepages, const bool lock);
+
+    ~SoapyRTLSDRArena(void);
+
+    //! Get a region of the arena, nullptr when there is no room
+    signed char *allocate(const size_t size);
+
+    void release(signed char *ptr);
+
+    size_t size(void) const;
+
+    //! Get or create the process-wide arena with the given name
+    static std::shared_ptr<SoapyRTLSDRArena> shared(
+        const std::string &name, const size_t size, const bool hugepages, const bool lock);
+
+private:
+    signed char *_mem;
+    size_t _size;
+    bool _mapped, _locked;
+    std::mutex _mutex;
+    std::map<size_t, size_t> _regions; //offset -> length
+};
+
+//! Header of a ring exported in shared memory, followed by the slot table and data
+struct SoapyRTLSDRShmHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSlots;
+    uint32_t slotSize; //bytes of CU8 data per slot
+    uint64_t dataOffset; //offset of slot 0 data from the header
+    char serial[64];
+    char tuner[32];
+    std::atomic<unsigned long long> writeIndex; //slots written since creation
+    std::atomic<unsigned long long> sampleRate;
+    std::atomic<unsigned long long> frequency;
+    std::atomic<unsigned> closed; //set when the producer goes away
+    int64_t producer; //process id of the producer, to detect a stale segment
+};
+
+//! One slot of the exported ring, index is ~0 while the slot is being written
+struct SoapyRTLSDRShmSlot
+{
+    std::atomic<unsigned long long> index;
+    std::atomic<unsigned long long> tick;
+    std::atomic<unsigned> size;
+    std::atomic<int> flags;
+};
+
+/*!
+ * Raw CU8 ring published in POSIX shared memory for other processes.
+ * There is one writer and any number of read-only readers; readers
+ * check the slot index before and after using the data to detect laps.
+ */
+class SoapyRTLSDRSharedRing
+{
+public:
+    //! Create and publish a ring, replacing a stale segment of the same name
+    SoapyRTLSDRSharedRing(const std::string &name, const size_t numSlots, const size_t slotSize,
+        const std::string &serial, const std::string &tuner);
+
+    //! Attach read-only to a published ring
+    SoapyRTLSDRSharedRing(const std::string &name);
+
+    ~SoapyRTLSDRSharedRing(void);
+
+    //! Write a buffer, splitting it across slots when it is larger than a slot
+    void write(const unsigned char *buf, const size_t len, const unsigned long long tick, const int flags,
+        const uint32_t sampleRate, const uint32_t frequency);
+
+    void setTuning(const uint32_t sampleRate, const uint32_t frequency);
+
+    const SoapyRTLSDRShmHeader &header(void) const;
+
+    const SoapyRTLSDRShmSlot &slot(const size_t index) const;
+
+    const signed char *data(const size_t index) const;
+
+private:
+    std::string _name;
+    bool _owner;
+    void *_mem;
+    size_t _size;
+    SoapyRTLSDRShmHeader *_header;
+    SoapyRTLSDRShmSlot *_slots;
+};
+
+//read-only devices attached to an exported ring, see rtlsdr_shm
+std::vector<SoapySDR::Kwargs> findRTLSDRShm(const SoapySDR::Kwargs &args);
+SoapySDR::Device *makeRTLSDRShm(const SoapySDR::Kwargs &args);
+
+//several dongles as one device, the serial arg lists them
+bool isRTLSDRArray(const SoapySDR::Kwargs &args);
+std::vector<SoapySDR::Kwargs> findRTLSDRArray(const SoapySDR::Kwargs &args);
+SoapySDR::Device *makeRTLSDRArray(const SoapySDR::Kwargs &args);
+
+/*!
+ * Transport to one dongle, librtlsdr for a local usb device or a
+ * connection to an rtl_tcp server. The setters mirror librtlsdr and
+ * return 0 on success, the getters report what was actually applied.
+ */
+class SoapyRTLSDRBackend
+{
+public:
+    virtual ~SoapyRTLSDRBackend(void);
+
+    virtual rtlsdr_tuner tunerType(void) const = 0;
+
+    //! Gain steps in tenths of a dB
+    virtual std::vector<int> tunerGains(void) const = 0;
+
+    virtual int setFrequency(const uint32_t frequency) = 0;
+    virtual uint32_t getFrequency(void) const = 0;
+    virtual int setFrequencyCorrection(const int ppm) = 0;
+    virtual int getFrequencyCorrection(void) const = 0;
+    virtual int setSampleRate(const uint32_t rate) = 0;
+    virtual uint32_t getSampleRate(void) const = 0;
+    virtual int setBandwidth(const uint32_t bandwidth) = 0;
+
+    //! Manual gain when true, the tuner agc otherwise
+    virtual int setGainMode(const bool manual) = 0;
+    virtual int setGain(const int gain) = 0;
+    virtual int setIFGain(const int stage, const int gain) = 0;
+    virtual int setDirectSampling(const int mode) = 0;
+    virtual int setOffsetTuning(const bool enable) = 0;
+    virtual int setAGCMode(const bool enable) = 0;
+    virtual int setTestMode(const bool enable) = 0;
+    virtual int setBiasTee(const bool enable) = 0;
+    virtual int setDithering(const bool enable) = 0;
+
+    //! Fill buf with raw samples, short or 0 after cancel(), -1 when the dongle is gone
+    virtual long read(unsigned char *buf, const size_t len) = 0;
+
+    //! Interrupt read() and the async loop
+    virtual void cancel(void) = 0;
+
+    //! Drop the samples queued before the next stream start
+    virtual void reset(void) = 0;
+};
+
+/*!
+ * A local dongle through librtlsdr.
+ */
+class SoapyRTLSDRUsbBackend : public SoapyRTLSDRBackend
+{
+public:
+    SoapyRTLSDRUsbBackend(const int deviceId);
+
+    ~SoapyRTLSDRUsbBackend(void);
+
+    //! The librtlsdr handle, for the usb strings and rtlsdr_read_async
+    rtlsdr_dev_t *device(void) const;
+
+    rtlsdr_tuner tunerType(void) const;
+    std::vector<int> tunerGains(void) const;
+    int setFrequency(const uint32_t frequency);
+    uint32_t getFrequency(void) const;
+    int setFrequencyCorrection(const int ppm);
+    int getFrequencyCorrection(void) const;
+    int setSampleRate(const uint32_t rate);
+    uint32_t getSampleRate(void) const;
+    int setBandwidth(const uint32_t bandwidth);
+    int setGainMode(const bool manual);
+    int setGain(const int gain);
+    int setIFGain(const int stage, const int gain);
+    int setDirectSampling(const int mode);
+    int setOffsetTuning(const bool enable);
+    int setAGCMode(const bool enable);
+    int setTestMode(const bool enable);
+    int setBiasTee(const bool enable);
+    int setDithering(const bool enable);
+    long read(unsigned char *buf, const size_t len);
+    void cancel(void);
+    void reset(void);
+
+private:
+    rtlsdr_dev_t *_dev;
+    std::atomic<bool> _cancel;
+};
+
+//rtl_tcp commands, a byte followed by a 32 bit big endian parameter
+#define RTLTCP_SET_FREQ 0x01
+#define RTLTCP_SET_SAMPLE_RATE 0x02
+#define RTLTCP_SET_GAIN_MODE 0x03
+#define RTLTCP_SET_GAIN 0x04
+#define RTLTCP_SET_FREQ_CORRECTION 0x05
+#define RTLTCP_SET_IF_GAIN 0x06
+#define RTLTCP_SET_TEST_MODE 0x07
+#define RTLTCP_SET_AGC_MODE 0x08
+#define RTLTCP_SET_DIRECT_SAMPLING 0x09
+#define RTLTCP_SET_OFFSET_TUNING 0x0a
+#define RTLTCP_SET_GAIN_BY_INDEX 0x0d
+#define RTLTCP_SET_BIAS_TEE 0x0e
+
+/*!
+ * Client of a remote rtl_tcp server, used in place of the
+ * USB device when the rtltcp=host:port device arg is given.
+ * rtl_tcp cannot be queried, the getters report the last values sent.
+ */
+class SoapyRTLSDRTcpClient : public SoapyRTLSDRBackend
+{
+public:
+    SoapyRTLSDRTcpClient(const std::string &address);
+
+    ~SoapyRTLSDRTcpClient(void);
+
+    const std::string &address(void) const;
+
+    rtlsdr_tuner tunerType(void) const;
+
+    //! Gain steps in tenths of a dB for the reported tuner
+    std::vector<int> tunerGains(void) const;
+
+    //! Send a command, 0 on success like the librtlsdr setters
+    int command(const uint8_t cmd, const uint32_t param);
+
+    int setFrequency(const uint32_t frequency);
+    uint32_t getFrequency(void) const;
+    int setFrequencyCorrection(const int ppm);
+    int getFrequencyCorrection(void) const;
+    int setSampleRate(const uint32_t rate);
+    uint32_t getSampleRate(void) const;
+    int setBandwidth(const uint32_t bandwidth);
+    int setGainMode(const bool manual);
+    int setGain(const int gain);
+    int setIFGain(const int stage, const int gain);
+    int setDirectSampling(const int mode);
+    int setOffsetTuning(const bool enable);
+    int setAGCMode(const bool enable);
+    int setTestMode(const bool enable);
+    int setBiasTee(const bool enable);
+    int setDithering(const bool enable);
+
+    //! Fill buf with samples, short or 0 after cancel(), -1 when disconnected
+    long read(unsigned char *buf, const size_t len);
+
+    //! Receive what is available without blocking, 0 when none, -1 when disconnected
+    long receiveSome(unsigned char *buf, const size_t len);
+
+    //! Socket to wait on for receiveSome()
+    int fd(void) const;
+
+    void cancel(void);
+
+    //! Discard what the server sent while the stream was stopped,
+    //! the stream restarts on a whole sample
+    void reset(void);
+
+private:
+    std::string _address;
+    int _sock;
+    rtlsdr_tuner _tunerType;
+    size_t _gainCount;
+    std::atomic<bool> _cancel;
+    std::mutex _mutex;
+    unsigned long long _received; //bytes since connecting, odd in the middle of a sample
+    uint32_t _frequency, _sampleRate;
+    int _ppm;
+};
+
+/*!
+ * Server for rtl_tcp clients, fed with the raw samples of this device.
+ * The rx thread copies into a byte queue and never blocks; every client
+ * sends from its own cursor into the queue and skips to the newest data,
+ * counting the dropped bytes, when it falls too far behind.
+ * Clients are read-only, their commands are ignored.
+ */
+class SoapyRTLSDRTcpServer
+{
+public:
+    SoapyRTLSDRTcpServer(const std::string &address, const size_t queueBytes,
+        const rtlsdr_tuner tunerType, const size_t gainCount);
+
+    ~SoapyRTLSDRTcpServer(void);
+
+    //! Queue raw samples for every client, called from the rx thread
+    void push(const unsigned char *buf, const size_t len);
+
+    //! Resize the queue keeping the newest bytes, push() must not be running
+    void resize(const size_t queueBytes);
+
+    size_t queueBytes(void) const;
+
+    //! Connected clients as peer:sentBytes:droppedBytes
+    std::string clients(void) const;
+
+private:
+    struct Client
+    {
+        int fd;
+        std::string peer;
+        size_t header; //header bytes left to send
+        unsigned long long cursor; //queue position of the next byte
+        unsigned long long sent, dropped;
+        bool blocked; //waiting for the socket to drain
+        size_t commands; //ignored command bytes
+    };
+
+    void serve(void);
+    void wake(void);
+    void watch(const int fd, const bool writable, const bool add);
+    void accept(void);
+    bool receive(Client &client);
+    void trim(Client &client);
+    bool send(Client &client);
+    std::vector<Client>::iterator disconnect(std::vector<Client>::iterator it);
+
+    std::string _address;
+    int _listen, _poll, _wake[2];
+    unsigned char _header[12];
+    std::vector<unsigned char> _ring;
+    std::mutex _ringMutex; //held by the server thread while it sends from the queue
+    std::atomic<unsigned long long> _written; //bytes pushed since the start
+    std::atomic<bool> _done;
+    std::thread _thread;
+    mutable std::mutex _mutex;
+    std::vector<Client> _clients;
+};
+
+/*!
+ * Latency profile of the settings calls. Each call records how long it
+ * blocked, then the rx thread measures how many samples after the call
+ * the block power took to settle near the power at the end of a window.
+ * A newer call ends the windows of the calls still being measured.
+ */
+class SoapyRTLSDRProfiler
+{
+public:
+    //! Record a call that returned at tick, the settling is measured over window samples
+    void call(const std::string &op, const double durationUs, const unsigned long long tick, const size_t window);
+
+    //! Measure the pending calls on raw samples, called from the rx thread
+    void samples(const unsigned char *buf, const size_t len, const unsigned long long tick);
+
+    //! Per operation op:calls:callUs:settleSamples, distributions as min/p50/p90/max
+    std::string report(void) const;
+
+private:
+    struct Pending
+    {
+        std::string op;
+        unsigned long long tick;
+        size_t window; //blocks to measure
+        unsigned long long sum;
+        size_t fill;
+        std::vector<double> power; //mean power per block
+    };
+
+    void finish(const Pending &pending);
+
+    mutable std::mutex _mutex;
+    std::map<std::string, std::vector<double>> _calls, _settles;
+    std::vector<Pending> _pending;
+};
+
+class SoapyRTLSDR;
+
+/*!
+ * One process-wide thread that receives for every rtl_tcp device
+ * streaming with rtltcp_engine=shared, in place of a thread per device.
+ * The thread runs while at least one device is attached.
+ */
+class SoapyRTLSDRTcpEngine
+{
+public:
+    static void attach(SoapyRTLSDR *device, const int fd);
+
+    //! Blocks until the engine is done with the device
+    static void detach(SoapyRTLSDR *device);
+
+private:
+    SoapyRTLSDRTcpEngine(void);
+    ~SoapyRTLSDRTcpEngine(void);
+    static SoapyRTLSDRTcpEngine &instance(void);
+
+    void serve(void);
+    void wake(void);
+
+    int _poll, _wake[2];
+    bool _done;
+    std::thread _thread;
+    std::mutex _lifecycle; //serializes attach and detach
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::vector<std::pair<int, SoapyRTLSDR *>> _devices;
+    SoapyRTLSDR *_busy; //device the thread is receiving for
+};
+
+//! In-place radix-2 complex FFT of a power of two size
+class SoapyRTLSDRFFT
+{
+public:
+    SoapyRTLSDRFFT(const size_t size);
+
+    size_t size(void) const;
+
+    //! The inverse transform is not scaled
+    void transform(std::complex<float> *data, const bool inverse) const;
+
+private:
+    size_t _size;
+    std::vector<std::complex<float>> _twiddles;
+    std::vector<size_t> _bitrev;
+};
+
+/*!
+ * Channel filter run on the converted samples of one stream:
+ * frequency shift, FIR filter and decimation. The FIR is computed
+ * with overlap-save fast convolution so long filters stay cheap.
+ */
+class SoapyRTLSDRChannelFilter
+{
+public:
+    //! Shift is in cycles per input sample, the channel at +shift moves to DC
+    SoapyRTLSDRChannelFilter(const std::vector<float> &taps, const double shift, const size_t decim);
+
+    //! Design a lowpass, the cutoff is relative to the input rate
+    static std::vector<float> lowpass(const size_t numTaps, const double cutoff);
+
+    //! Filter the input, the decimated output is appended to out
+    void process(const std::complex<float> *in, const size_t numElems, std::vector<std::complex<float>> &out);
+
+    //! Clear the filter history after a discontinuity
+    void reset(void);
+
+    size_t decimation(void) const;
+
+    //! Group delay in input samples
+    size_t delay(void) const;
+
+private:
+    void runBlock(std::vector<std::complex<float>> &out);
+
+    size_t _numTaps;
+    SoapyRTLSDRFFT _fft;
+    size_t _fftSize, _blockSize;
+    std::vector<std::complex<float>> _response; //transform of the taps
+    std::vector<std::complex<float>> _block; //history and new input
+    std::vector<std::complex<float>> _work;
+    size_t _fill; //new input in the block
+    double _shift, _phase;
+    size_t _decim, _decimPhase;
+};
+
+/*!
+ * Polyphase resampler between two integer rates, only their ratio
+ * up/down matters. The output position is kept exactly in 1/up input
+ * samples, so output n lies at input sample n * down / up after a reset.
+ * Ratios with more than RESAMPLER_MAX_PHASES phases interpolate
+ * linearly between the two nearest phases of the bank.
+ */
+class SoapyRTLSDRResampler
+{
+public:
+    //! The taps per phase are scaled up by the decimation when down > up
+    SoapyRTLSDRResampler(const unsigned long long inputRate, const unsigned long long outputRate, const size_t tapsPerPhase);
+
+    //! Resample the input, the output is appended to out
+    void process(const std::complex<float> *in, const size_t numElems, std::vector<std::complex<float>> &out);
+
+    //! Clear the history after a discontinuity
+    void reset(void);
+
+    //! Group delay in input samples
+    double delay(void) const;
+
+private:
+    unsigned long long _up, _down;
+    size_t _numPhases, _numTaps;
+    std::vector<float> _bank; //phase major, taps reversed
+    std::vector<std::complex<float>> _history;
+    unsigned long long _position; //next output in 1/up input samples from the history start
+};
+
+/*!
+ * Per-stream state, used as the stream handle.
+ * Every stream reads the shared ring with its own cursor;
+ * the cursor counts are protected by the device buffer mutex.
+ */
+struct SoapyRTLSDRStream
+{
+    SoapyRTLSDRStream(void):
+        format(RTL_RX_FORMAT_FLOAT32),
+        planar(false),
+        head(0),
+        count(0),
+        held(0),
+        overflowEvent(false),
+        resetBuffer(false),
+        active(false),
+        currentBuff(nullptr),
+        currentHandle(0),
+        currentFlags(0),
+        bufferedElems(0),
+        bufTicks(0),
+        filteredHead(0),
+        filteredTick(0),
+        filterNextTick(-1),
+        resampleRate(0),
+        resampleTaps(DEFAULT_RESAMPLE_TAPS),
+        resampleFrom(0),
+        resampledCount(0),
+        resampleDelayNs(0),
+        fmNextTick(-1)
+    {}
+
+    rtlsdrRXFormat format;
+    bool planar; //I and Q in separate buffers
+    size_t head; //next slot to acquire
+    size_t count; //slots written but not acquired
+    size_t held; //slots acquired but not released
+    bool overflowEvent;
+    bool resetBuffer;
+    bool active;
+
+    //readStream remainder
+    signed char *currentBuff;
+    size_t currentHandle;
+    int currentFlags;
+    size_t bufferedElems;
+    long long bufTicks;
+
+    //optional channel filter, output waits in filtered
+    std::unique_ptr<SoapyRTLSDRChannelFilter> filter;
+    std::vector<std::complex<float>> filterIn, filtered;
+    size_t filteredHead;
+    long long filteredTick; //input tick of filtered[filteredHead]
+    long long filterNextTick; //expected tick of the next raw buffer
+
+    //optional resampler after the channel filter, built for the device rate on the first read
+    unsigned long resampleRate;
+    size_t resampleTaps;
+    std::unique_ptr<SoapyRTLSDRResampler> resampler;
+    std::vector<std::complex<float>> resampleIn;
+    uint32_t resampleFrom; //device rate of the resampler
+    unsigned long long resampledCount; //outputs handed out since the reset
+    long long resampleDelayNs;
+
+    //fm discriminator state
+    std::complex<float> fmLast;
+    long long fmNextTick;
+};
 
 class SoapyRTLSDR: public SoapySDR::Device
 {
@@ -101,6 +757,16 @@ public:
             long long &timeNs,
             const long timeoutUs = 100000);
 
+    //! Convert raw samples of stream with the device settings
+    void convertStream(
+            SoapySDR::Stream *stream,
+            const rtlsdrRXFormat format,
+            const bool planar,
+            void * const *buffs,
+            const signed char *in,
+            const size_t numElems,
+            const long long tick);
+
     /*******************************************************************
      * Direct buffer access API
      ******************************************************************/
@@ -216,6 +882,19 @@ public:
 
     void setHardwareTime(const long long timeNs, const std::string &what = "");
 
+    /*******************************************************************
+     * History API
+     ******************************************************************/
+
+    /*!
+     * Copy raw CU8 samples from the history ring (history_ms stream arg).
+     * \param tick the sample index of the first sample, see timeNsToTicks
+     * \param buff the destination for numElems CU8 samples
+     * \return the number of samples copied or SOAPY_SDR_TIME_ERROR
+     * when the window is no longer (or not yet) in the history
+     */
+    long long readHistory(const long long tick, void *buff, const size_t numElems) const;
+
     /*******************************************************************
      * Utility
      ******************************************************************/
@@ -237,51 +916,172 @@ public:
 
 private:
 
-    //device handle
+    //the settings go through the backend, dev is the librtlsdr handle
+    //of a usb backend and _tcp the client of an rtl_tcp one
     int deviceId;
+    std::unique_ptr<SoapyRTLSDRBackend> _backend;
     rtlsdr_dev_t *dev;
+    SoapyRTLSDRTcpClient *_tcp;
+    void openUsb(const SoapySDR::Kwargs &args);
 
     //cached settings
-    rtlsdrRXFormat rxFormat;
     rtlsdr_tuner tunerType;
     uint32_t sampleRate, centerFrequency, bandwidth;
+
+    //lo_offset tunes the hardware away from the requested centerFrequency,
+    //the conversion shifts the samples back by the difference
+    double loOffset;
+    uint32_t tunedFrequency;
+    std::atomic<long long> _ncoFrequency;
     int ppm, directSamplingMode;
     size_t numBuffers, bufferLength, asyncBuffs;
+    double latencyMs, headroomMs;
     bool iqSwap, gainMode, offsetMode, digitalAGC, testMode, biasTee, dithering;
-    double IFGain[6], tunerGain;
+    double IFGain[6];
     std::atomic<long long> ticks;
 
-    std::vector<std::complex<float> > _lut_32f;
-    std::vector<std::complex<float> > _lut_swap_32f;
-    std::vector<std::complex<int16_t> > _lut_16i;
-    std::vector<std::complex<int16_t> > _lut_swap_16i;
+    //the tuner gain is stepped by the software agc on its own thread,
+    //the gain mutex orders those steps against setGain
+    std::atomic<double> tunerGain;
+    std::mutex _gainMutex;
+
+    //software agc on the tuner gain table
+    std::atomic<bool> softAGC;
+    double agcSetPoint, agcHysteresis;
+    std::vector<int> tunerGains;
+    rtlsdrSignalStats _agcStats;
+    std::atomic<long long> _agcSettleTick;
+
+    //gain steps wait for the agc thread, the mutex also guards the events
+    std::thread _agcThread;
+    mutable std::mutex _agcMutex;
+    std::condition_variable _agcCond;
+    std::atomic<int> _agcStep; //tenths of a dB, -1 when none is pending
+    long long _agcStepTick; //first sample of the measurement behind the step
+    bool _agcExit;
+    std::vector<std::pair<long long, double>> _agcEvents;
+    void agcOperation(void);
+    void startAGC(void);
+    void stopAGC(void);
+
+    //async thread scheduling
+    std::string threadAffinity, threadScheduler;
+    int threadPriority;
 
 
 public:
     struct Buffer
     {
         unsigned long long tick;
-        std::vector<signed char> data;
+        int flags;
+        signed char *data;
+        size_t size;
     };
 
     //async api usage
     std::thread _rx_async_thread;
     void rx_async_operation(void);
+    void rx_tcp_operation(void);
+    void cancelAsync(void);
+    void resetAsync(void);
+    void startAsync(void);
+    void stopAsync(void);
+    bool asyncRunning(void) const;
+    void configureThread(const std::string &name) const;
     void rx_callback(unsigned char *buf, uint32_t len);
+    void dispatchBuffer(const unsigned char *buf, const size_t len, const size_t index);
+    void pushBuffer(const unsigned char *buf, const size_t len, const unsigned long long tick, const int flags);
+    bool reserveBuffer(size_t &index);
+    void commitBuffer(const size_t index, const size_t len, const unsigned long long tick, const int flags);
+    void softAGCUpdate(const rtlsdrSignalStats &stats, const long long tick);
+    int readFiltered(SoapyRTLSDRStream *rxStream, void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    void resetResampler(SoapyRTLSDRStream *rxStream, const long long decim);
+
+    //history ring of raw samples, written by the rx callback,
+    //reallocated with the rx thread stopped when the rate changes
+    void historyBuffer(const unsigned char *buf, const size_t len, const unsigned long long tick);
+    void dumpHistory(const std::string &request) const;
+    size_t historySizing(const size_t length) const;
+    void allocateHistory(void);
+    mutable std::mutex _historyMutex; //readers against a reallocation
+    std::shared_ptr<SoapyRTLSDRArena> _historyArena;
+    signed char *_history;
+    size_t _historySize;
+    double historyMs;
+    std::atomic<unsigned long long> _historyWritten; //total bytes since the base tick
+    std::atomic<long long> _historyBaseTick;
+    std::atomic<unsigned long long> _historyEpoch; //bumped on tick discontinuities
+
+    //squelch gate state, owned by the rx callback
+    void squelchBuffer(const unsigned char *buf, const size_t len, const unsigned long long tick);
+    bool squelchEnabled, _squelchOpen;
+    double squelchLevel, squelchHangMs, squelchPrerollMs;
+    size_t _squelchHangBuffers, _squelchHang;
+    std::vector<Buffer> _preroll;
+    size_t _prerollHead, _prerollCount;
 
     std::mutex _buf_mutex;
     std::condition_variable _buf_cond;
 
+    void allocateBuffers(void);
+    void resetSlots(void);
+    void releaseBuffers(void);
+    void latencySizing(size_t &length, size_t &buffers, size_t &async) const;
+    void applyLatencySizing(void);
+    std::atomic<bool> _resizeBuffers;
+
     std::vector<Buffer> _buffs;
-    size_t	_buf_head;
+    std::shared_ptr<SoapyRTLSDRArena> _arena;
+    signed char *_arenaBuffs;
+    std::string _arenaLayout;
+    std::string arenaName;
+    size_t arenaSize;
+    bool arenaHugepages, arenaLock;
     size_t	_buf_tail;
-    std::atomic<size_t>	_buf_count;
-    signed char *_currentBuff;
-    std::atomic<bool> _overflowEvent;
-    size_t _currentHandle;
-    size_t bufferedElems;
-    long long bufTicks;
-    std::atomic<bool> resetBuffer;
+    std::vector<size_t> _buf_slots; //buffer behind each ring slot
+    std::vector<size_t> _buf_spares; //buffers outside of the ring
+    std::vector<int> _buf_users; //readers holding each buffer
+
+    //transactional apply of a whole configuration, see the apply setting
+    void applyConfiguration(const SoapySDR::Kwargs &target);
+    SoapySDR::Kwargs currentConfiguration(void) const;
+    std::atomic<bool> _applying; //dispatchBuffer drops samples meanwhile
+
+    //optional latency profile of the settings calls
+    void profileSetting(const std::string &op, const std::chrono::steady_clock::time_point &start);
+    std::shared_ptr<SoapyRTLSDRProfiler> _profiler;
+
+    //iq calibration applied in the conversion, keyed by serial or rtl_tcp address
+    void calibrateIQ(const size_t numElems);
+    void setCalibration(const std::string &value);
+    std::string calibrationKey, calibrationFile;
+    std::shared_ptr<const SoapyRTLSDRCalibration> _calibration;
+
+    //optional export of the ring to other processes
+    std::unique_ptr<SoapyRTLSDRSharedRing> _shm;
+    std::unique_ptr<SoapyRTLSDRTcpServer> _tcpServer;
+    size_t tcpQueueSizing(const size_t length) const;
+    double tcpQueueMs;
+
+    //rtl_tcp receive on the shared engine thread
+    bool rx_tcp_ready(void);
+    bool tcpShared, _tcpAttached;
+    std::vector<unsigned char> _tcpScratch;
+    size_t _tcpFill;
+
+    //usb receive in the thread of acquireReadBuffer, no rx thread
+    void rx_usb_read(SoapyRTLSDRStream *rxStream);
+    bool usbReader;
+    std::atomic<bool> _usbReading;
+    std::mutex _usbReadMutex;
+    std::vector<unsigned char> _usbScratch;
+    std::chrono::steady_clock::time_point _usbReadEnd;
+
+    //streams reading from the ring
+    void setupRing(const SoapySDR::Kwargs &args);
+    void resetStreams(void);
+    std::mutex _streamMutex;
+    std::vector<SoapyRTLSDRStream *> _streams;
 
     double gainMin, gainMax;
 };
@@ -27,9 +27,29 @@
 #include <SoapySDR/Logger.hpp>
 #include <SoapySDR/Formats.hpp>
 #include <SoapySDR/Time.hpp>
-#include <algorithm> //min
-#include <climits> //SHRT_MAX
+#include <algorithm> //min, find_if
+#include <climits> //SHRT_MAX, USHRT_MAX
+#include <limits>
 #include <cstring> // memcpy
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//complex ieee half, SoapySDR has no constant for it
+#ifndef SOAPY_SDR_CF16
+#define SOAPY_SDR_CF16 "CF16"
+#endif
 
 
 std::vector<std::string> SoapyRTLSDR::getStreamFormats(const int direction, const size_t channel) const {
@@ -38,6 +58,12 @@ std::vector<std::string> SoapyRTLSDR::getStreamFormats(const int direction, cons
     formats.push_back(SOAPY_SDR_CS8);
     formats.push_back(SOAPY_SDR_CS16);
     formats.push_back(SOAPY_SDR_CF32);
+    formats.push_back(SOAPY_SDR_CU8);
+    formats.push_back(SOAPY_SDR_CF16);
+    formats.push_back(SOAPY_SDR_U16);
+    formats.push_back(SOAPY_SDR_S8);
+    formats.push_back(SOAPY_SDR_S16);
+    formats.push_back(SOAPY_SDR_F32);
 
     return formats;
 }
@@ -90,9 +116,750 @@ SoapySDR::ArgInfoList SoapyRTLSDR::getStreamArgsInfo(const int direction, const
 
     streamArgs.push_back(asyncbuffsArg);
 
+    SoapySDR::ArgInfo latencyArg;
+    latencyArg.key = "latency_ms";
+    latencyArg.value = "0";
+    latencyArg.name = "Latency target";
+    latencyArg.description = "Size buffers for this latency at the current sample rate, overrides bufflen, buffers and asyncBuffs (0 to disable).";
+    latencyArg.units = "ms";
+    latencyArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(latencyArg);
+
+    SoapySDR::ArgInfo headroomArg;
+    headroomArg.key = "headroom_ms";
+    headroomArg.value = std::to_string(DEFAULT_HEADROOM_MS);
+    headroomArg.name = "Ring headroom";
+    headroomArg.description = "Total ring duration when using latency_ms.";
+    headroomArg.units = "ms";
+    headroomArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(headroomArg);
+
+    SoapySDR::ArgInfo historyArg;
+    historyArg.key = "history_ms";
+    historyArg.value = "0";
+    historyArg.name = "History";
+    historyArg.description = "Keep this much raw CU8 data for pre-trigger capture through the history_dump setting (0 to disable).";
+    historyArg.units = "ms";
+    historyArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(historyArg);
+
+    SoapySDR::ArgInfo squelchArg;
+    squelchArg.key = "squelch";
+    squelchArg.value = "";
+    squelchArg.name = "Squelch";
+    squelchArg.description = "Only stream buffers above this power, gaps show up in the timestamps (empty to disable).";
+    squelchArg.units = "dBFS";
+    squelchArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(squelchArg);
+
+    SoapySDR::ArgInfo squelchHangArg;
+    squelchHangArg.key = "squelch_hang_ms";
+    squelchHangArg.value = std::to_string(DEFAULT_SQUELCH_HANG_MS);
+    squelchHangArg.name = "Squelch hang";
+    squelchHangArg.description = "Post-roll streamed after the power drops below the squelch, the last buffer ends the burst.";
+    squelchHangArg.units = "ms";
+    squelchHangArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(squelchHangArg);
+
+    SoapySDR::ArgInfo squelchPrerollArg;
+    squelchPrerollArg.key = "squelch_preroll_ms";
+    squelchPrerollArg.value = std::to_string(DEFAULT_SQUELCH_PREROLL_MS);
+    squelchPrerollArg.name = "Squelch pre-roll";
+    squelchPrerollArg.description = "Data from before the squelch opens that is streamed with the burst.";
+    squelchPrerollArg.units = "ms";
+    squelchPrerollArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(squelchPrerollArg);
+
+    SoapySDR::ArgInfo affinityArg;
+    affinityArg.key = "affinity";
+    affinityArg.value = "";
+    affinityArg.name = "CPU affinity";
+    affinityArg.description = "CPU list for the stream threads, example: 0-3,6 (empty for no pinning).";
+    affinityArg.type = SoapySDR::ArgInfo::STRING;
+
+    streamArgs.push_back(affinityArg);
+
+    SoapySDR::ArgInfo schedulerArg;
+    schedulerArg.key = "scheduler";
+    schedulerArg.value = "";
+    schedulerArg.name = "Scheduler";
+    schedulerArg.description = "Scheduling policy for the stream threads, uses priority as the real-time priority or nice level.";
+    schedulerArg.type = SoapySDR::ArgInfo::STRING;
+    schedulerArg.options.push_back("");
+    schedulerArg.optionNames.push_back("Default");
+    schedulerArg.options.push_back("other");
+    schedulerArg.optionNames.push_back("Nice level");
+    schedulerArg.options.push_back("fifo");
+    schedulerArg.optionNames.push_back("SCHED_FIFO");
+    schedulerArg.options.push_back("rr");
+    schedulerArg.optionNames.push_back("SCHED_RR");
+
+    streamArgs.push_back(schedulerArg);
+
+    SoapySDR::ArgInfo priorityArg;
+    priorityArg.key = "priority";
+    priorityArg.value = "0";
+    priorityArg.name = "Priority";
+    priorityArg.description = "Real-time priority (fifo, rr) or nice level (other) for the stream threads.";
+    priorityArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(priorityArg);
+
+    SoapySDR::ArgInfo hugepagesArg;
+    hugepagesArg.key = "hugepages";
+    hugepagesArg.value = "false";
+    hugepagesArg.name = "Hugepages";
+    hugepagesArg.description = "Back the ring buffers with 2 MiB hugepages when available.";
+    hugepagesArg.type = SoapySDR::ArgInfo::BOOL;
+
+    streamArgs.push_back(hugepagesArg);
+
+    SoapySDR::ArgInfo mlockArg;
+    mlockArg.key = "mlock";
+    mlockArg.value = "false";
+    mlockArg.name = "Lock memory";
+    mlockArg.description = "Lock the ring buffers into memory (see RLIMIT_MEMLOCK).";
+    mlockArg.type = SoapySDR::ArgInfo::BOOL;
+
+    streamArgs.push_back(mlockArg);
+
+    SoapySDR::ArgInfo arenaArg;
+    arenaArg.key = "arena";
+    arenaArg.value = "";
+    arenaArg.name = "Shared arena";
+    arenaArg.description = "Name of a process-wide arena to share with other streams (empty for a private arena).";
+    arenaArg.type = SoapySDR::ArgInfo::STRING;
+
+    streamArgs.push_back(arenaArg);
+
+    SoapySDR::ArgInfo arenaSizeArg;
+    arenaSizeArg.key = "arena_size";
+    arenaSizeArg.value = "0";
+    arenaSizeArg.name = "Shared arena size";
+    arenaSizeArg.description = "Size of the shared arena when this stream creates it (0 for just this stream).";
+    arenaSizeArg.units = "bytes";
+    arenaSizeArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(arenaSizeArg);
+
+    SoapySDR::ArgInfo shmArg;
+    shmArg.key = "shm";
+    shmArg.value = "";
+    shmArg.name = "Shared memory export";
+    shmArg.description = "Publish the raw CU8 ring in POSIX shared memory under this name, other processes open it with rtlsdr_shm=name, a name held by a running producer is refused (empty to disable).";
+    shmArg.type = SoapySDR::ArgInfo::STRING;
+
+    streamArgs.push_back(shmArg);
+
+    SoapySDR::ArgInfo tcpServerArg;
+    tcpServerArg.key = "rtltcp_server";
+    tcpServerArg.value = "";
+    tcpServerArg.name = "rtl_tcp server";
+    tcpServerArg.description = "Serve the raw samples to read-only rtl_tcp clients on port or host:port while the stream is active (empty to disable).";
+    tcpServerArg.type = SoapySDR::ArgInfo::STRING;
+
+    streamArgs.push_back(tcpServerArg);
+
+    SoapySDR::ArgInfo tcpQueueArg;
+    tcpQueueArg.key = "rtltcp_queue_ms";
+    tcpQueueArg.value = std::to_string(DEFAULT_RTLTCP_QUEUE_MS);
+    tcpQueueArg.name = "rtl_tcp queue";
+    tcpQueueArg.description = "Samples queued for rtl_tcp clients, a client that falls half this far behind drops data.";
+    tcpQueueArg.units = "ms";
+    tcpQueueArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(tcpQueueArg);
+
+    SoapySDR::ArgInfo tcpEngineArg;
+    tcpEngineArg.key = "rtltcp_engine";
+    tcpEngineArg.value = "thread";
+    tcpEngineArg.name = "rtl_tcp receive engine";
+    tcpEngineArg.description = "Receive from the rtl_tcp server on a thread for this device, or on one thread shared by every rtl_tcp device of the process.";
+    tcpEngineArg.type = SoapySDR::ArgInfo::STRING;
+    tcpEngineArg.options.push_back("thread");
+    tcpEngineArg.options.push_back("shared");
+
+    streamArgs.push_back(tcpEngineArg);
+
+    SoapySDR::ArgInfo usbEngineArg;
+    usbEngineArg.key = "usb_engine";
+    usbEngineArg.value = "thread";
+    usbEngineArg.name = "USB receive engine";
+    usbEngineArg.description = "Receive USB transfers on a thread for this device, or synchronously in the thread that reads the stream. "
+        "The reader mode runs one thread per dongle instead of two, but a read blocks for a whole transfer, "
+        "the other consumers only get samples while the stream is read, and samples the dongle sends meanwhile are lost: "
+        "they are counted in the time stamps and reported as an overflow. The rx thread settings have no effect.";
+    usbEngineArg.type = SoapySDR::ArgInfo::STRING;
+    usbEngineArg.options.push_back("thread");
+    usbEngineArg.options.push_back("reader");
+
+    streamArgs.push_back(usbEngineArg);
+
+    SoapySDR::ArgInfo filterTapsArg;
+    filterTapsArg.key = "filter_taps";
+    filterTapsArg.value = "";
+    filterTapsArg.name = "Channel filter taps";
+    filterTapsArg.description = "Real FIR taps for the channel filter separated by spaces or semicolons, overrides filter_cutoff (empty to design the taps).";
+    filterTapsArg.type = SoapySDR::ArgInfo::STRING;
+
+    streamArgs.push_back(filterTapsArg);
+
+    SoapySDR::ArgInfo filterCutoffArg;
+    filterCutoffArg.key = "filter_cutoff";
+    filterCutoffArg.value = "";
+    filterCutoffArg.name = "Channel filter cutoff";
+    filterCutoffArg.description = "Design a lowpass channel filter with this cutoff (empty for 40% of the decimated rate when decimating).";
+    filterCutoffArg.units = "Hz";
+    filterCutoffArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(filterCutoffArg);
+
+    SoapySDR::ArgInfo filterNumTapsArg;
+    filterNumTapsArg.key = "filter_num_taps";
+    filterNumTapsArg.value = std::to_string(DEFAULT_FILTER_TAPS);
+    filterNumTapsArg.name = "Channel filter length";
+    filterNumTapsArg.description = "Number of taps in the designed channel filter.";
+    filterNumTapsArg.units = "taps";
+    filterNumTapsArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(filterNumTapsArg);
+
+    SoapySDR::ArgInfo filterShiftArg;
+    filterShiftArg.key = "filter_shift";
+    filterShiftArg.value = "0";
+    filterShiftArg.name = "Channel offset";
+    filterShiftArg.description = "Offset of the channel from the center frequency, it is shifted to DC before filtering.";
+    filterShiftArg.units = "Hz";
+    filterShiftArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(filterShiftArg);
+
+    SoapySDR::ArgInfo filterDecimArg;
+    filterDecimArg.key = "filter_decim";
+    filterDecimArg.value = "1";
+    filterDecimArg.name = "Channel decimation";
+    filterDecimArg.description = "Keep every Nth filtered sample, the stream runs at getSampleRate() / N while getSampleRate() keeps reporting the device rate, timestamps stay in device rate ticks.";
+    filterDecimArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(filterDecimArg);
+
+    SoapySDR::ArgInfo resampleRateArg;
+    resampleRateArg.key = "resample_rate";
+    resampleRateArg.value = "";
+    resampleRateArg.name = "Resample rate";
+    resampleRateArg.description = "Resample the stream after the channel filter to exactly this rate, getSampleRate() keeps reporting the device rate, timestamps stay exact (empty for the device rate).";
+    resampleRateArg.units = "Hz";
+    resampleRateArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(resampleRateArg);
+
+    SoapySDR::ArgInfo resampleTapsArg;
+    resampleTapsArg.key = "resample_taps";
+    resampleTapsArg.value = std::to_string(DEFAULT_RESAMPLE_TAPS);
+    resampleTapsArg.name = "Resampler length";
+    resampleTapsArg.description = "Taps per phase of the resampler, multiplied by the decimation when the rate goes down.";
+    resampleTapsArg.units = "taps";
+    resampleTapsArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(resampleTapsArg);
+
+    SoapySDR::ArgInfo magnitudeArg;
+    magnitudeArg.key = "magnitude";
+    magnitudeArg.value = "linear";
+    magnitudeArg.name = "Magnitude";
+    magnitudeArg.description = "Output of the U16 format, a full scale rail is 32768 for both.";
+    magnitudeArg.type = SoapySDR::ArgInfo::STRING;
+    magnitudeArg.options.push_back("linear");
+    magnitudeArg.optionNames.push_back("Magnitude");
+    magnitudeArg.options.push_back("squared");
+    magnitudeArg.optionNames.push_back("Magnitude squared");
+
+    streamArgs.push_back(magnitudeArg);
+
+    SoapySDR::ArgInfo demodArg;
+    demodArg.key = "demod";
+    demodArg.value = "";
+    demodArg.name = "Demodulator";
+    demodArg.description = "Deliver F32 or S16 FM discriminator output, full scale is a deviation of half the sample rate (empty to disable).";
+    demodArg.type = SoapySDR::ArgInfo::STRING;
+    demodArg.options.push_back("");
+    demodArg.optionNames.push_back("None");
+    demodArg.options.push_back("fm");
+    demodArg.optionNames.push_back("FM");
+
+    streamArgs.push_back(demodArg);
+
+    SoapySDR::ArgInfo layoutArg;
+    layoutArg.key = "layout";
+    layoutArg.value = "interleaved";
+    layoutArg.name = "Sample layout";
+    layoutArg.description = "Complex formats write interleaved I/Q to buffs[0], or I to buffs[0] and Q to buffs[1] when planar.";
+    layoutArg.type = SoapySDR::ArgInfo::STRING;
+    layoutArg.options.push_back("interleaved");
+    layoutArg.optionNames.push_back("Interleaved");
+    layoutArg.options.push_back("planar");
+    layoutArg.optionNames.push_back("Planar");
+
+    streamArgs.push_back(layoutArg);
+
     return streamArgs;
 }
 
+/*******************************************************************
+ * Conversion kernels
+ ******************************************************************/
+
+//power of one raw rail, scaled so that full scale is 1 << 16
+static inline unsigned rawPower(const unsigned char x)
+{
+    const int c = 2 * int(x) - 255;
+    return unsigned(c * c);
+}
+
+static inline unsigned rawClipped(const unsigned char i, const unsigned char q)
+{
+    return (i == 0 or i == 255 or q == 0 or q == 255) ? 1 : 0;
+}
+
+//power and clipping of a raw buffer for the software agc
+static void measureRaw(rtlsdrSignalStats &stats, const unsigned char *raw, const size_t numElems)
+{
+    for (size_t i = 0; i < numElems; i++)
+    {
+        stats.power += rawPower(raw[i * 2]) + rawPower(raw[i * 2 + 1]);
+        stats.clipped += rawClipped(raw[i * 2], raw[i * 2 + 1]);
+    }
+    stats.count += numElems;
+}
+
+//ieee half with round to nearest even, portable in place of f16c
+static inline uint16_t floatToHalf(const float value)
+{
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const int exponent = int((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31) return sign | 0x7c00;
+
+    //subnormal halfs keep the implicit bit in the mantissa
+    uint32_t shift = 13;
+    uint32_t half = (uint32_t(std::max(exponent, 0)) << 10);
+    if (exponent <= 0)
+    {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+    }
+    half |= mantissa >> shift;
+
+    //a carry out of the mantissa correctly bumps the exponent
+    const uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+    if (rest > halfway or (rest == halfway and (half & 1))) half++;
+    return sign | uint16_t(half);
+}
+
+SoapyRTLSDRTables::SoapyRTLSDRTables(void)
+{
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "Generating RTL-SDR lookup tables");
+    for (unsigned int x = 0; x < 256; x++)
+    {
+        f32[x] = (x - RAW_BIAS) * (1.0f / 128.0f);
+        s16[x] = int16_t(float(SHRT_MAX) * f32[x]);
+        f16[x] = floatToHalf(f32[x]);
+    }
+
+    //the bias is not centered between two codes, so the magnitude is not
+    //symmetric in the raw rails and every pair gets its own entry
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        for (unsigned int q = 0; q < 256; q++)
+        {
+            const double power = double(f32[i]) * f32[i] + double(f32[q]) * f32[q];
+            mag16[(i << 8) | q] = uint16_t(std::lround(std::sqrt(power) * 32768.0));
+            magsq16[(i << 8) | q] = uint16_t(std::min<long>(std::lround(power * 32768.0), USHRT_MAX));
+        }
+    }
+}
+
+const SoapyRTLSDRTables &SoapyRTLSDRTables::get(void)
+{
+    static const SoapyRTLSDRTables tables;
+    return tables;
+}
+
+//where the converted rails go, interleaved in one buffer or planar in two,
+//swapped I/Q only exchanges the rails
+template <typename T>
+struct OutputRails
+{
+    OutputRails(void * const *buffs, const bool planar, const bool swap):
+        i((T *)buffs[0]), q(planar ? (T *)buffs[1] : (T *)buffs[0] + 1), stride(planar ? 1 : 2)
+    {
+        if (swap) std::swap(i, q);
+    }
+
+    OutputRails(T *out, const bool swap):
+        i(out), q(out + 1), stride(2)
+    {
+        if (swap) std::swap(i, q);
+    }
+
+    T *i, *q;
+    size_t stride;
+};
+
+template <typename T>
+static void convertLUT(const OutputRails<T> &out, const T *lut, const signed char *in, const size_t numElems)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    for (size_t i = 0; i < numElems; i++)
+    {
+        const unsigned char x = raw[i * 2], y = raw[i * 2 + 1];
+        out.i[i * out.stride] = lut[x];
+        out.q[i * out.stride] = lut[y];
+    }
+}
+
+static void convertCS8(const OutputRails<int8_t> &out, const signed char *in, const size_t numElems)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    for (size_t i = 0; i < numElems; i++)
+    {
+        const unsigned char x = raw[i * 2], y = raw[i * 2 + 1];
+        out.i[i * out.stride] = x - 128;
+        out.q[i * out.stride] = y - 128;
+    }
+}
+
+//the raw samples are already CU8, only a swap or the planar layout needs a pass
+static void convertCU8(const OutputRails<uint8_t> &out, const signed char *in, const size_t numElems)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    if (out.q == out.i + 1) std::memcpy(out.i, in, numElems * BYTES_PER_SAMPLE);
+    else for (size_t i = 0; i < numElems; i++)
+    {
+        const unsigned char x = raw[i * 2], y = raw[i * 2 + 1];
+        out.i[i * out.stride] = x;
+        out.q[i * out.stride] = y;
+    }
+}
+
+//cs8 to cu8 in place, adding 128 flips the sign bit
+static void offsetBinary(const OutputRails<int8_t> &out, const size_t numElems)
+{
+    for (size_t i = 0; i < numElems; i++)
+    {
+        out.i[i * out.stride] ^= 0x80;
+        out.q[i * out.stride] ^= 0x80;
+    }
+}
+
+static void convertHalf(const OutputRails<uint16_t> &out, const std::complex<float> *in, const size_t numElems)
+{
+    for (size_t i = 0; i < numElems; i++)
+    {
+        out.i[i * out.stride] = floatToHalf(in[i].real());
+        out.q[i * out.stride] = floatToHalf(in[i].imag());
+    }
+}
+
+//phase of the re-centering oscillator at a tick, whole cycles are dropped exactly
+static std::complex<float> ncoRotation(const long long tick, const long long frequency, const uint32_t rate)
+{
+    const long long cycles = ((tick % rate) * (frequency % rate)) % rate;
+    return std::polar(1.0f, float(2 * M_PI * double(cycles) / rate));
+}
+
+//clamp and truncate toward zero into an integer format like the s16 table,
+//so the corrected and the table conversions agree
+template <typename T>
+static inline T saturate(const float x)
+{
+    return T(std::max(float(std::numeric_limits<T>::min()), std::min(float(std::numeric_limits<T>::max()), x)));
+}
+
+template <>
+inline float saturate<float>(const float x)
+{
+    return x;
+}
+
+//per-rail input tables, the device calibration or the shared f32 table
+//with no Q correction from the I rail
+static const float noSkew[256] = {};
+
+struct InputRails
+{
+    InputRails(const float *lut):
+        i(lut), q(lut), qi(noSkew){}
+
+    InputRails(const SoapyRTLSDRCalibration &calibration):
+        i(calibration.i), q(calibration.q), qi(calibration.qi){}
+
+    const float *i, *q, *qi;
+};
+
+//convert through the input rails, swap is applied after the correction
+template <typename T>
+static void convertRails(const OutputRails<T> &out, const float scale, const InputRails &rails, const signed char *in, const size_t numElems, const bool swap)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    T *outI = swap ? out.q : out.i, *outQ = swap ? out.i : out.q;
+    for (size_t i = 0; i < numElems; i++)
+    {
+        const unsigned char x = raw[i * 2], y = raw[i * 2 + 1];
+        outI[i * out.stride] = saturate<T>(rails.i[x] * scale);
+        outQ[i * out.stride] = saturate<T>((rails.q[y] + rails.qi[x]) * scale);
+    }
+}
+
+//convert and shift by frequency in the same pass, the oscillator
+//restarts from the exact phase every NCO_RESYNC_SAMPLES to bound the drift
+template <typename T>
+static void convertShift(const OutputRails<T> &out, const float scale, const InputRails &rails, const signed char *in, const size_t numElems, const bool swap,
+    const long long tick, const long long frequency, const uint32_t rate)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    const std::complex<float> step = ncoRotation(1, frequency, rate);
+    for (size_t i0 = 0; i0 < numElems; i0 += NCO_RESYNC_SAMPLES)
+    {
+        std::complex<float> rotation = ncoRotation(tick + i0, frequency, rate);
+        const size_t i1 = std::min(numElems, i0 + NCO_RESYNC_SAMPLES);
+        for (size_t i = i0; i < i1; i++)
+        {
+            const unsigned char ri = raw[i * 2], rq = raw[i * 2 + 1];
+            const float vi = rails.i[ri], vq = rails.q[rq] + rails.qi[ri];
+            const std::complex<float> x = swap ? std::complex<float>(vq, vi) : std::complex<float>(vi, vq);
+            out.i[i * out.stride] = saturate<T>((x.real() * rotation.real() - x.imag() * rotation.imag()) * scale);
+            out.q[i * out.stride] = saturate<T>((x.real() * rotation.imag() + x.imag() * rotation.real()) * scale);
+            rotation = std::complex<float>(
+                rotation.real() * step.real() - rotation.imag() * step.imag(),
+                rotation.real() * step.imag() + rotation.imag() * step.real());
+        }
+    }
+}
+
+//the complex conversion whenever a calibration or the lo_offset shift applies
+template <typename T>
+static void convertCorrected(const OutputRails<T> &out, const float scale, const InputRails &rails, const signed char *in, const size_t numElems, const bool swap,
+    const long long tick, const long long frequency, const uint32_t rate)
+{
+    if (frequency != 0) convertShift(out, scale, rails, in, numElems, swap, tick, frequency, rate);
+    else convertRails(out, scale, rails, in, numElems, swap);
+}
+
+//the table holds the magnitude of every raw pair, swapping I and Q does not change it
+static void convertMag(uint16_t *out, const uint16_t *lut, const signed char *in, const size_t numElems)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    for (size_t i = 0; i < numElems; i++)
+    {
+        const unsigned char x = raw[i * 2], y = raw[i * 2 + 1];
+        out[i] = lut[(unsigned(x) << 8) | y];
+    }
+}
+
+//one rail of the raw pairs, the other adc branch is idle in direct sampling
+template <typename T>
+static void convertReal(T *out, const float scale, const signed char *in, const size_t rail, const size_t numElems)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    for (size_t i = 0; i < numElems; i++)
+    {
+        out[i] = T((raw[i * 2 + rail] - RAW_BIAS) * scale);
+    }
+}
+
+static void convertRealS8(int8_t *out, const signed char *in, const size_t rail, const size_t numElems)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    for (size_t i = 0; i < numElems; i++)
+    {
+        out[i] = raw[i * 2 + rail] - 128;
+    }
+}
+
+//atan2 with a polynomial on one octant, error about 1e-5 rad,
+//the octant fixups are selects so the loop can vectorize
+static inline float fastAtan2(const float y, const float x)
+{
+    const float ax = std::abs(x), ay = std::abs(y);
+    const float a = std::min(ax, ay) / (std::max(ax, ay) + 1e-20f);
+    const float s = a * a;
+    float r = a * (0.9998660f + s * (-0.3302995f + s * (0.1801410f + s * (-0.0851330f + s * 0.0208351f))));
+    r = (ay > ax) ? float(M_PI / 2) - r : r;
+    r = (x < 0.0f) ? float(M_PI) - r : r;
+    return (y < 0.0f) ? -r : r;
+}
+
+//polar discriminator, the phase step between samples scaled so pi is full scale
+template <typename T>
+static void discriminate(T *out, const float scale, const std::complex<float> *in, const size_t numElems, std::complex<float> &last)
+{
+    const float gain = scale / float(M_PI);
+    for (size_t i = 0; i < numElems; i++)
+    {
+        const float re = in[i].real() * last.real() + in[i].imag() * last.imag();
+        const float im = in[i].imag() * last.real() - in[i].real() * last.imag();
+        out[i] = saturate<T>(fastAtan2(im, re) * gain);
+        last = in[i];
+    }
+}
+
+//discriminate straight from the raw samples through the input rails,
+//the same as converting to complex first without the scratch pass
+template <typename T>
+static void discriminateRaw(T *out, const float scale, const InputRails &rails, const signed char *in, const size_t numElems, const bool swap,
+    std::complex<float> &last)
+{
+    const unsigned char *raw = (const unsigned char *)in;
+    const float gain = scale / float(M_PI);
+    float lastI = last.real(), lastQ = last.imag();
+    for (size_t i = 0; i < numElems; i++)
+    {
+        const unsigned char x = raw[i * 2], y = raw[i * 2 + 1];
+        const float vi = rails.i[x], vq = rails.q[y] + rails.qi[x];
+        const float si = swap ? vq : vi, sq = swap ? vi : vq;
+        const float re = si * lastI + sq * lastQ;
+        const float im = sq * lastI - si * lastQ;
+        out[i] = saturate<T>(fastAtan2(im, re) * gain);
+        lastI = si;
+        lastQ = sq;
+    }
+    last = std::complex<float>(lastI, lastQ);
+}
+
+//scale and saturate filtered samples into an integer format
+template <typename T>
+static void convertFiltered(const OutputRails<T> &out, const float scale, const std::complex<float> *in, const size_t numElems)
+{
+    for (size_t i = 0; i < numElems; i++)
+    {
+        out.i[i * out.stride] = saturate<T>(in[i].real() * scale);
+        out.q[i * out.stride] = saturate<T>(in[i].imag() * scale);
+    }
+}
+
+//one pass over the raw samples into buffs
+static void convertRaw(const SoapyRTLSDRConversion &c, void * const *buffs, const signed char *in, const size_t numElems)
+{
+    void *buff0 = buffs[0];
+    const bool planar = c.planar;
+    const SoapyRTLSDRTables &tables = SoapyRTLSDRTables::get();
+    //a device calibration replaces the shared tables for the complex formats
+    const InputRails rails = c.calibration ? InputRails(*c.calibration) : InputRails(tables.f32);
+    const bool complexFormat = c.format == RTL_RX_FORMAT_FLOAT32 or
+        c.format == RTL_RX_FORMAT_INT16 or c.format == RTL_RX_FORMAT_INT8 or
+        c.format == RTL_RX_FORMAT_UINT8 or c.format == RTL_RX_FORMAT_FLOAT16;
+    if ((c.format == RTL_RX_FORMAT_FM_FLOAT32 or c.format == RTL_RX_FORMAT_FM_INT16) and c.nco == 0)
+    {
+        //one pass from the raw samples, the calibration is in the rails
+        if (c.format == RTL_RX_FORMAT_FM_FLOAT32) discriminateRaw((float *)buff0, 1.0f, rails, in, numElems, c.swap, *c.fmLast);
+        else discriminateRaw((int16_t *)buff0, 32768.0f, rails, in, numElems, c.swap, *c.fmLast);
+    }
+    else if (c.format == RTL_RX_FORMAT_FM_FLOAT32 or c.format == RTL_RX_FORMAT_FM_INT16)
+    {
+        //the lo_offset shift goes through the complex scratch first
+        c.scratch->resize(numElems);
+        float *scratch = (float *)c.scratch->data();
+        convertCorrected(OutputRails<float>(scratch, false), 1.0f, rails, in, numElems, c.swap, c.tick, c.nco, c.rate);
+        if (c.format == RTL_RX_FORMAT_FM_FLOAT32) discriminate((float *)buff0, 1.0f, c.scratch->data(), numElems, *c.fmLast);
+        else discriminate((int16_t *)buff0, 32768.0f, c.scratch->data(), numElems, *c.fmLast);
+    }
+    else if ((c.nco != 0 or c.calibration) and complexFormat)
+    {
+        //the shift and the correction need floats, the 8 bit formats take the
+        //integer path below whenever neither applies
+        if (c.format == RTL_RX_FORMAT_FLOAT32)
+        {
+            convertCorrected(OutputRails<float>(buffs, planar, false), 1.0f, rails, in, numElems, c.swap, c.tick, c.nco, c.rate);
+        }
+        else if (c.format == RTL_RX_FORMAT_INT16)
+        {
+            convertCorrected(OutputRails<int16_t>(buffs, planar, false), float(SHRT_MAX), rails, in, numElems, c.swap, c.tick, c.nco, c.rate);
+        }
+        else if (c.format == RTL_RX_FORMAT_FLOAT16)
+        {
+            c.scratch->resize(numElems);
+            convertCorrected(OutputRails<float>((float *)c.scratch->data(), false), 1.0f, rails, in, numElems, c.swap, c.tick, c.nco, c.rate);
+            convertHalf(OutputRails<uint16_t>(buffs, planar, false), c.scratch->data(), numElems);
+        }
+        else
+        {
+            convertCorrected(OutputRails<int8_t>(buffs, planar, false), 128.0f, rails, in, numElems, c.swap, c.tick, c.nco, c.rate);
+            if (c.format == RTL_RX_FORMAT_UINT8) offsetBinary(OutputRails<int8_t>(buffs, planar, false), numElems);
+        }
+    }
+    else if (c.format == RTL_RX_FORMAT_FLOAT32)
+    {
+        convertLUT(OutputRails<float>(buffs, planar, c.swap), tables.f32, in, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_INT16)
+    {
+        convertLUT(OutputRails<int16_t>(buffs, planar, c.swap), tables.s16, in, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_INT8)
+    {
+        convertCS8(OutputRails<int8_t>(buffs, planar, c.swap), in, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_UINT8)
+    {
+        convertCU8(OutputRails<uint8_t>(buffs, planar, c.swap), in, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_FLOAT16)
+    {
+        convertLUT(OutputRails<uint16_t>(buffs, planar, c.swap), tables.f16, in, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_MAG16)
+    {
+        convertMag((uint16_t *)buff0, tables.mag16, in, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_MAGSQ16)
+    {
+        convertMag((uint16_t *)buff0, tables.magsq16, in, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_REAL_FLOAT32)
+    {
+        convertReal((float *)buff0, 1.0f / 128.0f, in, c.rail, numElems);
+    }
+    else if (c.format == RTL_RX_FORMAT_REAL_INT16)
+    {
+        convertReal((int16_t *)buff0, float(SHRT_MAX) / 128.0f, in, c.rail, numElems);
+    }
+    else
+    {
+        convertRealS8((int8_t *)buff0, in, c.rail, numElems);
+    }
+}
+
+SoapyRTLSDRConversion::SoapyRTLSDRConversion(void):
+    format(RTL_RX_FORMAT_FLOAT32),
+    planar(false),
+    swap(false),
+    rail(0),
+    nco(0),
+    tick(0),
+    rate(0),
+    calibration(nullptr),
+    scratch(nullptr),
+    fmLast(nullptr)
+{
+    return;
+}
+
+void SoapyRTLSDRConversion::convert(void * const *buffs, const signed char *in, const size_t numElems) const
+{
+    convertRaw(*this, buffs, in, numElems);
+}
+
 /*******************************************************************
  * Async thread work
  ******************************************************************/
@@ -104,52 +871,655 @@ static void _rx_callback(unsigned char *buf, uint32_t len, void *ctx)
     self->rx_callback(buf, len);
 }
 
+//parse a cpu list such as "0-3,6" into individual cpu numbers
+static std::vector<int> parseCpuList(const std::string &list)
+{
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+        const std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty()) continue;
+
+        const size_t dash = item.find('-');
+        const int first = std::stoi(item.substr(0, dash));
+        const int last = (dash == std::string::npos) ? first : std::stoi(item.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+//apply the stream thread settings to the calling thread,
+//failures are only logged since the stream works without them
+void SoapyRTLSDR::configureThread(const std::string &name) const
+{
+#if defined(__linux__)
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#elif defined(__APPLE__)
+    pthread_setname_np(name.c_str());
+#endif
+
+    if (not threadAffinity.empty())
+    {
+#ifdef __linux__
+        std::vector<int> cpus;
+        try
+        {
+            cpus = parseCpuList(threadAffinity);
+        }
+        catch (const std::exception &)
+        {
+            SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR invalid affinity '%s'", threadAffinity.c_str());
+        }
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (const auto cpu : cpus)
+        {
+            if (cpu >= 0 and cpu < CPU_SETSIZE) CPU_SET(cpu, &cpuset);
+        }
+        if (CPU_COUNT(&cpuset) != 0)
+        {
+            int r = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+            if (r != 0) SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR %s affinity '%s' failed: %s",
+                name.c_str(), threadAffinity.c_str(), std::strerror(r));
+        }
+#else
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR thread affinity not supported on this platform");
+#endif
+    }
+
+#ifndef _WIN32
+    if (threadScheduler == "fifo" or threadScheduler == "rr")
+    {
+        const int policy = (threadScheduler == "fifo") ? SCHED_FIFO : SCHED_RR;
+        sched_param param;
+        std::memset(&param, 0, sizeof(param));
+        param.sched_priority = std::max(sched_get_priority_min(policy),
+            std::min(sched_get_priority_max(policy), threadPriority));
+        int r = pthread_setschedparam(pthread_self(), policy, &param);
+        if (r != 0) SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR %s scheduler %s priority %d failed: %s",
+            name.c_str(), threadScheduler.c_str(), param.sched_priority, std::strerror(r));
+    }
+    else if (threadScheduler == "other" and threadPriority != 0)
+    {
+#ifdef __linux__
+        //linux applies the nice level per thread
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), threadPriority) != 0)
+            SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR %s nice %d failed: %s",
+                name.c_str(), threadPriority, std::strerror(errno));
+#else
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR per-thread nice level not supported on this platform");
+#endif
+    }
+#endif
+}
+
 void SoapyRTLSDR::rx_async_operation(void)
 {
     //printf("rx_async_operation\n");
-    rtlsdr_read_async(dev, &_rx_callback, this, asyncBuffs, bufferLength);
+    configureThread(_tcp ? "rtltcp-rx" : "rtlsdr-rx-" + std::to_string(deviceId));
+    if (_tcp) rx_tcp_operation();
+    else rtlsdr_read_async(dev, &_rx_callback, this, asyncBuffs, bufferLength);
     //printf("rx_async_operation done!\n");
 }
 
+void SoapyRTLSDR::cancelAsync(void)
+{
+    _backend->cancel();
+}
+
+void SoapyRTLSDR::resetAsync(void)
+{
+    //rtl_tcp drops what the server sent while the stream was stopped
+    _backend->reset();
+}
+
+void SoapyRTLSDR::startAsync(void)
+{
+    resetAsync();
+    if (usbReader)
+    {
+        _usbScratch.resize(bufferLength);
+        _usbReadEnd = std::chrono::steady_clock::time_point();
+        _usbReading = true;
+        return;
+    }
+    if (not tcpShared)
+    {
+        _rx_async_thread = std::thread(&SoapyRTLSDR::rx_async_operation, this);
+        return;
+    }
+
+    //the reset realigned the socket on a whole sample,
+    //a half sample left over from the last run is stale
+    _tcpScratch.resize(bufferLength);
+    _tcpFill = 0;
+    SoapyRTLSDRTcpEngine::attach(this, _tcp->fd());
+    _tcpAttached = true;
+}
+
+void SoapyRTLSDR::stopAsync(void)
+{
+    if (_usbReading)
+    {
+        //a read in progress finishes its transfer, the next one returns at once
+        _usbReading = false;
+        cancelAsync();
+        std::lock_guard<std::mutex> lock(_usbReadMutex);
+    }
+    if (_tcpAttached)
+    {
+        SoapyRTLSDRTcpEngine::detach(this);
+        _tcpAttached = false;
+
+        //hand over the whole samples of a partly filled buffer like a cancelled receive
+        const size_t len = _tcpFill - _tcpFill % BYTES_PER_SAMPLE;
+        if (len != 0) rx_callback(_tcpScratch.data(), len);
+        _tcpFill = 0;
+    }
+    if (_rx_async_thread.joinable())
+    {
+        cancelAsync();
+        _rx_async_thread.join();
+    }
+}
+
+bool SoapyRTLSDR::asyncRunning(void) const
+{
+    return _tcpAttached or _usbReading or _rx_async_thread.joinable();
+}
+
+//one transfer with rtlsdr_read_sync when this stream has nothing queued,
+//the stream that holds the read dispatches for every other one
+void SoapyRTLSDR::rx_usb_read(SoapyRTLSDRStream *rxStream)
+{
+    {
+        std::lock_guard<std::mutex> lock(_buf_mutex);
+
+        //drain like acquireReadBuffer would, so the reset does not discard this read
+        if (rxStream->resetBuffer)
+        {
+            rxStream->head = _buf_tail;
+            rxStream->count = 0;
+            rxStream->resetBuffer = false;
+            rxStream->overflowEvent = false;
+        }
+        if (rxStream->count != 0 or rxStream->overflowEvent) return;
+    }
+
+    //the other streams wait on the buffer condition meanwhile
+    std::unique_lock<std::mutex> lock(_usbReadMutex, std::try_to_lock);
+    if (not lock.owns_lock() or not _usbReading) return;
+
+    //the dongle keeps sampling between reads and drops what its fifo cannot hold,
+    //an idle longer than one transfer counts the lost samples in the ticks
+    //and is reported to every reader as an overflow before the next read
+    const auto now = std::chrono::steady_clock::now();
+    if (_usbReadEnd != std::chrono::steady_clock::time_point())
+    {
+        const double idle = std::chrono::duration<double>(now - _usbReadEnd).count();
+        if (idle * sampleRate * BYTES_PER_SAMPLE > bufferLength)
+        {
+            ticks += (unsigned long long)(idle * sampleRate);
+            _usbReadEnd = now;
+            std::lock_guard<std::mutex> bufLock(_buf_mutex);
+            for (auto stream : _streams) stream->overflowEvent = true;
+            return;
+        }
+    }
+
+    //receive straight into the next ring slot like rtl_tcp does
+    size_t index = 0;
+    const bool direct = not squelchEnabled and reserveBuffer(index);
+    unsigned char *buf = direct ? (unsigned char *)_buffs[index].data : _usbScratch.data();
+
+    const long len = _backend->read(buf, bufferLength);
+    _usbReadEnd = std::chrono::steady_clock::now();
+    if (len < 0) SoapySDR_logf(SOAPY_SDR_ERROR, "RTL-SDR rtlsdr_read_sync failed on device %d", deviceId);
+    if (len <= 0) return;
+
+    if (not direct) rx_callback(buf, len);
+    else dispatchBuffer(buf, len, index);
+}
+
 void SoapyRTLSDR::rx_callback(unsigned char *buf, uint32_t len)
 {
     //printf("_rx_callback %d _buf_head=%d, numBuffers=%d\n", len, _buf_head, _buf_tail);
+    dispatchBuffer(buf, len, RX_COPY_BUFFER);
+}
 
+//one raw buffer to the history, the server, the profiler, the export and the readers,
+//index is the ring slot it was received into or RX_COPY_BUFFER to copy it into one
+void SoapyRTLSDR::dispatchBuffer(const unsigned char *buf, const size_t len, const size_t index)
+{
     // atomically add len to ticks but return the previous value
     unsigned long long tick = ticks.fetch_add(len / BYTES_PER_SAMPLE);
 
-    //overflow condition: the caller is not reading fast enough
-    if (_buf_count == numBuffers)
+    //samples taken while apply writes a configuration belong to neither one,
+    //dropping them leaves the readers a single gap in the ticks,
+    //a reserved but uncommitted slot is simply written again
+    if (_applying) return;
+
+    //every buffer is measured once however many streams read it
+    if (softAGC)
     {
-        _overflowEvent = true;
-        return;
+        rtlsdrSignalStats stats;
+        measureRaw(stats, buf, len / BYTES_PER_SAMPLE);
+        softAGCUpdate(stats, tick);
     }
 
-    //copy into the buffer queue
-    auto &buff = _buffs[_buf_tail];
-    buff.tick = tick;
-    buff.data.resize(len);
-    std::memcpy(buff.data.data(), buf, len);
+    if (_history != nullptr) historyBuffer(buf, len, tick);
+    if (_tcpServer) _tcpServer->push(buf, len);
+    const auto profiler = std::atomic_load(&_profiler);
+    if (profiler) profiler->samples(buf, len, tick);
 
-    //increment the tail pointer
-    _buf_tail = (_buf_tail + 1) % numBuffers;
+    if (index != RX_COPY_BUFFER)
+    {
+        if (_shm) _shm->write(buf, len, tick, 0, sampleRate, tunedFrequency);
+        commitBuffer(index, len, tick, 0);
+    }
+    else if (squelchEnabled) squelchBuffer(buf, len, tick);
+    else pushBuffer(buf, len, tick, 0);
+}
 
-    //increment buffers available under lock
-    //to avoid race in acquireReadBuffer wait
+void SoapyRTLSDR::pushBuffer(const unsigned char *buf, const size_t len, const unsigned long long tick, const int flags)
+{
+    //other processes see exactly what the local readers see
+    if (_shm) _shm->write(buf, len, tick, flags, sampleRate, tunedFrequency);
+
+    size_t index = 0;
+    if (not reserveBuffer(index)) return;
+
+    //copy into the buffer queue, readers only see the slot once counted
+    std::memcpy(_buffs[index].data, buf, std::min<size_t>(len, bufferLength));
+    commitBuffer(index, len, tick, flags);
+}
+
+bool SoapyRTLSDR::reserveBuffer(size_t &index)
+{
+    std::lock_guard<std::mutex> lock(_buf_mutex);
+
+    //a buffer still held by a lapped reader cannot be written,
+    //swap a free spare into the slot and leave the reader its copy
+    size_t &slot = _buf_slots[_buf_tail];
+    if (_buf_users[slot] != 0)
+    {
+        auto it = std::find_if(_buf_spares.begin(), _buf_spares.end(), [this](const size_t i){return _buf_users[i] == 0;});
+
+        //no spare left, drop the buffer for every reader rather than corrupt it
+        if (it == _buf_spares.end())
+        {
+            for (auto stream : _streams) stream->overflowEvent = true;
+            return false;
+        }
+        std::swap(slot, *it);
+    }
+    index = slot;
+    return true;
+}
+
+void SoapyRTLSDR::commitBuffer(const size_t index, const size_t len, const unsigned long long tick, const int flags)
+{
+    auto &buff = _buffs[index];
+    buff.tick = tick;
+    buff.flags = flags;
+    buff.size = std::min<size_t>(len, bufferLength);
+
+    //increment the tail pointer and each reader's available count
+    //under lock to avoid race in acquireReadBuffer wait
     {
     std::lock_guard<std::mutex> lock(_buf_mutex);
-    _buf_count++;
+    _buf_tail = (_buf_tail + 1) % numBuffers;
+    for (auto stream : _streams)
+    {
+        if (not stream->active) continue;
 
+        //overflow condition: this reader is not reading fast enough
+        if (stream->count + stream->held >= numBuffers - 1) stream->overflowEvent = true;
+        else stream->count++;
+    }
     }
 
     //notify readStream()
-    _buf_cond.notify_one();
+    _buf_cond.notify_all();
+}
+
+/*******************************************************************
+ * History ring
+ ******************************************************************/
+
+void SoapyRTLSDR::historyBuffer(const unsigned char *buf, const size_t len, const unsigned long long tick)
+{
+    //restart the history when the ticks jump (rate change, new hardware time)
+    unsigned long long written = _historyWritten.load(std::memory_order_relaxed);
+    if (written == 0 or (long long)tick != _historyBaseTick + (long long)(written / BYTES_PER_SAMPLE))
+    {
+        _historyEpoch++;
+        _historyWritten = 0;
+        _historyBaseTick = tick;
+        written = 0;
+    }
+
+    //a buffer larger than the ring only leaves its newest bytes
+    const size_t skip = len - std::min(len, _historySize);
+
+    //copy with wrap around, then publish the new total
+    const size_t offset = (written + skip) % _historySize;
+    const size_t first = std::min(len - skip, _historySize - offset);
+    std::memcpy(_history + offset, buf + skip, first);
+    std::memcpy(_history, buf + skip + first, len - skip - first);
+    _historyWritten.store(written + len, std::memory_order_release);
+}
+
+//history_ms at the current rate, at least two buffers of the given length
+size_t SoapyRTLSDR::historySizing(const size_t length) const
+{
+    if (historyMs <= 0.0) return 0;
+    return std::max<size_t>(size_t(historyMs * sampleRate / 1000.0) * BYTES_PER_SAMPLE, 2 * length);
+}
+
+size_t SoapyRTLSDR::tcpQueueSizing(const size_t length) const
+{
+    return std::max<size_t>(size_t(tcpQueueMs * sampleRate / 1000.0) * BYTES_PER_SAMPLE, 2 * length);
+}
+
+//the rx thread must not be running, readers wait on the history mutex
+void SoapyRTLSDR::allocateHistory(void)
+{
+    std::lock_guard<std::mutex> lock(_historyMutex);
+    _history = nullptr;
+    _historyArena.reset();
+    _historyWritten = 0;
+    _historyEpoch++;
+    _historySize = historySizing(bufferLength);
+    if (_historySize == 0) return;
+
+    _historyArena.reset(new SoapyRTLSDRArena(_historySize, arenaHugepages, arenaLock));
+    _history = _historyArena->allocate(_historySize);
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR history of %g ms uses %zu bytes", historyMs, _historySize);
+}
+
+long long SoapyRTLSDR::readHistory(const long long tick, void *buff, const size_t numElems) const
+{
+    std::lock_guard<std::mutex> lock(_historyMutex);
+    if (_history == nullptr) return SOAPY_SDR_NOT_SUPPORTED;
+
+    const unsigned long long epoch = _historyEpoch;
+    const long long baseTick = _historyBaseTick;
+    const unsigned long long written = _historyWritten.load(std::memory_order_acquire);
+
+    //the window must be fully written and not yet overwritten
+    const long long start = (tick - baseTick) * BYTES_PER_SAMPLE;
+    const long long length = numElems * BYTES_PER_SAMPLE;
+    if (start < 0 or start + length > (long long)written) return SOAPY_SDR_TIME_ERROR;
+    if ((long long)written - start > (long long)_historySize) return SOAPY_SDR_TIME_ERROR;
+
+    const size_t offset = start % _historySize;
+    const size_t first = std::min<size_t>(length, _historySize - offset);
+    std::memcpy(buff, _history + offset, first);
+    std::memcpy((char *)buff + first, _history, length - first);
+
+    //check that the writer did not lap the copy, a write in progress may
+    //already be touching one buffer length, at most the ring, past the published total
+    const unsigned long long after = _historyWritten.load(std::memory_order_acquire);
+    const size_t inProgress = std::min(bufferLength, _historySize);
+    if (_historyEpoch != epoch or after + inProgress - start > _historySize) return SOAPY_SDR_TIME_ERROR;
+
+    return numElems;
+}
+
+//history_dump request: startNs:stopNs:path
+void SoapyRTLSDR::dumpHistory(const std::string &request) const
+{
+    const size_t colon0 = request.find(':');
+    const size_t colon1 = request.find(':', colon0 + 1);
+    if (colon0 == std::string::npos or colon1 == std::string::npos)
+    {
+        throw std::runtime_error("history_dump expects startNs:stopNs:path");
+    }
+    const long long startNs = std::stoll(request.substr(0, colon0));
+    const long long stopNs = std::stoll(request.substr(colon0 + 1, colon1 - colon0 - 1));
+    const std::string path = request.substr(colon1 + 1);
+
+    //snapshot to memory first so the window is not lost while writing
+    const long long startTick = SoapySDR::timeNsToTicks(startNs, sampleRate);
+    const long long numElems = SoapySDR::timeNsToTicks(stopNs, sampleRate) - startTick;
+    if (numElems <= 0) throw std::runtime_error("history_dump empty window");
+    std::vector<char> data(numElems * BYTES_PER_SAMPLE);
+    if (readHistory(startTick, data.data(), numElems) != numElems)
+    {
+        throw std::runtime_error("history_dump window not in history: " + request);
+    }
+
+    FILE *fp = std::fopen(path.c_str(), "wb");
+    if (fp == nullptr) throw std::runtime_error("history_dump cannot open " + path);
+    const size_t n = std::fwrite(data.data(), 1, data.size(), fp);
+    std::fclose(fp);
+    if (n != data.size()) throw std::runtime_error("history_dump write failed " + path);
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR wrote %lld history samples to %s", numElems, path.c_str());
+}
+
+/*******************************************************************
+ * Squelch gate
+ ******************************************************************/
+
+//mean power of a raw buffer in dBFS, every 4th sample is plenty for a gate
+static double rawPowerDb(const unsigned char *buf, const size_t len)
+{
+    unsigned long long power = 0;
+    size_t count = 0;
+    for (size_t i = 0; i + 1 < len; i += 4 * BYTES_PER_SAMPLE)
+    {
+        power += rawPower(buf[i]) + rawPower(buf[i + 1]);
+        count++;
+    }
+    if (count == 0) return -100.0;
+    return 10*std::log10((power + 1.0) / (count * 65536.0));
+}
+
+//only hand buffers to the reader while the channel is active,
+//quiet buffers are held in the pre-roll slots until the gate opens
+void SoapyRTLSDR::squelchBuffer(const unsigned char *buf, const size_t len, const unsigned long long tick)
+{
+    const bool active = rawPowerDb(buf, len) >= squelchLevel;
+
+    if (not _squelchOpen)
+    {
+        if (not active)
+        {
+            if (_preroll.empty()) return;
+            if (_prerollCount == _preroll.size())
+            {
+                _prerollHead = (_prerollHead + 1) % _preroll.size();
+                _prerollCount--;
+            }
+            auto &buff = _preroll[(_prerollHead + _prerollCount) % _preroll.size()];
+            buff.tick = tick;
+            buff.size = std::min<size_t>(len, bufferLength);
+            std::memcpy(buff.data, buf, buff.size);
+            _prerollCount++;
+            return;
+        }
+
+        //opening: the pre-roll goes out first with its original ticks
+        _squelchOpen = true;
+        for (; _prerollCount != 0; _prerollCount--)
+        {
+            const auto &buff = _preroll[_prerollHead];
+            pushBuffer((const unsigned char *)buff.data, buff.size, buff.tick, 0);
+            _prerollHead = (_prerollHead + 1) % _preroll.size();
+        }
+    }
+
+    if (active) _squelchHang = _squelchHangBuffers;
+    else _squelchHang--;
+
+    //the last buffer of the hang time ends the burst
+    if (_squelchHang == 0)
+    {
+        _squelchOpen = false;
+        pushBuffer(buf, len, tick, SOAPY_SDR_END_BURST);
+    }
+    else pushBuffer(buf, len, tick, 0);
+}
+
+/*******************************************************************
+ * Software AGC
+ ******************************************************************/
+
+//called by dispatchBuffer with statistics of the samples starting at tick,
+//a gain step is handed to the agc thread so the usb transfer blocks neither
+//the rx thread nor the readers
+void SoapyRTLSDR::softAGCUpdate(const rtlsdrSignalStats &stats, const long long tick)
+{
+    //samples from before the last change do not reflect the current gain,
+    //neither do the ones taken while a step waits for the agc thread
+    if (tick < _agcSettleTick or _agcStep >= 0 or tunerGains.empty())
+    {
+        _agcStats = rtlsdrSignalStats();
+        return;
+    }
+
+    _agcStats.power += stats.power;
+    _agcStats.clipped += stats.clipped;
+    _agcStats.count += stats.count;
+    if (_agcStats.count < std::max<size_t>(1024, sampleRate / AGC_UPDATE_RATE)) return;
+
+    const double powerDb = 10*std::log10((_agcStats.power + 1.0) / (_agcStats.count * 65536.0));
+    const double clipRatio = double(_agcStats.clipped) / _agcStats.count;
+    _agcStats = rtlsdrSignalStats();
+
+    //find the current position in the gain table
+    const double gain = tunerGain;
+    const int current = int(gain * 10);
+    size_t index = 0;
+    while (index + 1 < tunerGains.size() and tunerGains[index + 1] <= current) index++;
+
+    //back off hard on overload, otherwise step towards the set point
+    double target = gain;
+    if (clipRatio > AGC_CLIP_RATIO) target = gain - AGC_OVERLOAD_STEP_DB;
+    else if (std::abs(agcSetPoint - powerDb) > agcHysteresis) target = gain + (agcSetPoint - powerDb);
+    else return;
+
+    //largest table entry that does not exceed the target
+    size_t next = 0;
+    while (next + 1 < tunerGains.size() and tunerGains[next + 1] <= target * 10) next++;
+    if (next == index) return;
+
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR AGC %.1f dBFS, %.4f clipped: step to tuner gain %.1f dB",
+        powerDb, clipRatio, tunerGains[next] / 10.0);
+    std::lock_guard<std::mutex> lock(_agcMutex);
+    _agcStep = tunerGains[next];
+    _agcStepTick = tick;
+    _agcCond.notify_one();
+}
+
+//applies the gain steps of softAGCUpdate, runs while sw_agc is on
+void SoapyRTLSDR::agcOperation(void)
+{
+    std::unique_lock<std::mutex> lock(_agcMutex);
+    while (true)
+    {
+        _agcCond.wait(lock, [this]{return _agcExit or _agcStep >= 0;});
+        if (_agcExit) return;
+        const int step = _agcStep;
+        const long long stepTick = _agcStepTick;
+        lock.unlock();
+
+        //a setGain from the application since the measurement wins over this step
+        bool applied = false;
+        {
+            std::lock_guard<std::mutex> gainLock(_gainMutex);
+            if (softAGC and stepTick >= _agcSettleTick)
+            {
+                tunerGain = step / 10.0;
+                _backend->setGain(step);
+
+                //the next raw sample is the first one taken at the new gain
+                _agcSettleTick = ticks.load();
+                applied = true;
+            }
+        }
+
+        lock.lock();
+        _agcStep = -1;
+        if (not applied) continue;
+        _agcEvents.push_back(std::make_pair(_agcSettleTick.load(), step / 10.0));
+        if (_agcEvents.size() > AGC_MAX_EVENTS) _agcEvents.erase(_agcEvents.begin());
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR AGC tuner gain %.1f dB at tick %lld", step / 10.0, _agcSettleTick.load());
+    }
+}
+
+void SoapyRTLSDR::startAGC(void)
+{
+    if (_agcThread.joinable()) return;
+    _agcExit = false;
+    _agcStep = -1;
+    _agcThread = std::thread(&SoapyRTLSDR::agcOperation, this);
+}
+
+void SoapyRTLSDR::stopAGC(void)
+{
+    if (not _agcThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(_agcMutex);
+        _agcExit = true;
+    }
+    _agcCond.notify_one();
+    _agcThread.join();
 }
 
 /*******************************************************************
  * Stream API
  ******************************************************************/
 
+//build the optional channel filter from the stream args
+static std::unique_ptr<SoapyRTLSDRChannelFilter> makeChannelFilter(const SoapySDR::Kwargs &args, const double rate)
+{
+    const bool enabled = (args.count("filter_taps") != 0 and not args.at("filter_taps").empty()) or
+        (args.count("filter_cutoff") != 0 and not args.at("filter_cutoff").empty()) or
+        args.count("filter_shift") != 0 or args.count("filter_decim") != 0;
+    if (not enabled) return std::unique_ptr<SoapyRTLSDRChannelFilter>();
+
+    std::vector<float> taps;
+    double shift = 0.0, cutoff = 0.0;
+    int decim = 1, numTaps = DEFAULT_FILTER_TAPS;
+    try
+    {
+        if (args.count("filter_shift") != 0) shift = std::stod(args.at("filter_shift"));
+        if (args.count("filter_decim") != 0) decim = std::max(std::stoi(args.at("filter_decim")), 1);
+        if (args.count("filter_num_taps") != 0) numTaps = std::max(std::stoi(args.at("filter_num_taps")), 1);
+        if (args.count("filter_cutoff") != 0 and not args.at("filter_cutoff").empty()) cutoff = std::stod(args.at("filter_cutoff")) / rate;
+        if (args.count("filter_taps") != 0)
+        {
+            //commas separate the stream args, so the taps also take spaces or semicolons
+            const std::string &list = args.at("filter_taps");
+            size_t pos = list.find_first_not_of(" ;,");
+            while (pos != std::string::npos)
+            {
+                size_t end = list.find_first_of(" ;,", pos);
+                if (end == std::string::npos) end = list.size();
+                taps.push_back(std::stof(list.substr(pos, end - pos)));
+                pos = list.find_first_not_of(" ;,", end);
+            }
+        }
+    }
+    catch (const std::invalid_argument &)
+    {
+        throw std::runtime_error("setupStream invalid channel filter arguments");
+    }
+
+    //decimating without a filter would alias, design one for the new rate
+    if (taps.empty() and cutoff == 0.0 and decim > 1) cutoff = 0.4 / decim;
+    if (taps.empty() and cutoff > 0.0) taps = SoapyRTLSDRChannelFilter::lowpass(numTaps, std::min(cutoff, 0.5));
+
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR channel filter %zu taps, shift %g Hz, decimation %d", taps.size(), shift, decim);
+    return std::unique_ptr<SoapyRTLSDRChannelFilter>(new SoapyRTLSDRChannelFilter(taps, shift / rate, decim));
+}
+
 SoapySDR::Stream *SoapyRTLSDR::setupStream(
         const int direction,
         const std::string &format,
@@ -167,6 +1537,8 @@ SoapySDR::Stream *SoapyRTLSDR::setupStream(
         throw std::runtime_error("setupStream invalid channel selection");
     }
 
+    rtlsdrRXFormat rxFormat;
+
     //check the format
     if (format == SOAPY_SDR_CF32)
     {
@@ -182,49 +1554,125 @@ SoapySDR::Stream *SoapyRTLSDR::setupStream(
         SoapySDR_log(SOAPY_SDR_INFO, "Using format CS8.");
         rxFormat = RTL_RX_FORMAT_INT8;
     }
-    else
+    else if (format == SOAPY_SDR_CU8)
+    {
+        SoapySDR_log(SOAPY_SDR_INFO, "Using format CU8.");
+        rxFormat = RTL_RX_FORMAT_UINT8;
+    }
+    else if (format == SOAPY_SDR_CF16)
+    {
+        SoapySDR_log(SOAPY_SDR_INFO, "Using format CF16.");
+        rxFormat = RTL_RX_FORMAT_FLOAT16;
+    }
+    else if (format == SOAPY_SDR_U16)
+    {
+        const bool squared = args.count("magnitude") != 0 and args.at("magnitude") == "squared";
+        SoapySDR_logf(SOAPY_SDR_INFO, "Using format U16 (magnitude%s).", squared ? " squared" : "");
+        rxFormat = squared ? RTL_RX_FORMAT_MAGSQ16 : RTL_RX_FORMAT_MAG16;
+    }
+    else if (format == SOAPY_SDR_F32)
+    {
+        SoapySDR_log(SOAPY_SDR_INFO, "Using format F32.");
+        rxFormat = RTL_RX_FORMAT_REAL_FLOAT32;
+    }
+    else if (format == SOAPY_SDR_S16)
+    {
+        SoapySDR_log(SOAPY_SDR_INFO, "Using format S16.");
+        rxFormat = RTL_RX_FORMAT_REAL_INT16;
+    }
+    else if (format == SOAPY_SDR_S8)
+    {
+        SoapySDR_log(SOAPY_SDR_INFO, "Using format S8.");
+        rxFormat = RTL_RX_FORMAT_REAL_INT8;
+    }
+    else
+    {
+        throw std::runtime_error(
+                "setupStream invalid format '" + format
+                        + "' -- Only CS8, CS16, CF32, CU8, CF16, U16, S8, S16 and F32 are supported by SoapyRTLSDR module.");
+    }
+
+    //the fm discriminator replaces the real formats
+    if (args.count("demod") != 0 and args.at("demod") == "fm")
+    {
+        if (rxFormat == RTL_RX_FORMAT_REAL_FLOAT32) rxFormat = RTL_RX_FORMAT_FM_FLOAT32;
+        else if (rxFormat == RTL_RX_FORMAT_REAL_INT16) rxFormat = RTL_RX_FORMAT_FM_INT16;
+        else throw std::runtime_error("setupStream demod=fm needs format F32 or S16");
+        SoapySDR_logf(SOAPY_SDR_INFO, "Using FM discriminator output.");
+    }
+    else if (args.count("demod") != 0 and not args.at("demod").empty())
+    {
+        throw std::runtime_error("setupStream invalid demod '" + args.at("demod") + "'");
+    }
+
+    const bool realFormat = rxFormat == RTL_RX_FORMAT_REAL_FLOAT32 or
+        rxFormat == RTL_RX_FORMAT_REAL_INT16 or rxFormat == RTL_RX_FORMAT_REAL_INT8;
+    if (realFormat and directSamplingMode == 0)
     {
-        throw std::runtime_error(
-                "setupStream invalid format '" + format
-                        + "' -- Only CS8, CS16 and CF32 are supported by SoapyRTLSDR module.");
+        SoapySDR_logf(SOAPY_SDR_WARNING, "Real format %s without direct sampling only delivers the I rail", format.c_str());
     }
 
-    if (rxFormat != RTL_RX_FORMAT_INT8 && !_lut_32f.size())
+    //the channel filter works on the CF32 conversion
+    std::unique_ptr<SoapyRTLSDRChannelFilter> filter = makeChannelFilter(args, sampleRate);
+    unsigned long resampleRate = 0;
+    int resampleTaps = DEFAULT_RESAMPLE_TAPS;
+    try
     {
-        SoapySDR_logf(SOAPY_SDR_DEBUG, "Generating RTL-SDR lookup tables");
-        // create lookup tables
-        for (unsigned int i = 0; i <= 0xffff; i++)
+        if (args.count("resample_rate") != 0 and not args.at("resample_rate").empty())
         {
-# if (__BYTE_ORDER == __LITTLE_ENDIAN)
-            float re = ((i & 0xff) - 127.4f) * (1.0f / 128.0f);
-            float im = ((i >> 8) - 127.4f) * (1.0f / 128.0f);
-#else
-            float re = ((i >> 8) - 127.4f) * (1.0f / 128.0f);
-            float im = ((i & 0xff) - 127.4f) * (1.0f / 128.0f);
-#endif
-
-            std::complex<float> v32f, vs32f;
-
-            v32f.real(re);
-            v32f.imag(im);
-            _lut_32f.push_back(v32f);
+            const double rate = std::stod(args.at("resample_rate"));
+            if (rate < 1.0) throw std::runtime_error("setupStream invalid resample_rate " + args.at("resample_rate"));
+            resampleRate = std::lround(rate);
+        }
+        if (args.count("resample_taps") != 0) resampleTaps = std::max(std::stoi(args.at("resample_taps")), 1);
+    }
+    catch (const std::invalid_argument &)
+    {
+        throw std::runtime_error("setupStream invalid resampler arguments");
+    }
+    if ((filter or resampleRate != 0) and realFormat)
+    {
+        throw std::runtime_error("setupStream the channel filter needs a complex or U16 format");
+    }
 
-            vs32f.real(v32f.imag());
-            vs32f.imag(v32f.real());
-            _lut_swap_32f.push_back(vs32f);
+    //planar output splits the rails of the complex formats
+    const bool planar = args.count("layout") != 0 and args.at("layout") == "planar";
+    if (args.count("layout") != 0 and not planar and args.at("layout") != "interleaved")
+    {
+        throw std::runtime_error("setupStream invalid layout '" + args.at("layout") + "'");
+    }
+    const bool complexFormat = rxFormat == RTL_RX_FORMAT_FLOAT32 or rxFormat == RTL_RX_FORMAT_INT16 or
+        rxFormat == RTL_RX_FORMAT_INT8 or rxFormat == RTL_RX_FORMAT_UINT8 or rxFormat == RTL_RX_FORMAT_FLOAT16;
+    if (planar and not complexFormat)
+    {
+        throw std::runtime_error("setupStream layout=planar needs a complex format");
+    }
 
-            std::complex<int16_t> v16i, vs16i;
+    //build the shared tables now rather than on the first read
+    SoapyRTLSDRTables::get();
 
-            v16i.real(int16_t((float(SHRT_MAX) * re)));
-            v16i.imag(int16_t((float(SHRT_MAX) * im)));
-            _lut_16i.push_back(v16i);
+    //the first stream configures the ring, later streams share it
+    std::lock_guard<std::mutex> lock(_streamMutex);
+    if (_streams.empty()) setupRing(args);
+    else SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR stream shares the ring with %zu other streams, ring args ignored", _streams.size());
 
-            vs16i.real(vs16i.imag());
-            vs16i.imag(vs16i.real());
-            _lut_swap_16i.push_back(vs16i);
-        }
+    SoapyRTLSDRStream *rxStream = new SoapyRTLSDRStream();
+    rxStream->format = rxFormat;
+    rxStream->planar = planar;
+    rxStream->filter = std::move(filter);
+    rxStream->resampleRate = resampleRate;
+    rxStream->resampleTaps = resampleTaps;
+    {
+    std::lock_guard<std::mutex> bufLock(_buf_mutex);
+    _streams.push_back(rxStream);
     }
 
+    return (SoapySDR::Stream *) rxStream;
+}
+
+//configure and allocate the ring shared by all streams
+void SoapyRTLSDR::setupRing(const SoapySDR::Kwargs &args)
+{
     bufferLength = DEFAULT_BUFFER_LENGTH;
     if (args.count("bufflen") != 0)
     {
@@ -238,7 +1686,7 @@ SoapySDR::Stream *SoapyRTLSDR::setupStream(
         }
         catch (const std::invalid_argument &){}
     }
-    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR Using buffer length %d", bufferLength);
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR Using buffer length %zu", bufferLength);
 
     numBuffers = DEFAULT_NUM_BUFFERS;
     if (args.count("buffers") != 0)
@@ -246,14 +1694,14 @@ SoapySDR::Stream *SoapyRTLSDR::setupStream(
         try
         {
             int numBuffers_in = std::stoi(args.at("buffers"));
-            if (numBuffers_in > 0)
+            if (numBuffers_in > 1)
             {
                 numBuffers = numBuffers_in;
             }
         }
         catch (const std::invalid_argument &){}
     }
-    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR Using %d buffers", numBuffers);
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR Using %zu buffers", numBuffers);
 
     asyncBuffs = 0;
     if (args.count("asyncBuffs") != 0)
@@ -268,6 +1716,43 @@ SoapySDR::Stream *SoapyRTLSDR::setupStream(
         }
         catch (const std::invalid_argument &){}
     }
+
+    latencyMs = 0.0;
+    headroomMs = DEFAULT_HEADROOM_MS;
+    if (args.count("latency_ms") != 0)
+    {
+        try
+        {
+            latencyMs = std::max(0.0, std::stod(args.at("latency_ms")));
+            if (args.count("headroom_ms") != 0) headroomMs = std::stod(args.at("headroom_ms"));
+        }
+        catch (const std::invalid_argument &){}
+    }
+    if (latencyMs > 0.0)
+    {
+        latencySizing(bufferLength, numBuffers, asyncBuffs);
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR latency %g ms: buffer length %zu, %zu buffers, %zu async buffers",
+            latencyMs, bufferLength, numBuffers, asyncBuffs);
+    }
+
+    threadAffinity = (args.count("affinity") != 0) ? args.at("affinity") : "";
+    threadScheduler = (args.count("scheduler") != 0) ? args.at("scheduler") : "";
+    threadPriority = 0;
+    if (args.count("priority") != 0)
+    {
+        try
+        {
+            threadPriority = std::stoi(args.at("priority"));
+        }
+        catch (const std::invalid_argument &){}
+    }
+    if (not threadScheduler.empty() and threadScheduler != "other" and
+        threadScheduler != "fifo" and threadScheduler != "rr")
+    {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR unknown scheduler '%s', [other, fifo, rr]", threadScheduler.c_str());
+        threadScheduler.clear();
+    }
+
     if (tunerType == RTLSDR_TUNER_E4000) {
         IFGain[0] = 6;
         IFGain[1] = 9;
@@ -280,29 +1765,305 @@ SoapySDR::Stream *SoapyRTLSDR::setupStream(
             IFGain[i] = 0;
         }
     }
-    tunerGain = rtlsdr_get_tuner_gain(dev) / 10.0;
+    if (dev != nullptr) tunerGain = rtlsdr_get_tuner_gain(dev) / 10.0;
 
     //clear async fifo counts
     _buf_tail = 0;
-    _buf_count = 0;
-    _buf_head = 0;
+
+    squelchEnabled = false;
+    squelchHangMs = DEFAULT_SQUELCH_HANG_MS;
+    squelchPrerollMs = DEFAULT_SQUELCH_PREROLL_MS;
+    if (args.count("squelch") != 0 and not args.at("squelch").empty())
+    {
+        try
+        {
+            squelchLevel = std::stod(args.at("squelch"));
+            squelchEnabled = true;
+            if (args.count("squelch_hang_ms") != 0) squelchHangMs = std::stod(args.at("squelch_hang_ms"));
+            if (args.count("squelch_preroll_ms") != 0) squelchPrerollMs = std::stod(args.at("squelch_preroll_ms"));
+        }
+        catch (const std::invalid_argument &){}
+    }
+    if (squelchEnabled) SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR squelch %g dBFS, hang %g ms, pre-roll %g ms",
+        squelchLevel, squelchHangMs, squelchPrerollMs);
+
+    historyMs = 0.0;
+    if (args.count("history_ms") != 0)
+    {
+        try
+        {
+            historyMs = std::max(0.0, std::stod(args.at("history_ms")));
+        }
+        catch (const std::invalid_argument &){}
+    }
+
+    arenaHugepages = (args.count("hugepages") != 0 and args.at("hugepages") == "true");
+    arenaLock = (args.count("mlock") != 0 and args.at("mlock") == "true");
+    arenaName = (args.count("arena") != 0) ? args.at("arena") : "";
+    arenaSize = 0;
+    if (args.count("arena_size") != 0)
+    {
+        try
+        {
+            arenaSize = std::stoull(args.at("arena_size"));
+        }
+        catch (const std::invalid_argument &){}
+    }
 
     //allocate buffers
-    _buffs.resize(numBuffers);
-    for (auto &buff : _buffs) buff.data.reserve(bufferLength);
-    for (auto &buff : _buffs) buff.data.resize(bufferLength);
+    allocateBuffers();
+
+    //the export ring keeps the initial slot size, larger buffers span slots
+    _shm.reset();
+    if (args.count("shm") != 0 and not args.at("shm").empty())
+    {
+        char manufact[256], product[256], serial[256];
+        if (_tcp) std::snprintf(serial, sizeof(serial), "%s", _tcp->address().c_str());
+        else if (rtlsdr_get_device_usb_strings(deviceId, manufact, product, serial) != 0) serial[0] = '\0';
+        _shm.reset(new SoapyRTLSDRSharedRing(args.at("shm"), numBuffers, bufferLength, serial, rtlTunerToString(tunerType)));
+        _shm->setTuning(sampleRate, tunedFrequency);
+    }
+
+    //librtlsdr runs a usb event loop inside rtlsdr_read_async for every
+    //dongle, only rtl_tcp devices can share one receive thread
+    tcpShared = args.count("rtltcp_engine") != 0 and args.at("rtltcp_engine") == "shared";
+    if (tcpShared and not _tcp)
+    {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR rtltcp_engine=shared only applies to rtl_tcp devices, using a thread");
+        tcpShared = false;
+    }
+    _tcpFill = 0;
+
+    //the other way around, rtlsdr_read_sync can run in the consumer
+    usbReader = args.count("usb_engine") != 0 and args.at("usb_engine") == "reader";
+    if (usbReader and _tcp)
+    {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR usb_engine=reader only applies to usb devices, using a thread");
+        usbReader = false;
+    }
+    if (usbReader and (not threadAffinity.empty() or not threadScheduler.empty() or threadPriority != 0))
+    {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "RTL-SDR usb_engine=reader has no rx thread, "
+            "affinity, scheduler and priority have no effect");
+    }
+
+    //the server queue is sized for the current rate, at least two buffers
+    _tcpServer.reset();
+    if (args.count("rtltcp_server") != 0 and not args.at("rtltcp_server").empty())
+    {
+        tcpQueueMs = DEFAULT_RTLTCP_QUEUE_MS;
+        try
+        {
+            if (args.count("rtltcp_queue_ms") != 0) tcpQueueMs = std::stod(args.at("rtltcp_queue_ms"));
+        }
+        catch (const std::invalid_argument &){}
+        _tcpServer.reset(new SoapyRTLSDRTcpServer(args.at("rtltcp_server"), tcpQueueSizing(bufferLength), tunerType, tunerGains.size()));
+    }
+
+    //the history is sized for the current rate, 2 bytes per sample
+    allocateHistory();
+
+}
+
+void SoapyRTLSDR::allocateBuffers(void)
+{
+    //squelch hang and pre-roll in whole buffers
+    const double bufferMs = bufferLength * 1000.0 / (sampleRate * BYTES_PER_SAMPLE);
+    _squelchHangBuffers = std::max<size_t>(1, size_t(std::ceil(squelchHangMs / bufferMs)));
+    const size_t numPreroll = squelchEnabled ? size_t(std::ceil(squelchPrerollMs / bufferMs)) : 0;
+
+    const size_t stride = ((bufferLength + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT) * ARENA_ALIGNMENT;
+    const size_t numStorage = numBuffers + SPARE_NUM_BUFFERS;
+    const size_t length = stride * (numStorage + numPreroll);
+
+    //keep the current arena when the layout and options did not change
+    const std::string layout = arenaName + ":" + std::to_string(length) + ":" +
+        std::to_string(arenaHugepages) + ":" + std::to_string(arenaLock);
+    if (_arenaBuffs != nullptr and layout == _arenaLayout and _preroll.size() == numPreroll)
+    {
+        for (auto &buff : _buffs) buff.size = bufferLength;
+        resetSlots();
+        return;
+    }
+    releaseBuffers();
+
+    if (arenaName.empty())
+    {
+        _arena.reset(new SoapyRTLSDRArena(length, arenaHugepages, arenaLock));
+    }
+    else
+    {
+        _arena = SoapyRTLSDRArena::shared(arenaName, std::max(arenaSize, length), arenaHugepages, arenaLock);
+    }
+
+    _arenaBuffs = _arena->allocate(length);
+    if (_arenaBuffs == nullptr)
+    {
+        _arena.reset();
+        throw std::runtime_error("setupStream failed: arena '" + arenaName + "' has no room for "
+            + std::to_string(length) + " bytes, increase arena_size");
+    }
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR ring uses %zu bytes of a %zu byte arena", length, _arena->size());
+
+    _arenaLayout = layout;
+    _buffs.resize(numStorage);
+    for (size_t i = 0; i < numStorage; i++)
+    {
+        _buffs[i].tick = 0;
+        _buffs[i].flags = 0;
+        _buffs[i].data = _arenaBuffs + i * stride;
+        _buffs[i].size = bufferLength;
+    }
+    _preroll.resize(numPreroll);
+    for (size_t i = 0; i < numPreroll; i++)
+    {
+        _preroll[i].tick = 0;
+        _preroll[i].flags = 0;
+        _preroll[i].data = _arenaBuffs + (numStorage + i) * stride;
+        _preroll[i].size = bufferLength;
+    }
+    resetSlots();
+}
+
+void SoapyRTLSDR::resetSlots(void)
+{
+    //the first buffers back the ring, the rest are spares
+    _buf_users.assign(_buffs.size(), 0);
+    _buf_slots.resize(numBuffers);
+    _buf_spares.clear();
+    for (size_t i = 0; i < _buffs.size(); i++)
+    {
+        if (i < numBuffers) _buf_slots[i] = i;
+        else _buf_spares.push_back(i);
+    }
+}
+
+//derive the buffer layout from the latency target and the current sample rate
+void SoapyRTLSDR::latencySizing(size_t &length, size_t &buffers, size_t &async) const
+{
+    const double bytesPerMs = sampleRate * BYTES_PER_SAMPLE / 1000.0;
+
+    //usb transfers are multiples of 512 bytes
+    length = size_t(latencyMs * bytesPerMs / 512.0 + 0.5) * 512;
+    length = std::max<size_t>(512, std::min<size_t>(DEFAULT_BUFFER_LENGTH, length));
+
+    const double bufferMs = length / bytesPerMs;
+    buffers = std::max<size_t>(2, size_t(std::ceil(headroomMs / bufferMs)));
+
+    //keep enough transfers in flight to ride out usb scheduling hiccups
+    async = std::max<size_t>(4, std::min<size_t>(32, size_t(std::ceil(ASYNC_INFLIGHT_MS / bufferMs))));
+}
+
+//resize the ring after a rate change, called from the readers
+void SoapyRTLSDR::applyLatencySizing(void)
+{
+    std::lock_guard<std::mutex> streamLock(_streamMutex);
+    if (not _resizeBuffers) return;
+
+    //the ring follows latency_ms, the history and the server queue follow the new rate
+    size_t length = bufferLength, buffers = numBuffers, async = asyncBuffs;
+    if (latencyMs > 0.0) latencySizing(length, buffers, async);
+    const bool resizeRing = length != bufferLength or buffers != numBuffers or async != asyncBuffs;
+    const bool resizeHistory = historySizing(length) != _historySize;
+    const bool resizeServer = _tcpServer and tcpQueueSizing(length) != _tcpServer->queueBytes();
+    if (not resizeRing and not resizeHistory and not resizeServer)
+    {
+        _resizeBuffers = false;
+        return;
+    }
+
+    //another reader still holds a slot, try again on the next acquire
+    auto slotsHeld = [this](void)
+    {
+        bool held = false;
+        for (auto stream : _streams) held = held or (stream->held != 0);
+        return held;
+    };
+    {
+    std::lock_guard<std::mutex> lock(_buf_mutex);
+    if (slotsHeld()) return;
+    }
+
+    const bool running = asyncRunning();
+    if (running) stopAsync();
+
+    {
+    std::lock_guard<std::mutex> lock(_buf_mutex);
+    if (not slotsHeld() and not resizeRing)
+    {
+        _resizeBuffers = false;
+        if (resizeHistory) allocateHistory();
+        if (resizeServer) _tcpServer->resize(tcpQueueSizing(length));
+    }
+    else if (not slotsHeld())
+    {
+        _resizeBuffers = false;
+        bufferLength = length;
+        numBuffers = buffers;
+        asyncBuffs = async;
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR latency %g ms at %u sps: buffer length %zu, %zu buffers, %zu async buffers",
+            latencyMs, sampleRate, bufferLength, numBuffers, asyncBuffs);
+
+        _buf_tail = 0;
+        allocateBuffers();
+        for (auto stream : _streams)
+        {
+            stream->head = 0;
+            stream->count = 0;
+        }
+        allocateHistory();
+        if (_tcpServer) _tcpServer->resize(tcpQueueSizing(length));
+    }
+    }
+
+    if (running) startAsync();
+}
 
-    return (SoapySDR::Stream *) this;
+void SoapyRTLSDR::releaseBuffers(void)
+{
+    if (_arena and _arenaBuffs != nullptr) _arena->release(_arenaBuffs);
+    _arenaBuffs = nullptr;
+    _arenaLayout.clear();
+    _arena.reset();
+    _buffs.clear();
+    _preroll.clear();
 }
 
 void SoapyRTLSDR::closeStream(SoapySDR::Stream *stream)
 {
     this->deactivateStream(stream, 0, 0);
-    _buffs.clear();
+
+    std::lock_guard<std::mutex> lock(_streamMutex);
+    {
+    std::lock_guard<std::mutex> bufLock(_buf_mutex);
+    _streams.erase(std::remove(_streams.begin(), _streams.end(), (SoapyRTLSDRStream *)stream), _streams.end());
+    }
+    delete (SoapyRTLSDRStream *)stream;
+
+    //the last stream out releases the ring
+    if (not _streams.empty()) return;
+    releaseBuffers();
+    {
+    std::lock_guard<std::mutex> historyLock(_historyMutex);
+    _history = nullptr;
+    _historyArena.reset();
+    }
+    _shm.reset();
+    _tcpServer.reset();
 }
 
 size_t SoapyRTLSDR::getStreamMTU(SoapySDR::Stream *stream) const
 {
+    //a pending rate change resizes the ring at the next activation,
+    //an active stream keeps getting the current buffers until it is applied
+    const SoapyRTLSDRStream *rxStream = (const SoapyRTLSDRStream *)stream;
+    const bool pending = _buffs.empty() or (_resizeBuffers and not rxStream->active);
+    if (latencyMs > 0.0 and pending)
+    {
+        size_t length, buffers, async;
+        latencySizing(length, buffers, async);
+        return length / BYTES_PER_SAMPLE;
+    }
     return bufferLength / BYTES_PER_SAMPLE;
 }
 
@@ -313,14 +2074,29 @@ int SoapyRTLSDR::activateStream(
         const size_t numElems)
 {
     if (flags != 0) return SOAPY_SDR_NOT_SUPPORTED;
-    resetBuffer = true;
-    bufferedElems = 0;
+    SoapyRTLSDRStream *rxStream = (SoapyRTLSDRStream *)stream;
+    applyLatencySizing();
+
+    std::lock_guard<std::mutex> lock(_streamMutex);
+
+    //start reading from the current ring position
+    {
+    std::lock_guard<std::mutex> bufLock(_buf_mutex);
+    rxStream->head = _buf_tail;
+    rxStream->count = 0;
+    rxStream->overflowEvent = false;
+    rxStream->resetBuffer = true;
+    rxStream->active = true;
+    }
 
     //start the async thread
-    if (not _rx_async_thread.joinable())
+    if (not asyncRunning())
     {
-        rtlsdr_reset_buffer(dev);
-        _rx_async_thread = std::thread(&SoapyRTLSDR::rx_async_operation, this);
+        _squelchOpen = false;
+        _squelchHang = 0;
+        _prerollHead = 0;
+        _prerollCount = 0;
+        startAsync();
     }
 
     return 0;
@@ -329,14 +2105,62 @@ int SoapyRTLSDR::activateStream(
 int SoapyRTLSDR::deactivateStream(SoapySDR::Stream *stream, const int flags, const long long timeNs)
 {
     if (flags != 0) return SOAPY_SDR_NOT_SUPPORTED;
-    if (_rx_async_thread.joinable())
+    SoapyRTLSDRStream *rxStream = (SoapyRTLSDRStream *)stream;
+
+    std::lock_guard<std::mutex> lock(_streamMutex);
+    bool active = false;
     {
-        rtlsdr_cancel_async(dev);
-        _rx_async_thread.join();
+    std::lock_guard<std::mutex> bufLock(_buf_mutex);
+    rxStream->active = false;
+    for (auto other : _streams) active = active or other->active;
     }
+
+    //the usb thread keeps running for the other active streams
+    if (not active) stopAsync();
     return 0;
 }
 
+void SoapyRTLSDR::resetStreams(void)
+{
+    std::lock_guard<std::mutex> lock(_buf_mutex);
+    for (auto stream : _streams) stream->resetBuffer = true;
+}
+
+void SoapyRTLSDR::convertStream(
+        SoapySDR::Stream *stream,
+        const rtlsdrRXFormat format,
+        const bool planar,
+        void * const *buffs,
+        const signed char *in,
+        const size_t numElems,
+        const long long tick)
+{
+    SoapyRTLSDRStream *rxStream = (SoapyRTLSDRStream *)stream;
+    SoapyRTLSDRConversion conversion;
+    conversion.format = format;
+    conversion.planar = planar;
+    conversion.swap = iqSwap;
+    //direct sampling mode 2 feeds the Q branch
+    conversion.rail = (directSamplingMode == 2) ? 1 : 0;
+    //lo_offset re-centering, swapped I/Q mirrors the spectrum
+    conversion.nco = iqSwap ? -_ncoFrequency.load() : _ncoFrequency.load();
+    conversion.tick = tick;
+    conversion.rate = sampleRate;
+    const auto calibration = std::atomic_load(&_calibration);
+    conversion.calibration = calibration.get();
+    conversion.scratch = &rxStream->filterIn;
+    conversion.fmLast = &rxStream->fmLast;
+
+    //restart the discriminator across gaps
+    if (format == RTL_RX_FORMAT_FM_FLOAT32 or format == RTL_RX_FORMAT_FM_INT16)
+    {
+        if (tick != rxStream->fmNextTick) rxStream->fmLast = 0.0f;
+        rxStream->fmNextTick = tick + numElems;
+    }
+
+    conversion.convert(buffs, in, numElems);
+}
+
 int SoapyRTLSDR::readStream(
         SoapySDR::Stream *stream,
         void * const *buffs,
@@ -345,112 +2169,197 @@ int SoapyRTLSDR::readStream(
         long long &timeNs,
         const long timeoutUs)
 {
+    SoapyRTLSDRStream *rxStream = (SoapyRTLSDRStream *)stream;
+    if (rxStream->filter or rxStream->resampleRate != 0) return readFiltered(rxStream, buffs, numElems, flags, timeNs, timeoutUs);
+
     //drop remainder buffer on reset
-    if (resetBuffer and bufferedElems != 0)
+    if (rxStream->resetBuffer and rxStream->bufferedElems != 0)
     {
-        bufferedElems = 0;
-        this->releaseReadBuffer(stream, _currentHandle);
+        rxStream->bufferedElems = 0;
+        this->releaseReadBuffer(stream, rxStream->currentHandle);
     }
 
-    //this is the user's buffer for channel 0
-    void *buff0 = buffs[0];
-
     //are elements left in the buffer? if not, do a new read.
-    if (bufferedElems == 0)
+    if (rxStream->bufferedElems == 0)
     {
-        int ret = this->acquireReadBuffer(stream, _currentHandle, (const void **)&_currentBuff, flags, timeNs, timeoutUs);
+        int ret = this->acquireReadBuffer(stream, rxStream->currentHandle, (const void **)&rxStream->currentBuff, flags, timeNs, timeoutUs);
         if (ret < 0) return ret;
-        bufferedElems = ret;
+        rxStream->bufferedElems = ret;
+
+        //end of burst belongs on the last fragment of the buffer
+        rxStream->currentFlags = flags & SOAPY_SDR_END_BURST;
+        flags &= ~SOAPY_SDR_END_BURST;
     }
 
     //otherwise just update return time to the current tick count
     else
     {
         flags |= SOAPY_SDR_HAS_TIME;
-        timeNs = SoapySDR::ticksToTimeNs(bufTicks, sampleRate);
+        timeNs = SoapySDR::ticksToTimeNs(rxStream->bufTicks, sampleRate);
     }
 
-    size_t returnedElems = std::min(bufferedElems, numElems);
+    size_t returnedElems = std::min(rxStream->bufferedElems, numElems);
 
-    //convert into user's buff0
-    if (rxFormat == RTL_RX_FORMAT_FLOAT32)
+    //convert into user's buff0, or buff0 and buff1 for the planar layout
+    this->convertStream(stream, rxStream->format, rxStream->planar, buffs, rxStream->currentBuff, returnedElems, rxStream->bufTicks);
+
+    //bump variables for next call into readStream
+    rxStream->bufferedElems -= returnedElems;
+    rxStream->currentBuff += returnedElems*BYTES_PER_SAMPLE;
+    rxStream->bufTicks += returnedElems; //for the next call to readStream if there is a remainder
+
+    //return number of elements written to buff0
+    if (rxStream->bufferedElems != 0) flags |= SOAPY_SDR_MORE_FRAGMENTS;
+    else
     {
-        float *ftarget = (float *) buff0;
-        std::complex<float> tmp;
-        if (iqSwap)
-        {
-            for (size_t i = 0; i < returnedElems; i++)
-            {
-                tmp = _lut_swap_32f[*((uint16_t*) &_currentBuff[2 * i])];
-                ftarget[i * 2] = tmp.real();
-                ftarget[i * 2 + 1] = tmp.imag();
-            }
-        }
-        else
-        {
-            for (size_t i = 0; i < returnedElems; i++)
-            {
-                tmp = _lut_32f[*((uint16_t*) &_currentBuff[2 * i])];
-                ftarget[i * 2] = tmp.real();
-                ftarget[i * 2 + 1] = tmp.imag();
-            }
-        }
+        flags |= rxStream->currentFlags;
+        this->releaseReadBuffer(stream, rxStream->currentHandle);
+    }
+    return returnedElems;
+}
+
+//readStream through the channel filter and the resampler, whole raw buffers
+//go into the filter and the output is handed out from the filtered queue
+int SoapyRTLSDR::readFiltered(
+        SoapyRTLSDRStream *rxStream,
+        void * const *buffs,
+        const size_t numElems,
+        int &flags,
+        long long &timeNs,
+        const long timeoutUs)
+{
+    SoapySDR::Stream *stream = (SoapySDR::Stream *)rxStream;
+    SoapyRTLSDRChannelFilter *filter = rxStream->filter.get();
+    const long long decim = filter ? filter->decimation() : 1;
+
+    //drop filtered samples on reset
+    if (rxStream->resetBuffer)
+    {
+        rxStream->filtered.clear();
+        rxStream->filteredHead = 0;
+        rxStream->filterNextTick = -1;
     }
-    else if (rxFormat == RTL_RX_FORMAT_INT16)
+
+    while (rxStream->filteredHead == rxStream->filtered.size())
     {
-        int16_t *itarget = (int16_t *) buff0;
-        std::complex<int16_t> tmp;
-        if (iqSwap)
+        rxStream->filtered.clear();
+        rxStream->filteredHead = 0;
+
+        const signed char *buff = nullptr;
+        int ret = this->acquireReadBuffer(stream, rxStream->currentHandle, (const void **)&buff, flags, timeNs, timeoutUs);
+        if (ret < 0)
         {
-            for (size_t i = 0; i < returnedElems; i++)
-            {
-                tmp = _lut_swap_16i[*((uint16_t*) &_currentBuff[2 * i])];
-                itarget[i * 2] = tmp.real();
-                itarget[i * 2 + 1] = tmp.imag();
-            }
+            if (ret == SOAPY_SDR_OVERFLOW) rxStream->filterNextTick = -1;
+            return ret;
+        }
+
+        //restart the filter on gaps, the output tick is the input tick less the group delay
+        if (rxStream->bufTicks != rxStream->filterNextTick)
+        {
+            if (filter) filter->reset();
+            rxStream->fmLast = 0.0f;
+            rxStream->filteredTick = rxStream->bufTicks - (filter ? (long long)filter->delay() : 0);
+            if (rxStream->resampleRate != 0) this->resetResampler(rxStream, decim);
         }
+        rxStream->filterNextTick = rxStream->bufTicks + ret;
+        rxStream->currentFlags = flags & SOAPY_SDR_END_BURST;
+
+        rxStream->filterIn.resize(ret);
+        const long long nco = iqSwap ? -_ncoFrequency.load() : _ncoFrequency.load();
+        const auto calibration = std::atomic_load(&_calibration);
+        const InputRails rails = calibration ? InputRails(*calibration) : InputRails(SoapyRTLSDRTables::get().f32);
+        float *scratch = (float *)rxStream->filterIn.data();
+        convertCorrected(OutputRails<float>(scratch, false), 1.0f, rails, buff, ret, iqSwap, rxStream->bufTicks, nco, sampleRate);
+        this->releaseReadBuffer(stream, rxStream->currentHandle);
+
+        if (not rxStream->resampler) filter->process(rxStream->filterIn.data(), ret, rxStream->filtered);
+        else if (not filter) rxStream->resampler->process(rxStream->filterIn.data(), ret, rxStream->filtered);
         else
         {
-            for (size_t i = 0; i < returnedElems; i++)
-            {
-                tmp = _lut_16i[*((uint16_t*) &_currentBuff[2 * i])];
-                itarget[i * 2] = tmp.real();
-                itarget[i * 2 + 1] = tmp.imag();
-            }
+            rxStream->resampleIn.clear();
+            filter->process(rxStream->filterIn.data(), ret, rxStream->resampleIn);
+            rxStream->resampler->process(rxStream->resampleIn.data(), rxStream->resampleIn.size(), rxStream->filtered);
         }
     }
-    else if (rxFormat == RTL_RX_FORMAT_INT8)
+
+    const std::complex<float> *in = rxStream->filtered.data() + rxStream->filteredHead;
+    const size_t returnedElems = std::min(rxStream->filtered.size() - rxStream->filteredHead, numElems);
+    void *buff0 = buffs[0];
+    const bool planar = rxStream->planar;
+    if (rxStream->format == RTL_RX_FORMAT_FLOAT32 and not planar)
     {
-        int8_t *itarget = (int8_t *) buff0;
-        if (iqSwap)
-        {
-            for (size_t i = 0; i < returnedElems; i++)
-            {
-                itarget[i * 2] = _currentBuff[i * 2 + 1]-128;
-                itarget[i * 2 + 1] = _currentBuff[i * 2]-128;
-            }
-        }
-        else
+        std::copy(in, in + returnedElems, (std::complex<float> *)buff0);
+    }
+    else if (rxStream->format == RTL_RX_FORMAT_FLOAT32)
+    {
+        convertFiltered(OutputRails<float>(buffs, planar, false), 1.0f, in, returnedElems);
+    }
+    else if (rxStream->format == RTL_RX_FORMAT_INT16)
+    {
+        convertFiltered(OutputRails<int16_t>(buffs, planar, false), 32768.0f, in, returnedElems);
+    }
+    else if (rxStream->format == RTL_RX_FORMAT_INT8 or rxStream->format == RTL_RX_FORMAT_UINT8)
+    {
+        const OutputRails<int8_t> out(buffs, planar, false);
+        convertFiltered(out, 128.0f, in, returnedElems);
+        if (rxStream->format == RTL_RX_FORMAT_UINT8) offsetBinary(out, returnedElems);
+    }
+    else if (rxStream->format == RTL_RX_FORMAT_FLOAT16)
+    {
+        convertHalf(OutputRails<uint16_t>(buffs, planar, false), in, returnedElems);
+    }
+    else if (rxStream->format == RTL_RX_FORMAT_FM_FLOAT32)
+    {
+        discriminate((float *)buff0, 1.0f, in, returnedElems, rxStream->fmLast);
+    }
+    else if (rxStream->format == RTL_RX_FORMAT_FM_INT16)
+    {
+        discriminate((int16_t *)buff0, 32768.0f, in, returnedElems, rxStream->fmLast);
+    }
+    else
+    {
+        const bool squared = rxStream->format == RTL_RX_FORMAT_MAGSQ16;
+        for (size_t i = 0; i < returnedElems; i++)
         {
-            for (size_t i = 0; i < returnedElems; i++)
-            {
-                itarget[i * 2] = _currentBuff[i * 2]-128;
-                itarget[i * 2 + 1] = _currentBuff[i * 2 + 1]-128;
-            }
+            const float power = std::norm(in[i]);
+            ((uint16_t *)buff0)[i] = uint16_t(std::min((squared ? power : std::sqrt(power)) * 32768.0f, float(USHRT_MAX)));
         }
     }
 
-    //bump variables for next call into readStream
-    bufferedElems -= returnedElems;
-    _currentBuff += returnedElems*BYTES_PER_SAMPLE;
-    bufTicks += returnedElems; //for the next call to readStream if there is a remainder
-
-    //return number of elements written to buff0
-    if (bufferedElems != 0) flags |= SOAPY_SDR_MORE_FRAGMENTS;
-    else this->releaseReadBuffer(stream, _currentHandle);
+    flags = SOAPY_SDR_HAS_TIME;
+    if (rxStream->resampler)
+    {
+        //resampled output n is exactly n output periods after the first one
+        timeNs = SoapySDR::ticksToTimeNs(rxStream->filteredTick, sampleRate) - rxStream->resampleDelayNs +
+            SoapySDR::ticksToTimeNs(rxStream->resampledCount, rxStream->resampleRate);
+        rxStream->resampledCount += returnedElems;
+    }
+    else
+    {
+        timeNs = SoapySDR::ticksToTimeNs(rxStream->filteredTick, sampleRate);
+        rxStream->filteredTick += returnedElems * decim;
+    }
+    rxStream->filteredHead += returnedElems;
+    if (rxStream->filteredHead != rxStream->filtered.size()) flags |= SOAPY_SDR_MORE_FRAGMENTS;
+    else flags |= rxStream->currentFlags;
     return returnedElems;
 }
 
+//restart the resampler after a gap, it is rebuilt when the device rate changed
+void SoapyRTLSDR::resetResampler(SoapyRTLSDRStream *rxStream, const long long decim)
+{
+    if (not rxStream->resampler or rxStream->resampleFrom != sampleRate)
+    {
+        //the filter output runs at sampleRate / decim, scale the output rate to keep integers
+        rxStream->resampler.reset(new SoapyRTLSDRResampler(sampleRate, rxStream->resampleRate * decim, rxStream->resampleTaps));
+        rxStream->resampleFrom = sampleRate;
+        rxStream->resampleDelayNs = std::llround(rxStream->resampler->delay() * decim * 1e9 / sampleRate);
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "RTL-SDR resampling %g Hz to %lu Hz", double(sampleRate) / decim, rxStream->resampleRate);
+    }
+    rxStream->resampler->reset();
+    rxStream->resampledCount = 0;
+}
+
 /*******************************************************************
  * Direct buffer access API
  ******************************************************************/
@@ -462,7 +2371,7 @@ size_t SoapyRTLSDR::getNumDirectAccessBuffers(SoapySDR::Stream *stream)
 
 int SoapyRTLSDR::getDirectAccessBufferAddrs(SoapySDR::Stream *stream, const size_t handle, void **buffs)
 {
-    buffs[0] = (void *)_buffs[handle].data.data();
+    buffs[0] = (void *)_buffs[handle].data;
     return 0;
 }
 
@@ -474,50 +2383,68 @@ int SoapyRTLSDR::acquireReadBuffer(
     long long &timeNs,
     const long timeoutUs)
 {
+    SoapyRTLSDRStream *rxStream = (SoapyRTLSDRStream *)stream;
+
+    //a rate change may have resized the ring
+    if (_resizeBuffers) applyLatencySizing();
+
+    if (_usbReading) rx_usb_read(rxStream);
+
+    std::unique_lock <std::mutex> lock(_buf_mutex);
+
     //reset is issued by various settings
     //to drain old data out of the queue
-    if (resetBuffer)
+    if (rxStream->resetBuffer)
     {
         //drain all buffers from the fifo
-        _buf_head = (_buf_head + _buf_count.exchange(0)) % numBuffers;
-        resetBuffer = false;
-        _overflowEvent = false;
+        rxStream->head = _buf_tail;
+        rxStream->count = 0;
+        rxStream->resetBuffer = false;
+        rxStream->overflowEvent = false;
     }
 
     //handle overflow from the rx callback thread
-    if (_overflowEvent)
+    if (rxStream->overflowEvent)
     {
         //drain the old buffers from the fifo
-        _buf_head = (_buf_head + _buf_count.exchange(0)) % numBuffers;
-        _overflowEvent = false;
+        rxStream->head = _buf_tail;
+        rxStream->count = 0;
+        rxStream->overflowEvent = false;
+        lock.unlock();
         SoapySDR::log(SOAPY_SDR_SSI, "O");
         return SOAPY_SDR_OVERFLOW;
     }
 
     //wait for a buffer to become available
-    if (_buf_count == 0)
+    if (rxStream->count == 0)
     {
-        std::unique_lock <std::mutex> lock(_buf_mutex);
-        _buf_cond.wait_for(lock, std::chrono::microseconds(timeoutUs), [this]{return _buf_count != 0;});
-        if (_buf_count == 0) return SOAPY_SDR_TIMEOUT;
+        _buf_cond.wait_for(lock, std::chrono::microseconds(timeoutUs), [rxStream]{return rxStream->count != 0;});
+        if (rxStream->count == 0) return SOAPY_SDR_TIMEOUT;
     }
 
-    //extract handle and buffer
-    handle = _buf_head;
-    _buf_head = (_buf_head + 1) % numBuffers;
-    bufTicks = _buffs[handle].tick;
+    //extract handle and buffer, the buffer is held until released
+    handle = _buf_slots[rxStream->head];
+    rxStream->head = (rxStream->head + 1) % numBuffers;
+    rxStream->count--;
+    rxStream->held++;
+    _buf_users[handle]++;
+    lock.unlock();
+
+    rxStream->bufTicks = _buffs[handle].tick;
     timeNs = SoapySDR::ticksToTimeNs(_buffs[handle].tick, sampleRate);
-    buffs[0] = (void *)_buffs[handle].data.data();
-    flags = SOAPY_SDR_HAS_TIME;
+    buffs[0] = (void *)_buffs[handle].data;
+    flags = SOAPY_SDR_HAS_TIME | _buffs[handle].flags;
 
     //return number available
-    return _buffs[handle].data.size() / BYTES_PER_SAMPLE;
+    return _buffs[handle].size / BYTES_PER_SAMPLE;
 }
 
 void SoapyRTLSDR::releaseReadBuffer(
     SoapySDR::Stream *stream,
     const size_t handle)
 {
-    //TODO this wont handle out of order releases
-    _buf_count--;
+    SoapyRTLSDRStream *rxStream = (SoapyRTLSDRStream *)stream;
+    std::lock_guard<std::mutex> lock(_buf_mutex);
+    rxStream->held--;
+    _buf_users[handle]--;
 }
@@ -0,0 +1,132 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include <algorithm> //min, max
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <vector>
+
+#define BENCH_SAMPLES (1 << 21)
+#define BENCH_CHUNK 16384 //like one ring buffer
+#define BENCH_RUNS 3
+
+/***********************************************************************
+ * Overlap-save channel filter against a direct form FIR of the same
+ * taps, which only computes the outputs the decimation keeps.
+ **********************************************************************/
+
+static void directFIR(const std::vector<float> &taps, const size_t decim,
+    std::vector<std::complex<float>> &history, size_t &phase,
+    const std::complex<float> *in, const size_t numElems, std::vector<std::complex<float>> &out)
+{
+    //history holds the last taps-1 inputs in front of the new ones
+    const size_t numTaps = taps.size();
+    history.resize(numTaps - 1);
+    history.insert(history.end(), in, in + numElems);
+    for (size_t n = 0; n < numElems; n++)
+    {
+        if (phase++ % decim != 0) continue;
+        const std::complex<float> *x = history.data() + n + numTaps - 1;
+        float re = 0.0f, im = 0.0f;
+        for (size_t k = 0; k < numTaps; k++)
+        {
+            re += taps[k] * x[-ptrdiff_t(k)].real();
+            im += taps[k] * x[-ptrdiff_t(k)].imag();
+        }
+        out.push_back(std::complex<float>(re, im));
+    }
+    history.erase(history.begin(), history.end() - (numTaps - 1));
+}
+
+//best of a few runs in millions of input samples per second
+template <typename Fn>
+static double throughput(Fn fn)
+{
+    double best = 0.0;
+    for (size_t run = 0; run < BENCH_RUNS; run++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::max(best, BENCH_SAMPLES / seconds / 1e6);
+    }
+    return best;
+}
+
+int main(void)
+{
+    std::vector<std::complex<float>> input(BENCH_SAMPLES);
+    unsigned state = 1;
+    for (auto &x : input)
+    {
+        state = state * 1103515245 + 12345;
+        x = std::complex<float>(float((state >> 16) & 0xff) / 128.0f - 1.0f, float((state >> 8) & 0xff) / 128.0f - 1.0f);
+    }
+
+    std::printf("%6s %6s %14s %14s %8s %10s\n", "taps", "decim", "overlap Msps", "direct Msps", "speedup", "max error");
+    const size_t tapCounts[] = {8, 16, 32, 64, 128, 256, 512};
+    const size_t decims[] = {1, 8};
+    for (const size_t decim : decims)
+    {
+        for (const size_t numTaps : tapCounts)
+        {
+            const auto taps = SoapyRTLSDRChannelFilter::lowpass(numTaps, 0.4 / decim);
+            std::vector<std::complex<float>> overlapOut, directOut;
+            overlapOut.reserve(BENCH_SAMPLES);
+            directOut.reserve(BENCH_SAMPLES);
+
+            const double overlap = throughput([&](void)
+            {
+                SoapyRTLSDRChannelFilter filter(taps, 0.0, decim);
+                overlapOut.clear();
+                for (size_t i = 0; i < input.size(); i += BENCH_CHUNK)
+                {
+                    filter.process(input.data() + i, std::min<size_t>(BENCH_CHUNK, input.size() - i), overlapOut);
+                }
+            });
+
+            const double direct = throughput([&](void)
+            {
+                std::vector<std::complex<float>> history;
+                size_t phase = 0;
+                directOut.clear();
+                for (size_t i = 0; i < input.size(); i += BENCH_CHUNK)
+                {
+                    directFIR(taps, decim, history, phase, input.data() + i, std::min<size_t>(BENCH_CHUNK, input.size() - i), directOut);
+                }
+            });
+
+            //the overlap-save output stops at the last whole block
+            float error = 0.0f;
+            const size_t common = std::min(overlapOut.size(), directOut.size());
+            for (size_t i = 0; i < common; i++) error = std::max(error, std::abs(overlapOut[i] - directOut[i]));
+
+            std::printf("%6zu %6zu %14.1f %14.1f %7.2fx %10.2e\n", numTaps, decim, overlap, direct, overlap / direct, error);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "SoapyRTLSDR.hpp"
+#include "FakeRTLSDR.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <sys/resource.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_SECONDS 2.0
+#define BENCH_MAX_DEVICES 16
+
+/***********************************************************************
+ * Process CPU and context switches against the number of dongles,
+ * with a usb thread per dongle against rtlsdr_read_sync in the reader.
+ * The simulated dongles deliver at 2.048 Msps and every dongle has one
+ * consumer thread that only takes the buffers, so the numbers are the
+ * cost of the transport. The reader mode loses what the dongle sends
+ * while nobody reads, the overflows it reported are counted so the two
+ * rates are only compared where both are lossless.
+ **********************************************************************/
+
+//threads of this process, -1 where /proc is missing
+static int threadCount(void)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 8, "Threads:") == 0) return std::stoi(line.substr(8));
+    }
+    return -1;
+}
+
+struct Usage
+{
+    double cpuSeconds;
+    long switches;
+};
+
+static Usage usage(void)
+{
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    Usage u;
+    u.cpuSeconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    u.switches = ru.ru_nvcsw + ru.ru_nivcsw;
+    return u;
+}
+
+static void measure(const size_t numDevices, const std::string &engine)
+{
+    std::vector<std::unique_ptr<SoapyRTLSDR>> devices;
+    std::vector<SoapySDR::Stream *> streams;
+    SoapySDR::Kwargs streamArgs;
+    streamArgs["usb_engine"] = engine;
+    for (size_t i = 0; i < numDevices; i++)
+    {
+        char serial[16];
+        std::snprintf(serial, sizeof(serial), "%08u", unsigned(i + 1));
+        SoapySDR::Kwargs args;
+        args["serial"] = serial;
+        devices.push_back(std::unique_ptr<SoapyRTLSDR>(new SoapyRTLSDR(args)));
+        streams.push_back(devices.back()->setupStream(SOAPY_SDR_RX, SOAPY_SDR_CS8, std::vector<size_t>(), streamArgs));
+        devices.back()->activateStream(streams.back());
+    }
+
+    std::atomic<bool> done(false);
+    std::atomic<unsigned long long> samples(0);
+    std::atomic<unsigned long long> overflows(0);
+    std::vector<std::thread> consumers;
+    for (size_t i = 0; i < numDevices; i++)
+    {
+        consumers.push_back(std::thread([&, i](void)
+        {
+            while (not done)
+            {
+                size_t handle = 0;
+                const void *buffs[1];
+                int flags = 0;
+                long long timeNs = 0;
+                const int ret = devices[i]->acquireReadBuffer(streams[i], handle, buffs, flags, timeNs);
+                if (ret == SOAPY_SDR_OVERFLOW) overflows++;
+                if (ret <= 0) continue;
+                samples += ret;
+                devices[i]->releaseReadBuffer(streams[i], handle);
+            }
+        }));
+    }
+
+    //settle, then measure the steady state
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const int threads = threadCount();
+    const Usage before = usage();
+    const unsigned long long samplesBefore = samples;
+    const unsigned long long overflowsBefore = overflows;
+    const auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(BENCH_SECONDS));
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const Usage after = usage();
+    const double rate = (samples - samplesBefore) / seconds / 1e6;
+    const unsigned long long lost = overflows - overflowsBefore;
+
+    done = true;
+    for (auto &consumer : consumers) consumer.join();
+    for (size_t i = 0; i < numDevices; i++)
+    {
+        devices[i]->deactivateStream(streams[i]);
+        devices[i]->closeStream(streams[i]);
+    }
+
+    std::printf("%8zu %8s %8d %8.1f %12.0f %12.2f %10llu\n", numDevices, engine.c_str(), threads,
+        100.0 * (after.cpuSeconds - before.cpuSeconds) / seconds,
+        (after.switches - before.switches) / seconds, rate, lost);
+}
+
+int main(void)
+{
+    FakeRTLSDR::setDeviceCount(BENCH_MAX_DEVICES);
+    FakeRTLSDR::setPattern(FakeRTLSDR::COUNTER);
+    FakeRTLSDR::setPaced(true);
+
+    std::printf("%8s %8s %8s %8s %12s %12s %10s\n", "dongles", "engine", "threads", "cpu %", "switches/s", "total Msps", "overflows");
+    const size_t deviceCounts[] = {1, 2, 4, 8, 16};
+    for (const size_t numDevices : deviceCounts)
+    {
+        measure(numDevices, "thread");
+        measure(numDevices, "reader");
+    }
+    return 0;
+}
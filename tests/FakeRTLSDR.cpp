@@ -0,0 +1,375 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "FakeRTLSDR.hpp"
+#include <rtl-sdr.h>
+#include <algorithm> //min
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio> //snprintf
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/***********************************************************************
+ * Simulation state
+ **********************************************************************/
+
+#define FAKE_MAX_DEVICES 16
+#define FAKE_BURST_PERIOD 7919
+#define FAKE_TRANSFER_SIZE (16 * 32 * 512)
+
+struct rtlsdr_dev
+{
+    uint32_t index;
+    uint32_t frequency;
+    uint32_t sampleRate;
+    int ppm;
+    int gain;
+    int directSampling;
+    int offsetTuning;
+    std::atomic<bool> cancel;
+    unsigned long long samples; //delivered since open
+    long long start; //absolute sample of the first delivery
+    std::chrono::steady_clock::time_point next; //pacing of read_sync
+};
+
+static std::atomic<size_t> deviceCount(1);
+static std::atomic<int> pattern(FakeRTLSDR::COUNTER);
+static std::atomic<long long> delays[FAKE_MAX_DEVICES];
+static std::atomic<long long> latencies[FAKE_MAX_DEVICES];
+static std::atomic<bool> paced(true);
+static std::atomic<size_t> controls(0);
+
+void FakeRTLSDR::setDeviceCount(const size_t count)
+{
+    deviceCount = std::min<size_t>(count, FAKE_MAX_DEVICES);
+}
+
+void FakeRTLSDR::setPattern(const Pattern p)
+{
+    pattern = p;
+}
+
+void FakeRTLSDR::setDelay(const size_t index, const long long samples)
+{
+    delays[index] = samples;
+}
+
+void FakeRTLSDR::setTransferLatency(const size_t index, const long long microseconds)
+{
+    latencies[index] = microseconds;
+}
+
+void FakeRTLSDR::setPaced(const bool p)
+{
+    paced = p;
+}
+
+size_t FakeRTLSDR::controlCount(void)
+{
+    return controls;
+}
+
+static uint32_t hash32(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return uint32_t(x);
+}
+
+static void fill(rtlsdr_dev_t *dev, unsigned char *buf, const uint32_t len)
+{
+    const bool bursts = pattern == FakeRTLSDR::BURSTS;
+    for (uint32_t i = 0; i + 1 < len; i += 2, dev->samples++)
+    {
+        if (not bursts)
+        {
+            buf[i] = (unsigned char)(dev->samples & 0xff);
+            buf[i + 1] = 255 - buf[i];
+            continue;
+        }
+        const long long n = dev->start + (long long)dev->samples - delays[dev->index];
+        const int amplitude = ((n / FAKE_BURST_PERIOD) % 13 == 0) ? 100 : 4;
+        const uint32_t h = hash32(uint64_t(n));
+        buf[i] = 128 + int(h & 0xff) * amplitude / 256 - amplitude / 2;
+        buf[i + 1] = 128 + int((h >> 8) & 0xff) * amplitude / 256 - amplitude / 2;
+    }
+}
+
+//every device counts absolute samples from the same epoch so delays line up
+static long long absoluteSample(const rtlsdr_dev_t *dev)
+{
+    static const auto epoch = std::chrono::steady_clock::now();
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count();
+    return (long long)(elapsed * dev->sampleRate);
+}
+
+static void transferWait(const rtlsdr_dev_t *dev, std::chrono::steady_clock::time_point &next, const uint32_t len)
+{
+    const long long latency = latencies[dev->index];
+    if (latency != 0) std::this_thread::sleep_for(std::chrono::microseconds(latency));
+    if (not paced) return;
+    next += std::chrono::nanoseconds((long long)(1e9 * (len / 2) / dev->sampleRate));
+    std::this_thread::sleep_until(next);
+}
+
+/***********************************************************************
+ * librtlsdr entry points
+ **********************************************************************/
+
+extern "C" {
+
+uint32_t rtlsdr_get_device_count(void)
+{
+    return uint32_t(deviceCount.load());
+}
+
+const char *rtlsdr_get_device_name(uint32_t index)
+{
+    return "Generic RTL2832U OEM";
+}
+
+int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact, char *product, char *serial)
+{
+    if (index >= deviceCount) return -1;
+    if (manufact != nullptr) std::snprintf(manufact, 256, "Realtek");
+    if (product != nullptr) std::snprintf(product, 256, "RTL2838UHIDIR");
+    if (serial != nullptr) std::snprintf(serial, 256, "%08u", index + 1);
+    return 0;
+}
+
+int rtlsdr_get_index_by_serial(const char *serial)
+{
+    char indexSerial[256];
+    for (uint32_t i = 0; i < deviceCount; i++)
+    {
+        rtlsdr_get_device_usb_strings(i, nullptr, nullptr, indexSerial);
+        if (std::strcmp(serial, indexSerial) == 0) return int(i);
+    }
+    return -3;
+}
+
+int rtlsdr_open(rtlsdr_dev_t **dev, uint32_t index)
+{
+    if (index >= deviceCount) return -1;
+    auto d = new rtlsdr_dev();
+    d->index = index;
+    d->frequency = 100000000;
+    d->sampleRate = 2048000;
+    d->ppm = 0;
+    d->gain = 0;
+    d->directSampling = 0;
+    d->offsetTuning = 0;
+    d->cancel = false;
+    d->samples = 0;
+    d->start = 0;
+    *dev = d;
+    return 0;
+}
+
+int rtlsdr_close(rtlsdr_dev_t *dev)
+{
+    delete dev;
+    return 0;
+}
+
+int rtlsdr_get_usb_strings(rtlsdr_dev_t *dev, char *manufact, char *product, char *serial)
+{
+    return rtlsdr_get_device_usb_strings(dev->index, manufact, product, serial);
+}
+
+int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
+{
+    controls++;
+    dev->frequency = freq;
+    return 0;
+}
+
+uint32_t rtlsdr_get_center_freq(rtlsdr_dev_t *dev)
+{
+    return dev->frequency;
+}
+
+int rtlsdr_set_freq_correction(rtlsdr_dev_t *dev, int ppm)
+{
+    if (ppm == dev->ppm) return -2;
+    controls++;
+    dev->ppm = ppm;
+    return 0;
+}
+
+int rtlsdr_get_freq_correction(rtlsdr_dev_t *dev)
+{
+    return dev->ppm;
+}
+
+enum rtlsdr_tuner rtlsdr_get_tuner_type(rtlsdr_dev_t *dev)
+{
+    return RTLSDR_TUNER_R820T;
+}
+
+static const int r820tGains[] = {0, 9, 14, 27, 37, 77, 87, 125, 144, 157, 166, 197, 207, 229,
+    254, 280, 297, 328, 338, 364, 372, 386, 402, 421, 434, 439, 445, 480, 496};
+
+int rtlsdr_get_tuner_gains(rtlsdr_dev_t *dev, int *gains)
+{
+    if (gains != nullptr) std::memcpy(gains, r820tGains, sizeof(r820tGains));
+    return int(sizeof(r820tGains) / sizeof(int));
+}
+
+int rtlsdr_set_tuner_gain(rtlsdr_dev_t *dev, int gain)
+{
+    controls++;
+    dev->gain = gain;
+    return 0;
+}
+
+int rtlsdr_get_tuner_gain(rtlsdr_dev_t *dev)
+{
+    return dev->gain;
+}
+
+int rtlsdr_set_tuner_bandwidth(rtlsdr_dev_t *dev, uint32_t bw)
+{
+    controls++;
+    return 0;
+}
+
+int rtlsdr_set_tuner_if_gain(rtlsdr_dev_t *dev, int stage, int gain)
+{
+    controls++;
+    return 0;
+}
+
+int rtlsdr_set_tuner_gain_mode(rtlsdr_dev_t *dev, int manual)
+{
+    controls++;
+    return 0;
+}
+
+int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t rate)
+{
+    if (rate < 225001 or rate > 3200000) return -EINVAL;
+    controls++;
+    dev->sampleRate = rate;
+    return 0;
+}
+
+uint32_t rtlsdr_get_sample_rate(rtlsdr_dev_t *dev)
+{
+    return dev->sampleRate;
+}
+
+int rtlsdr_set_testmode(rtlsdr_dev_t *dev, int on)
+{
+    return 0;
+}
+
+int rtlsdr_set_agc_mode(rtlsdr_dev_t *dev, int on)
+{
+    return 0;
+}
+
+int rtlsdr_set_direct_sampling(rtlsdr_dev_t *dev, int on)
+{
+    dev->directSampling = on;
+    return 0;
+}
+
+int rtlsdr_get_direct_sampling(rtlsdr_dev_t *dev)
+{
+    return dev->directSampling;
+}
+
+int rtlsdr_set_offset_tuning(rtlsdr_dev_t *dev, int on)
+{
+    dev->offsetTuning = on;
+    return 0;
+}
+
+int rtlsdr_get_offset_tuning(rtlsdr_dev_t *dev)
+{
+    return dev->offsetTuning;
+}
+
+int rtlsdr_set_bias_tee(rtlsdr_dev_t *dev, int on)
+{
+    return 0;
+}
+
+int rtlsdr_set_dithering(rtlsdr_dev_t *dev, int dither)
+{
+    return 0;
+}
+
+int rtlsdr_reset_buffer(rtlsdr_dev_t *dev)
+{
+    //the stream start clears a cancel left from the last stop
+    dev->cancel = false;
+    return 0;
+}
+
+int rtlsdr_read_sync(rtlsdr_dev_t *dev, void *buf, int len, int *n_read)
+{
+    //paced from the previous call, a long pause restarts the clock
+    const auto now = std::chrono::steady_clock::now();
+    if (dev->samples == 0 or dev->next < now - std::chrono::milliseconds(100))
+    {
+        dev->next = now;
+        dev->start = absoluteSample(dev) - (long long)dev->samples;
+    }
+    transferWait(dev, dev->next, uint32_t(len));
+    fill(dev, (unsigned char *)buf, uint32_t(len));
+    *n_read = len;
+    return 0;
+}
+
+int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+    if (buf_len == 0) buf_len = FAKE_TRANSFER_SIZE;
+    std::vector<unsigned char> buf(buf_len);
+    auto next = std::chrono::steady_clock::now();
+    dev->start = absoluteSample(dev) - (long long)dev->samples;
+    while (not dev->cancel)
+    {
+        transferWait(dev, next, buf_len);
+        fill(dev, buf.data(), buf_len);
+        cb(buf.data(), buf_len, ctx);
+    }
+    return 0;
+}
+
+int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
+{
+    dev->cancel = true;
+    return 0;
+}
+
+} //extern "C"
@@ -0,0 +1,62 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+/*!
+ * Controls for the simulated librtlsdr the tests link against.
+ * Every dongle streams a pattern derived from its sample index,
+ * so the tests can check continuity, alignment and delays.
+ */
+namespace FakeRTLSDR
+{
+    enum Pattern
+    {
+        //! i = n & 0xff, q = 255 - i for the n-th sample of the device
+        COUNTER,
+
+        //! noise with strong bursts every few thousand samples, the same
+        //! for every device at the same time minus its delay
+        BURSTS,
+    };
+
+    //! Dongles reported by rtlsdr_get_device_count, serials 00000001...
+    void setDeviceCount(const size_t count);
+
+    void setPattern(const Pattern pattern);
+
+    //! Samples the signal reaches this dongle after the first one
+    void setDelay(const size_t index, const long long samples);
+
+    //! Extra time every usb transfer of this dongle takes
+    void setTransferLatency(const size_t index, const long long microseconds);
+
+    //! Deliver at the sample rate when true, as fast as possible otherwise
+    void setPaced(const bool paced);
+
+    //! Settings sent to the dongles since the start, for the setter tests
+    size_t controlCount(void);
+}
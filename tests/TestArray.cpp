@@ -0,0 +1,138 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "SoapyRTLSDR.hpp"
+#include "FakeRTLSDR.hpp"
+#include "TestCheck.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define READ_ELEMS 8192
+#define CALIBRATE_SAMPLES 262144
+
+//read the array and return the fraction of samples where compare(channel, i)
+//says sample i of the channel matches channel 0
+template <typename Compare>
+static double readMatching(SoapySDR::Device *dev, SoapySDR::Stream *stream, std::vector<void *> &buffs,
+    const size_t numSamples, const size_t channel, Compare compare)
+{
+    size_t same = 0, total = 0;
+    while (total < numSamples)
+    {
+        int flags = 0;
+        long long timeNs = 0;
+        const int ret = dev->readStream(stream, buffs.data(), READ_ELEMS, flags, timeNs, 1000000);
+        //the array realigns after an overflow, e.g. while calibrating
+        if (ret == SOAPY_SDR_OVERFLOW) continue;
+        TEST_CHECK(ret > 0);
+        if (ret <= 0) return 0.0;
+        for (int i = 0; i < ret; i++) if (compare(channel, i)) same++;
+        total += ret;
+    }
+    return double(same) / total;
+}
+
+int main(void)
+{
+    //three dongles see the bursts at different sample indexes and deliver
+    //their usb transfers late by different amounts
+    FakeRTLSDR::setDeviceCount(3);
+    FakeRTLSDR::setPattern(FakeRTLSDR::BURSTS);
+    FakeRTLSDR::setDelay(1, 37);
+    FakeRTLSDR::setDelay(2, 1500);
+    FakeRTLSDR::setTransferLatency(1, 2000);
+    FakeRTLSDR::setTransferLatency(2, 7000);
+
+    SoapySDR::Kwargs args;
+    args["serial"] = "00000001;00000002;00000003";
+    std::unique_ptr<SoapySDR::Device> dev(makeRTLSDRArray(args));
+    TEST_CHECK(dev->getNumChannels(SOAPY_SDR_RX) == 3);
+
+    //interleaved CS8, the channels only agree once the delays are measured
+    {
+        auto stream = dev->setupStream(SOAPY_SDR_RX, SOAPY_SDR_CS8);
+        std::vector<std::vector<int8_t>> data(3, std::vector<int8_t>(2 * READ_ELEMS));
+        std::vector<void *> buffs;
+        for (auto &d : data) buffs.push_back(d.data());
+        const auto same = [&](const size_t c, const int i)
+        {
+            return data[c][2 * i] == data[0][2 * i] and data[c][2 * i + 1] == data[0][2 * i + 1];
+        };
+        TEST_CHECK(dev->activateStream(stream) == 0);
+
+        TEST_CHECK(readMatching(dev.get(), stream, buffs, 4 * READ_ELEMS, 2, same) < 0.5);
+        dev->writeSetting("calibrate", std::to_string(CALIBRATE_SAMPLES));
+        readMatching(dev.get(), stream, buffs, CALIBRATE_SAMPLES, 2, same);
+        TEST_CHECK(dev->readSetting("calibrate") != "");
+        TEST_CHECK(readMatching(dev.get(), stream, buffs, 16 * READ_ELEMS, 1, same) > 0.99);
+        TEST_CHECK(readMatching(dev.get(), stream, buffs, 16 * READ_ELEMS, 2, same) > 0.99);
+
+        //one measured delay per channel, the injected ones plus the start skew
+        long long d0 = 0, d1 = 0, d2 = 0;
+        TEST_CHECK(std::sscanf(dev->readSetting("delays").c_str(), "%lld;%lld;%lld", &d0, &d1, &d2) == 3);
+        TEST_CHECK(d0 == 0);
+
+        //the swap of one dongle applies in its conversion
+        dev->writeSetting(SOAPY_SDR_RX, 1, "iq_swap", "true");
+        const auto swapped = [&](const size_t c, const int i)
+        {
+            return data[c][2 * i] == data[0][2 * i + 1] and data[c][2 * i + 1] == data[0][2 * i];
+        };
+        readMatching(dev.get(), stream, buffs, 2 * READ_ELEMS, 1, swapped);
+        TEST_CHECK(readMatching(dev.get(), stream, buffs, 8 * READ_ELEMS, 1, swapped) > 0.99);
+        dev->writeSetting(SOAPY_SDR_RX, 1, "iq_swap", "false");
+
+        dev->deactivateStream(stream);
+        dev->closeStream(stream);
+    }
+
+    //planar CS16 writes I and Q of channel c to buffs[2c] and buffs[2c+1]
+    {
+        SoapySDR::Kwargs streamArgs;
+        streamArgs["layout"] = "planar";
+        auto stream = dev->setupStream(SOAPY_SDR_RX, SOAPY_SDR_CS16, std::vector<size_t>(), streamArgs);
+        std::vector<std::vector<int16_t>> data(6, std::vector<int16_t>(READ_ELEMS));
+        std::vector<void *> buffs;
+        for (auto &d : data) buffs.push_back(d.data());
+        const auto same = [&](const size_t c, const int i)
+        {
+            return data[2 * c][i] == data[0][i] and data[2 * c + 1][i] == data[1][i];
+        };
+        TEST_CHECK(dev->activateStream(stream) == 0);
+
+        //the start skew changes with every activation
+        dev->writeSetting("calibrate", std::to_string(CALIBRATE_SAMPLES));
+        readMatching(dev.get(), stream, buffs, CALIBRATE_SAMPLES, 2, same);
+        TEST_CHECK(readMatching(dev.get(), stream, buffs, 16 * READ_ELEMS, 1, same) > 0.95);
+        TEST_CHECK(readMatching(dev.get(), stream, buffs, 16 * READ_ELEMS, 2, same) > 0.95);
+
+        dev->deactivateStream(stream);
+        dev->closeStream(stream);
+    }
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,215 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include "TestCheck.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define STANDIN_BYTES_PER_SEC 2000000
+#define STANDIN_BLOCK 8192
+
+/***********************************************************************
+ * An rtl_tcp stand-in on the loopback interface: sends the header of
+ * an R820T, records the commands and streams samples i = n & 0xff with
+ * q = 255 - i until the first frequency change and q = i after it.
+ **********************************************************************/
+class RtlTcpStandIn
+{
+public:
+    RtlTcpStandIn(void):
+        _listener(socket(AF_INET, SOCK_STREAM, 0)),
+        _client(-1),
+        _done(false),
+        _retuned(false),
+        _switched(false)
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(_listener, (sockaddr *)&addr, sizeof(addr));
+        listen(_listener, 1);
+        socklen_t len = sizeof(addr);
+        getsockname(_listener, (sockaddr *)&addr, &len);
+        _port = ntohs(addr.sin_port);
+        _writer = std::thread(&RtlTcpStandIn::stream, this);
+    }
+
+    ~RtlTcpStandIn(void)
+    {
+        _done = true;
+        shutdown(_listener, SHUT_RDWR);
+        if (_client >= 0) shutdown(_client, SHUT_RDWR);
+        _writer.join();
+        if (_reader.joinable()) _reader.join();
+        if (_client >= 0) close(_client);
+        close(_listener);
+    }
+
+    std::string address(void) const
+    {
+        return "127.0.0.1:" + std::to_string(_port);
+    }
+
+    std::vector<std::pair<uint8_t, uint32_t>> commands(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _commands;
+    }
+
+    //true once every sample before the retune is in the socket
+    bool switched(void) const
+    {
+        return _switched;
+    }
+
+private:
+    void stream(void)
+    {
+        _client = accept(_listener, nullptr, nullptr);
+        if (_client < 0) return;
+        const unsigned char header[12] = {'R', 'T', 'L', '0', 0, 0, 0, RTLSDR_TUNER_R820T, 0, 0, 0, 29};
+        send(_client, header, sizeof(header), MSG_NOSIGNAL);
+        _reader = std::thread(&RtlTcpStandIn::receive, this);
+
+        std::vector<unsigned char> block(STANDIN_BLOCK);
+        unsigned long long n = 0;
+        auto next = std::chrono::steady_clock::now();
+        while (not _done)
+        {
+            const bool retuned = _retuned;
+            for (size_t i = 0; i < block.size(); i += 2, n++)
+            {
+                block[i] = (unsigned char)(n & 0xff);
+                block[i + 1] = retuned ? block[i] : 255 - block[i];
+            }
+            if (retuned) _switched = true;
+            if (send(_client, block.data(), block.size(), MSG_NOSIGNAL) <= 0) return;
+            next += std::chrono::microseconds(1000000LL * STANDIN_BLOCK / STANDIN_BYTES_PER_SEC);
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    void receive(void)
+    {
+        unsigned char msg[5];
+        while (recv(_client, msg, sizeof(msg), MSG_WAITALL) == sizeof(msg))
+        {
+            const uint32_t param = (uint32_t(msg[1]) << 24) | (uint32_t(msg[2]) << 16) | (uint32_t(msg[3]) << 8) | msg[4];
+            std::lock_guard<std::mutex> lock(_mutex);
+            _commands.push_back(std::make_pair(msg[0], param));
+            if (msg[0] == RTLTCP_SET_FREQ) _retuned = true;
+        }
+    }
+
+    int _listener, _client;
+    unsigned short _port;
+    std::atomic<bool> _done, _retuned, _switched;
+    std::thread _writer, _reader;
+    std::mutex _mutex;
+    std::vector<std::pair<uint8_t, uint32_t>> _commands;
+};
+
+template <typename Pred>
+static bool waitFor(Pred pred)
+{
+    const auto exit = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (not pred())
+    {
+        if (std::chrono::steady_clock::now() > exit) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+//samples of buf follow the counter from its first one, q matches the generation
+static bool counterPattern(const std::vector<unsigned char> &buf, const size_t len, const bool retuned)
+{
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        if (buf[i] != (unsigned char)(buf[0] + i / 2)) return false;
+        if (buf[i + 1] != (retuned ? buf[i] : 255 - buf[i])) return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    RtlTcpStandIn standIn;
+    SoapyRTLSDRTcpClient client(standIn.address());
+
+    //the header announces the tuner
+    TEST_CHECK(client.tunerType() == RTLSDR_TUNER_R820T);
+    TEST_CHECK(client.tunerGains().size() == 29);
+
+    //the setters reach the server as commands
+    TEST_CHECK(client.setSampleRate(1024000) == 0);
+    TEST_CHECK(client.setGainMode(true) == 0);
+    TEST_CHECK(client.setGain(200) == 0);
+    TEST_CHECK(client.setIFGain(2, 30) == 0);
+    TEST_CHECK(client.setBandwidth(0) == 0);
+    TEST_CHECK(client.setBandwidth(1000000) != 0);
+    TEST_CHECK(client.getSampleRate() == 1024000);
+    TEST_CHECK(waitFor([&]{return standIn.commands().size() == 4;}));
+    const auto commands = standIn.commands();
+    TEST_CHECK(commands.size() == 4);
+    if (commands.size() == 4)
+    {
+        TEST_CHECK(commands[0] == std::make_pair(uint8_t(RTLTCP_SET_SAMPLE_RATE), uint32_t(1024000)));
+        TEST_CHECK(commands[1] == std::make_pair(uint8_t(RTLTCP_SET_GAIN_MODE), uint32_t(1)));
+        TEST_CHECK(commands[2] == std::make_pair(uint8_t(RTLTCP_SET_GAIN), uint32_t(200)));
+        TEST_CHECK(commands[3] == std::make_pair(uint8_t(RTLTCP_SET_IF_GAIN), uint32_t((2 << 16) | 30)));
+    }
+
+    //whole buffers of a continuous stream, an odd length leaves half a sample behind
+    std::vector<unsigned char> buf(65536);
+    TEST_CHECK(client.read(buf.data(), buf.size()) == long(buf.size()));
+    TEST_CHECK(counterPattern(buf, buf.size(), false));
+    TEST_CHECK(client.read(buf.data(), 1001) == 1001);
+
+    //stop like deactivateStream, the server keeps sending while the client retunes
+    client.cancel();
+    TEST_CHECK(client.read(buf.data(), buf.size()) == 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    TEST_CHECK(client.setFrequency(433920000) == 0);
+    TEST_CHECK(client.getFrequency() == 433920000);
+    TEST_CHECK(waitFor([&]{return standIn.switched();}));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    //the restart drops the samples from before the retune and stays aligned
+    client.reset();
+    TEST_CHECK(client.read(buf.data(), buf.size()) == long(buf.size()));
+    TEST_CHECK(counterPattern(buf, buf.size(), true));
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,176 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Charles J. Cliffe
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SoapyRTLSDR.hpp"
+#include "TestCheck.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PUSH_BLOCK 16384
+#define PUSH_BLOCKS 512
+#define QUEUE_BYTES (256 * 1024)
+
+//a port nobody listens on right now
+static unsigned short freePort(void)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (sockaddr *)&addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *)&addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static int connectTo(const unsigned short port, const int rcvbuf)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (rcvbuf != 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) return -1;
+    return fd;
+}
+
+static std::string localPeer(const int fd)
+{
+    sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *)&addr, &len);
+    return "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+}
+
+//sent and dropped bytes of one peer in the clients() report
+static bool clientStats(const std::string &report, const std::string &peer, unsigned long long &sent, unsigned long long &dropped)
+{
+    const size_t pos = report.find(peer + ":");
+    if (pos == std::string::npos) return false;
+    return std::sscanf(report.c_str() + pos + peer.size(), ":%llu:%llu", &sent, &dropped) == 2;
+}
+
+static bool readAll(const int fd, unsigned char *buf, const size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        const ssize_t ret = recv(fd, buf + got, len - got, 0);
+        if (ret <= 0) return false;
+        got += ret;
+    }
+    return true;
+}
+
+static void checkHeader(const int fd)
+{
+    unsigned char header[12];
+    TEST_CHECK(readAll(fd, header, sizeof(header)));
+    TEST_CHECK(std::string((const char *)header, 4) == "RTL0");
+    TEST_CHECK(header[7] == RTLSDR_TUNER_R820T);
+    TEST_CHECK(header[11] == 29);
+}
+
+int main(void)
+{
+    const unsigned short port = freePort();
+    SoapyRTLSDRTcpServer server("127.0.0.1:" + std::to_string(port), QUEUE_BYTES, RTLSDR_TUNER_R820T, 29);
+
+    //the slow client never reads after the header and has a tiny socket buffer
+    const int fast = connectTo(port, 0);
+    const int slow = connectTo(port, 4096);
+    TEST_CHECK(fast >= 0 and slow >= 0);
+    if (fast < 0 or slow < 0) return TEST_RESULT();
+    checkHeader(fast);
+    checkHeader(slow);
+    const auto report = [&](void){return server.clients();};
+    for (int i = 0; i < 1000 and report().find(localPeer(slow)) == std::string::npos; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    //the fast client checks the whole stream while the rx side pushes
+    const size_t total = size_t(PUSH_BLOCK) * PUSH_BLOCKS;
+    std::atomic<size_t> received(0), errors(0);
+    std::thread reader([&](void)
+    {
+        std::vector<unsigned char> buf(65536);
+        while (received < total)
+        {
+            const ssize_t ret = recv(fast, buf.data(), buf.size(), 0);
+            if (ret <= 0) break;
+            for (ssize_t i = 0; i < ret; i++)
+            {
+                const size_t n = received + i;
+                const unsigned char expected = (n % 2 == 0) ? (unsigned char)(n / 2) : 255 - (unsigned char)(n / 2);
+                if (buf[i] != expected) errors++;
+            }
+            received += ret;
+        }
+    });
+
+    std::vector<unsigned char> block(PUSH_BLOCK);
+    for (size_t b = 0, n = 0; b < PUSH_BLOCKS; b++)
+    {
+        for (size_t i = 0; i < block.size(); i += 2, n++)
+        {
+            block[i] = (unsigned char)(n & 0xff);
+            block[i + 1] = 255 - block[i];
+        }
+        server.push(block.data(), block.size());
+
+        //a rate change halfway through, the stream stays continuous
+        if (b == PUSH_BLOCKS / 2) server.resize(2 * QUEUE_BYTES);
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    reader.join();
+    TEST_CHECK(server.queueBytes() == 2 * QUEUE_BYTES);
+
+    //the fast client got everything, the slow one was trimmed
+    TEST_CHECK(received == total);
+    TEST_CHECK(errors == 0);
+    unsigned long long sent = 0, dropped = 0;
+    TEST_CHECK(clientStats(report(), localPeer(fast), sent, dropped));
+    TEST_CHECK(sent == total and dropped == 0);
+    TEST_CHECK(clientStats(report(), localPeer(slow), sent, dropped));
+    TEST_CHECK(sent < total and dropped > 0);
+
+    //what the slow client does get is still whole samples
+    std::vector<unsigned char> buf(4096);
+    TEST_CHECK(readAll(slow, buf.data(), buf.size()));
+    for (size_t i = 0; i < buf.size(); i += 2) TEST_CHECK(buf[i + 1] == 255 - buf[i]);
+
+    close(fast);
+    close(slow);
+    return TEST_RESULT();
+}